@@ -0,0 +1,23 @@
+#include "iotHubLib.h"
+
+// to init iothublib use syntax like <sensors,actors>,
+// where sensors specifies number of sensors being used on this node
+// and actors specifies the number of actors being used on this node
+// the two arguments in the () are the hostname of the server and the port iothub is available on
+iotHubLib<1,0> iothub("linserver",3000); // note lack of http:// prefix, do not add one
+
+// deep sleep restarts the sketch on every wake, so setup() runs each time, GPIO16 must be wired to RST
+float read_battery() {
+  return analogRead(A0);
+}
+
+void setup() {
+  // wake every 5 minutes, readings are kept in RTC memory and uploaded at least once an hour
+  iothub.EnableDeepSleep(300000, 3600000);
+  iothub.Start();
+  iothub.RegisterSensor("Battery Level","number",read_battery,300000);
+}
+
+void loop() {
+  iothub.Tick(); // samples, uploads if due, then deep sleeps, this never returns
+}
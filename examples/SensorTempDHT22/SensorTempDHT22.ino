@@ -11,16 +11,22 @@ iotHubLib<2,0> iothub("linserver",3000); // note lack of http:// prefix, do not
 DHT dht_0(5, DHT22);
 DHT dht_1(4, DHT22);
 
+// these callbacks are run by Tick() whenever the sensor is due to be sampled
+float read_dht_0() {
+  return dht_0.readTemperature();
+}
+float read_dht_1() {
+  return dht_1.readTemperature();
+}
+
 void setup() {
   iothub.Start();
 
-  // add sensors
-  iothub.RegisterSensor("Temperature Sensor 1","number");
-  iothub.RegisterSensor("Temperature Sensor 2","number");
+  // add sensors with how often they should be sampled in ms, each sensor can have its own period
+  iothub.RegisterSensor("Temperature Sensor 1","number",read_dht_0,120000);
+  iothub.RegisterSensor("Temperature Sensor 2","number",read_dht_1,60000);
 }
 
 void loop() {
-  iothub.Send(0, dht_0.readTemperature() );
-  iothub.Send(1, dht_1.readTemperature() );
-  iothub.Tick();
+  iothub.Tick(); // samples and sends whichever sensors are due, then waits for the next one
 }
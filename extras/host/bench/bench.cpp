@@ -0,0 +1,252 @@
+// Benchmarks of the library's hot paths on the host build, reporting wall time and heap allocations per operation.
+// Time spent in the stand-in hub and the fakes' PlatformScopes is left out, as are their allocations. Host times are
+// only useful for comparing changes, a board is one to two orders of magnitude slower
+#include "support.h"
+#include "stand_in_hub.h"
+
+#include <chrono>
+#include <stdio.h>
+
+// accumulates the library's time and allocations over the timed parts of a benchmark
+class Stopwatch {
+public:
+  void Start() {
+    allocations_at_start = host::Allocations();
+    platform_ns_at_start = host::PlatformNanos();
+    started = std::chrono::steady_clock::now();
+  }
+  void Stop() {
+    elapsed += std::chrono::steady_clock::now() - started;
+    platform_ns += host::PlatformNanos() - platform_ns_at_start;
+    allocations += host::Allocations() - allocations_at_start;
+  }
+  void Report(const char* name, uint64_t ops, const char* extra = "") const {
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() - platform_ns;
+    printf("%-44s %10.0f ns/op %8.2f allocs/op%s\n", name, ns / ops, (double)allocations / ops, extra);
+  }
+
+private:
+  std::chrono::steady_clock::time_point started;
+  std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::duration::zero();
+  uint64_t platform_ns_at_start = 0;
+  uint64_t platform_ns = 0;
+  uint64_t allocations_at_start = 0;
+  uint64_t allocations = 0;
+};
+
+static void StartSensorNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Benchmark Sensor", "number");
+}
+
+static void IntActorChanged(int) {}
+static void FloatActorChanged(float) {}
+
+static const char* actor_names[] = {
+  "Benchmark Actor 0", "Benchmark Actor 1", "Benchmark Actor 2", "Benchmark Actor 3",
+  "Benchmark Actor 4", "Benchmark Actor 5", "Benchmark Actor 6", "Benchmark Actor 7"
+};
+
+static void RegisterBenchActor(iotHubLib<0,8>& iothub, uint index) {
+  if (index % 2 == 0) {
+    iothub.RegisterActor(actor_names[index], IntActorChanged);
+  } else {
+    iothub.RegisterActor(actor_names[index], FloatActorChanged);
+  }
+}
+
+static void StartActorNode(iotHubLib<0,8>& iothub) {
+  iothub.Start();
+  for (uint i = 0; i < 8; i++) {
+    RegisterBenchActor(iothub, i);
+  }
+}
+
+// Send() of a reading that is only queued, the queue is flushed outside the timed part whenever it fills
+static void BenchSendQueued(uint64_t ops) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(reading_queue_length, 0, 0);
+  Stopwatch stopwatch;
+  for (uint64_t i = 0; i < ops; i++) {
+    if (iothub.QueuedReadings() == reading_queue_length - 1) iothub.Flush();
+    stopwatch.Start();
+    iothub.Send(0, 20.0 + (i % 100) * 0.125);
+    stopwatch.Stop();
+    board.node.Advance(1000);
+  }
+  stopwatch.Report("Send() queued", ops);
+}
+
+// Send() with the default flush count of one, timed until the hub has answered the upload
+static void BenchSendUpload(uint64_t ops) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(1, 0, 0);
+  Stopwatch stopwatch;
+  for (uint64_t i = 0; i < ops; i++) {
+    stopwatch.Start();
+    iothub.Send(0, 20.0 + (i % 100) * 0.125);
+    iothub.Tick(); // a sensor only node waits there for the upload Send() started
+    stopwatch.Stop();
+    hub.Clear();
+  }
+  stopwatch.Report("Send() uploading one reading", ops);
+}
+
+// Flush() of a full batch, waiting for the hub, with the body size it was encoded to
+static void BenchFlushBatch(const char* name, iothub_encoding encoding, uint64_t ops) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(reading_queue_length, 0, 0);
+  iothub.SetEncoding(encoding);
+  Stopwatch stopwatch;
+  uint64_t body_bytes = 0;
+  for (uint64_t i = 0; i < ops; i++) {
+    for (uint j = 0; j < reading_queue_length - 1; j++) {
+      iothub.Send(0, 20.0 + j * 0.125);
+      board.node.Advance(1000);
+    }
+    stopwatch.Start();
+    iothub.Flush();
+    stopwatch.Stop();
+    for (const StandInHub::request& upload : hub.requests) body_bytes += upload.body.size();
+    hub.Clear();
+  }
+  char bytes[32];
+  snprintf(bytes, sizeof(bytes), " %8.0f body bytes", (double)body_bytes / ops);
+  stopwatch.Report(name, ops, bytes);
+}
+
+// one request to the actor server, from the connection being accepted to the response being sent
+static void BenchServe(const char* name, Board<iotHubLib<0,8>>& board, const std::string& request, uint64_t ops) {
+  Stopwatch stopwatch;
+  for (uint64_t i = 0; i < ops; i++) {
+    stopwatch.Start();
+    std::string response = Serve(board, request);
+    stopwatch.Stop();
+    if (ResponseStatus(response) != 200) {
+      printf("%s failed: %s\n", name, response.c_str());
+      return;
+    }
+  }
+  stopwatch.Report(name, ops);
+}
+
+static void BenchActorServer(uint64_t ops) {
+  StandInHub hub;
+  Board<iotHubLib<0,8>> board(StartActorNode);
+  board.Boot();
+  std::string id = hub.IdOf("Benchmark Actor 0", 'a');
+  std::string body = "{\"state\":42}";
+
+  BenchServe("GET /actors", board, "GET /actors HTTP/1.1\r\nHost: node\r\n\r\n", ops);
+  BenchServe("GET /actors/:id", board, "GET /actors/" + id + " HTTP/1.1\r\nHost: node\r\n\r\n", ops);
+  BenchServe("POST /actors/:id", board, "POST /actors/" + id + " HTTP/1.1\r\nHost: node\r\n"
+  "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body, ops);
+}
+
+// Boots of a node whose ids are all stored. Declaring the first seven actors loads and checks the id store then reads
+// each of their ids from it, declaring the last validates every stored id with the hub in one request
+static void BenchIdStoreRead(uint64_t ops) {
+  StandInHub hub;
+  Stopwatch read, validate;
+  Board<iotHubLib<0,8>> board([&](iotHubLib<0,8>& iothub) {
+    iothub.Start();
+    read.Start();
+    for (uint i = 0; i < 7; i++) {
+      RegisterBenchActor(iothub, i);
+    }
+    read.Stop();
+    validate.Start();
+    RegisterBenchActor(iothub, 7);
+    validate.Stop();
+  });
+  board.Boot(); // registers and stores the ids, untimed as no stopwatch has been started
+  read = Stopwatch();
+  validate = Stopwatch();
+  for (uint64_t i = 0; i < ops; i++) {
+    board.Boot();
+    hub.Clear();
+  }
+  read.Report("id store load and 7 reads", ops);
+  validate.Report("id store validation of 8 ids", ops);
+}
+
+// Boots of a node with an empty id store, declaring the last actor registers all eight and saves their ids with one
+// EEPROM commit
+static void BenchIdStoreWrite(uint64_t ops) {
+  StandInHub hub;
+  Stopwatch stopwatch;
+  Board<iotHubLib<0,8>> board([&](iotHubLib<0,8>& iothub) {
+    iothub.Start();
+    for (uint i = 0; i < 7; i++) {
+      RegisterBenchActor(iothub, i);
+    }
+    stopwatch.Start();
+    RegisterBenchActor(iothub, 7);
+    stopwatch.Stop();
+  });
+  board.Boot();
+  stopwatch = Stopwatch();
+  for (uint64_t i = 0; i < ops; i++) {
+    board.lib().ClearEeprom();
+    board.Boot();
+    hub.Clear();
+  }
+  stopwatch.Report("registration and id store write of 8 ids", ops);
+}
+
+// the actor lookup on its own, by ids of the node's actors and by one no actor has
+static void BenchFindActor(uint64_t ops) {
+  StandInHub hub;
+  Board<iotHubLib<0,8>> board(StartActorNode);
+  board.Boot();
+  std::vector<std::string> ids;
+  for (uint i = 0; i < 8; i++) {
+    ids.push_back(hub.IdOf(actor_names[i], 'a'));
+  }
+  iotHubLib<0,8>& iothub = board.lib();
+
+  Stopwatch found_stopwatch;
+  uint64_t found = 0;
+  found_stopwatch.Start();
+  for (uint64_t i = 0; i < ops; i++) {
+    found += iothub.HasActor(ids[i % 8].c_str());
+  }
+  found_stopwatch.Stop();
+  Stopwatch missing_stopwatch;
+  uint64_t missing = 0;
+  missing_stopwatch.Start();
+  for (uint64_t i = 0; i < ops; i++) {
+    missing += !iothub.HasActor("0123456789abcdef01234567");
+  }
+  missing_stopwatch.Stop();
+  if (found != ops || missing != ops) {
+    printf("FindActor() found %llu of %llu actors\n", (unsigned long long)found, (unsigned long long)ops);
+    return;
+  }
+  found_stopwatch.Report("FindActor() of an actor", ops);
+  missing_stopwatch.Report("FindActor() of an unknown id", ops);
+}
+
+// the optional argument scales how many operations each benchmark runs
+int main(int argc, char** argv) {
+  uint64_t scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  if (scale == 0) scale = 1;
+  BenchSendQueued(100000 * scale);
+  BenchSendUpload(10000 * scale);
+  BenchFlushBatch("Flush() of a batch of 19", encoding_json, 2000 * scale);
+  BenchFlushBatch("Flush() of a batch of 19 as CBOR", encoding_cbor, 2000 * scale);
+  BenchActorServer(5000 * scale);
+  BenchIdStoreRead(2000 * scale);
+  BenchIdStoreWrite(2000 * scale);
+  BenchFindActor(10000000 * scale);
+  return 0;
+}
@@ -0,0 +1,87 @@
+// Times the actor server and uploads at one log level, the Makefile builds this once per IOTHUB_LOG_LEVEL. Besides the
+// host time it reports how many bytes were logged per operation and how long the operation took on the node's virtual
+// clock. The fake Serial blocks as a board's does once its 128 byte FIFO is full at 115200 baud, so that time is
+// mostly the wait for the UART, the same thing LastRequestMicros() shows on hardware. Requests are served back to
+// back, a few ms apart, so a level that logs more than the UART sends in that time keeps it full
+#include "support.h"
+#include "stand_in_hub.h"
+
+#include <chrono>
+#include <stdio.h>
+
+static const char* LevelName() {
+  switch (IOTHUB_LOG_LEVEL) {
+    case IOTHUB_LOG_NONE: return "none";
+    case IOTHUB_LOG_ERROR: return "error";
+    case IOTHUB_LOG_WARN: return "warn";
+    case IOTHUB_LOG_INFO: return "info";
+    default: return "debug";
+  }
+}
+
+static void Report(const char* name, std::chrono::steady_clock::duration elapsed, uint64_t serial_bytes,
+uint64_t board_us, uint64_t ops) {
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+  printf("%-6s %-20s %9.0f ns/op %8.1f serial bytes/op %9.1f board us/op\n", LevelName(), name, ns,
+  (double)serial_bytes / ops, (double)board_us / ops);
+}
+
+static void IntActorChanged(int) {}
+
+static void StartActorNode(iotHubLib<0,2>& iothub) {
+  iothub.Start();
+  iothub.RegisterActor("Log Level Actor 0", IntActorChanged);
+  iothub.RegisterActor("Log Level Actor 1", IntActorChanged);
+}
+
+static void StartSensorNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Log Level Sensor", "number");
+}
+
+// the board time is how long the library took over each request by its own measure
+static void BenchServe(const char* name, Board<iotHubLib<0,2>>& board, const std::string& request, uint64_t ops) {
+  uint64_t serial_before = board.node.serial_bytes;
+  uint64_t board_us = 0;
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < ops; i++) {
+    Serve(board, request);
+    board_us += board.lib().LastRequestMicros();
+  }
+  Report(name, std::chrono::steady_clock::now() - started, board.node.serial_bytes - serial_before, board_us, ops);
+}
+
+int main(int argc, char** argv) {
+  uint64_t scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  if (scale == 0) scale = 1;
+  StandInHub hub;
+
+  Board<iotHubLib<0,2>> actor_node(StartActorNode);
+  actor_node.Boot();
+  std::string id = hub.IdOf("Log Level Actor 0", 'a');
+  std::string body = "{\"state\":42}";
+  BenchServe("GET /actors", actor_node, "GET /actors HTTP/1.1\r\nHost: node\r\n\r\n", 5000 * scale);
+  BenchServe("GET /actors/:id", actor_node, "GET /actors/" + id + " HTTP/1.1\r\nHost: node\r\n\r\n", 5000 * scale);
+  BenchServe("POST /actors/:id", actor_node, "POST /actors/" + id + " HTTP/1.1\r\nHost: node\r\n"
+  "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body, 5000 * scale);
+
+  Board<iotHubLib<1,0>> sensor_node(StartSensorNode);
+  sensor_node.Boot();
+  iotHubLib<1,0>& iothub = sensor_node.lib();
+  uint64_t ops = 10000 * scale;
+  uint64_t serial_before = sensor_node.node.serial_bytes;
+  uint64_t board_us = 0;
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < ops; i++) {
+    // Send() starts the upload, the board time leaves out the Tick() that waits for the hub and sleeps
+    uint64_t sent_at = sensor_node.node.clock_us;
+    iothub.Send(0, 20.0 + (i % 100) * 0.125);
+    board_us += sensor_node.node.clock_us - sent_at;
+    iothub.Tick();
+    sensor_node.node.uart_idle_us = 0; // the sleep in Tick() leaves the UART idle
+    hub.Clear();
+  }
+  Report("Send()", std::chrono::steady_clock::now() - started, sensor_node.node.serial_bytes - serial_before, board_us,
+  ops);
+  return 0;
+}
@@ -0,0 +1,256 @@
+#include "Arduino.h"
+#include "host.h"
+
+unsigned long millis() {
+  return host::Current().Micros() / 1000;
+}
+
+unsigned long micros() {
+  return host::Current().Micros();
+}
+
+// waiting is the only thing that moves a node's clock on its own
+void delay(unsigned long ms) {
+  host::Current().Advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  host::Current().Advance(us);
+}
+
+void yield() {}
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) {
+  return LOW;
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  while (size--) {
+    if (write(*buffer++) == 0) break;
+    written++;
+  }
+  return written;
+}
+
+size_t Print::print(const __FlashStringHelper* text) {
+  return print(reinterpret_cast<const char*>(text));
+}
+size_t Print::print(const String& text) {
+  return write((const uint8_t*)text.c_str(), text.length());
+}
+size_t Print::print(const char text[]) {
+  return write(text);
+}
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+size_t Print::print(unsigned char number, int base) {
+  return print((unsigned long)number, base);
+}
+size_t Print::print(int number, int base) {
+  return print((long)number, base);
+}
+size_t Print::print(unsigned int number, int base) {
+  return print((unsigned long)number, base);
+}
+size_t Print::print(long number, int base) {
+  return print((long long)number, base);
+}
+size_t Print::print(unsigned long number, int base) {
+  return print((unsigned long long)number, base);
+}
+size_t Print::print(long long number, int base) {
+  if (base == 0) return write((uint8_t)number);
+  if (base == 10 && number < 0) {
+    return print('-') + printNumber(-(unsigned long long)number, 10);
+  }
+  return printNumber(number, base);
+}
+size_t Print::print(unsigned long long number, int base) {
+  if (base == 0) return write((uint8_t)number);
+  return printNumber(number, base);
+}
+size_t Print::print(double number, int digits) {
+  return printFloat(number, digits);
+}
+size_t Print::print(const Printable& printable) {
+  return printable.printTo(*this);
+}
+
+size_t Print::println() {
+  return write("\r\n");
+}
+size_t Print::println(const __FlashStringHelper* text) {
+  return print(text) + println();
+}
+size_t Print::println(const String& text) {
+  return print(text) + println();
+}
+size_t Print::println(const char text[]) {
+  return print(text) + println();
+}
+size_t Print::println(char c) {
+  return print(c) + println();
+}
+size_t Print::println(unsigned char number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(int number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(unsigned int number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(long number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(unsigned long number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(long long number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(unsigned long long number, int base) {
+  return print(number, base) + println();
+}
+size_t Print::println(double number, int digits) {
+  return print(number, digits) + println();
+}
+size_t Print::println(const Printable& printable) {
+  return print(printable) + println();
+}
+
+size_t Print::printNumber(unsigned long long number, int base) {
+  char buffer[8 * sizeof(number) + 1];
+  char* digit = &buffer[sizeof(buffer) - 1];
+  *digit = 0;
+  if (base < 2) base = 10;
+  do {
+    char c = number % base;
+    number /= base;
+    *--digit = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (number);
+  return write(digit);
+}
+
+// the core's float printing, including its "ovf" for anything it can't hold in 32 bits
+size_t Print::printFloat(double number, int digits) {
+  if (isnan(number)) return print("nan");
+  if (isinf(number)) return print("inf");
+  if (number > 4294967040.0) return print("ovf");
+  if (number < -4294967040.0) return print("ovf");
+
+  size_t written = 0;
+  if (number < 0.0) {
+    written += print('-');
+    number = -number;
+  }
+  double rounding = 0.5;
+  for (int i = 0; i < digits; i++) rounding /= 10.0;
+  number += rounding;
+
+  unsigned long int_part = (unsigned long)number;
+  double remainder = number - (double)int_part;
+  written += print(int_part);
+  if (digits > 0) written += print('.');
+  while (digits-- > 0) {
+    remainder *= 10.0;
+    int to_print = (int)remainder;
+    written += print(to_print);
+    remainder -= to_print;
+  }
+  return written;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c < 0) break;
+    *buffer++ = (char)c;
+    count++;
+  }
+  return count;
+}
+
+HardwareSerial Serial;
+
+void HardwareSerial::begin(unsigned long baud) {
+  host::Current().serial_baud = baud;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  host::PlatformScope platform;
+  host::Node& node = host::Current();
+  node.serial_bytes += size;
+  uint64_t baud = node.serial_baud;
+  if (baud > 0) {
+    // the UART sends 10 bits a byte, a write only waits once more than its 128 byte FIFO is queued
+    uint64_t now = node.clock_us;
+    if (node.uart_idle_us < now) node.uart_idle_us = now;
+    node.uart_idle_us += (size * 10000000 + baud / 2) / baud;
+    uint64_t fifo_us = (128 * 10000000 + baud / 2) / baud;
+    if (node.uart_idle_us > now + fifo_us) node.Advance(node.uart_idle_us - fifo_us - now);
+  }
+  if (node.capture_serial) node.serial.append((const char*)buffer, size);
+  if (node.echo_serial) fwrite(buffer, 1, size, stdout);
+  return size;
+}
+
+String IPAddress::toString() const {
+  host::PlatformScope platform;
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(text);
+}
+
+size_t IPAddress::printTo(Print& out) const {
+  size_t written = 0;
+  for (int i = 0; i < 4; i++) {
+    if (i > 0) written += out.print('.');
+    written += out.print((*this)[i], DEC);
+  }
+  return written;
+}
+
+EspClass ESP;
+
+void EspClass::restart() {
+  throw host::Restart();
+}
+
+void EspClass::deepSleep(uint64_t time_us, RFMode mode) {
+  host::Current().deep_sleeps++;
+  host::Current().radio_at_boot = mode != RF_DISABLED;
+  throw host::DeepSleep{time_us, mode != RF_DISABLED};
+}
+
+uint32_t EspClass::getChipId() {
+  return host::Current().chip_id;
+}
+
+uint32_t EspClass::random() {
+  uint64_t& state = host::Current().random_state;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (uint32_t)(state >> 16);
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+  if (offset > 127 || offset * 4 + size > 512 || size == 0) return false;
+  memcpy(data, (uint8_t*)host::Current().rtc + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+  if (offset > 127 || offset * 4 + size > 512 || size == 0) return false;
+  memcpy((uint8_t*)host::Current().rtc + offset * 4, data, size);
+  return true;
+}
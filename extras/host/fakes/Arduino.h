@@ -0,0 +1,191 @@
+#ifndef IOTHUB_HOST_ARDUINO_H
+#define IOTHUB_HOST_ARDUINO_H
+
+// the parts of the ESP8266 Arduino core the library uses, with the core's semantics, running on a host::Node
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string>
+
+typedef unsigned int uint;
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(string_literal))
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+class String {
+public:
+  String(const char* value = "") : value(value == nullptr ? "" : value) {}
+  String(const std::string& value) : value(value) {}
+  explicit String(char c) : value(1, c) {}
+  explicit String(int number) : value(std::to_string(number)) {}
+  explicit String(unsigned int number) : value(std::to_string(number)) {}
+  explicit String(long number) : value(std::to_string(number)) {}
+  explicit String(unsigned long number) : value(std::to_string(number)) {}
+  const char* c_str() const { return value.c_str(); }
+  unsigned int length() const { return value.size(); }
+  bool reserve(unsigned int size) { value.reserve(size); return true; }
+  bool concat(const char* more) { value += more; return true; }
+  bool concat(const String& more) { value += more.value; return true; }
+  String& operator+=(const char* more) { value += more; return *this; }
+  String& operator+=(const String& more) { value += more.value; return *this; }
+  String operator+(const char* more) const { return String(value + more); }
+  String operator+(const String& more) const { return String(value + more.value); }
+  bool operator==(const char* other) const { return value == other; }
+  bool operator==(const String& other) const { return value == other.value; }
+  char operator[](unsigned int index) const { return index < value.size() ? value[index] : 0; }
+
+private:
+  std::string value;
+};
+
+class Print;
+class Printable {
+public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print& out) const = 0;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  size_t write(const char* text) { return text == nullptr ? 0 : write((const uint8_t*)text, strlen(text)); }
+  size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper* text);
+  size_t print(const String& text);
+  size_t print(const char text[]);
+  size_t print(char c);
+  size_t print(unsigned char number, int base = DEC);
+  size_t print(int number, int base = DEC);
+  size_t print(unsigned int number, int base = DEC);
+  size_t print(long number, int base = DEC);
+  size_t print(unsigned long number, int base = DEC);
+  size_t print(long long number, int base = DEC);
+  size_t print(unsigned long long number, int base = DEC);
+  size_t print(double number, int digits = 2);
+  size_t print(const Printable& printable);
+
+  size_t println(const __FlashStringHelper* text);
+  size_t println(const String& text);
+  size_t println(const char text[]);
+  size_t println(char c);
+  size_t println(unsigned char number, int base = DEC);
+  size_t println(int number, int base = DEC);
+  size_t println(unsigned int number, int base = DEC);
+  size_t println(long number, int base = DEC);
+  size_t println(unsigned long number, int base = DEC);
+  size_t println(long long number, int base = DEC);
+  size_t println(unsigned long long number, int base = DEC);
+  size_t println(double number, int digits = 2);
+  size_t println(const Printable& printable);
+  size_t println();
+
+private:
+  size_t printNumber(unsigned long long number, int base);
+  size_t printFloat(double number, int digits);
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long timeout) { this->timeout = timeout; }
+  // only what has already arrived is read, a host test has no one to wait for
+  size_t readBytes(char* buffer, size_t length);
+  size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+
+protected:
+  unsigned long timeout = 1000;
+};
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud);
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  using Print::write;
+};
+extern HardwareSerial Serial;
+
+class IPAddress : public Printable {
+public:
+  IPAddress() : address(0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  IPAddress(uint32_t address) : address(address) {}
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int index) const { return address >> (index * 8); }
+  bool isSet() const { return address != 0; }
+  String toString() const;
+  size_t printTo(Print& out) const override;
+
+private:
+  uint32_t address; // first octet in the lowest byte, as the core keeps it
+};
+
+class Client : public Stream {
+public:
+  virtual int connect(const char* host, uint16_t port) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+  virtual operator bool() = 0;
+  virtual int read(uint8_t* buffer, size_t size) = 0;
+  using Stream::read;
+  using Print::write;
+};
+
+enum RFMode { RF_DEFAULT = 0, RF_CAL = 1, RF_NO_CAL = 2, RF_DISABLED = 4 };
+#define WAKE_RF_DEFAULT RF_DEFAULT
+#define WAKE_RFCAL RF_CAL
+#define WAKE_NO_RFCAL RF_NO_CAL
+#define WAKE_RF_DISABLED RF_DISABLED
+
+class EspClass {
+public:
+  [[noreturn]] void restart();
+  [[noreturn]] void deepSleep(uint64_t time_us, RFMode mode = RF_DEFAULT);
+  uint64_t deepSleepMax() { return 12000000000ull; }
+  uint32_t getChipId();
+  uint32_t random();
+  uint32_t getFreeHeap() { return 41000; }
+  uint32_t getMaxFreeBlockSize() { return 38000; }
+  uint8_t getHeapFragmentation() { return 7; }
+  // offset is in 4 byte blocks and size in bytes, as on the board
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+};
+extern EspClass ESP;
+
+#endif
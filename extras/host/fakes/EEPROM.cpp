@@ -0,0 +1,50 @@
+#include "EEPROM.h"
+#include "host.h"
+
+EEPROMClass EEPROM;
+
+// begin() reads the sector again, dropping anything written but not committed, as the core's does
+void EEPROMClass::begin(size_t size) {
+  host::PlatformScope platform;
+  host::Node& node = host::Current();
+  if (size == 0 || size > node.flash_eeprom.size()) return;
+  size = (size + 3) & ~3; // the core rounds up to whole words
+  node.eeprom.assign(node.flash_eeprom.begin(), node.flash_eeprom.begin() + size);
+  node.eeprom_dirty = false;
+}
+
+// addresses past the size passed to begin() read as zero and ignore writes
+uint8_t EEPROMClass::read(int address) {
+  host::Node& node = host::Current();
+  if (address < 0 || (size_t)address >= node.eeprom.size()) return 0;
+  return node.eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  host::Node& node = host::Current();
+  if (address < 0 || (size_t)address >= node.eeprom.size()) return;
+  if (node.eeprom[address] == value) return;
+  node.eeprom[address] = value;
+  node.eeprom_dirty = true;
+}
+
+// only rewrites the sector when something changed
+bool EEPROMClass::commit() {
+  host::Node& node = host::Current();
+  if (node.eeprom.empty()) return false;
+  if (!node.eeprom_dirty) return true;
+  std::copy(node.eeprom.begin(), node.eeprom.end(), node.flash_eeprom.begin());
+  node.eeprom_dirty = false;
+  node.eeprom_commits++;
+  return true;
+}
+
+void EEPROMClass::end() {
+  commit();
+  host::PlatformScope platform;
+  host::Current().eeprom.clear();
+}
+
+size_t EEPROMClass::length() {
+  return host::Current().eeprom.size();
+}
@@ -0,0 +1,18 @@
+#ifndef IOTHUB_HOST_EEPROM_H
+#define IOTHUB_HOST_EEPROM_H
+
+#include "Arduino.h"
+
+// a RAM copy of the node's EEPROM flash sector, as in the core nothing reaches flash until commit()
+class EEPROMClass {
+public:
+  void begin(size_t size);
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+  bool commit();
+  void end();
+  size_t length();
+};
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,271 @@
+#include "ESP8266WiFi.h"
+#include "host.h"
+
+using host::Connection;
+using host::Current;
+using host::network;
+
+WiFiClient::WiFiClient(const std::shared_ptr<Connection>& connection, bool server_end) :
+connection(connection), server_end(server_end) {}
+
+// blocks for the round trip as the core's connect does, or for the whole timeout when nothing answers
+int WiFiClient::connect(const char* host_name, uint16_t port) {
+  host::PlatformScope platform;
+  host::Node& node = Current();
+  stop();
+  if (!node.WifiConnected()) return 0;
+  host::Service* service = host::Find(host_name, port);
+  if (service == nullptr) {
+    node.Advance(network.connect_timeout_us);
+    return 0;
+  }
+  node.Advance(network.connect_us);
+  if (service->refusing) return 0;
+  connection = std::make_shared<Connection>();
+  connection->service = service;
+  connection->client_ip = node.ip;
+  server_end = false;
+  node.connections.push_back(connection);
+  service->Accepted(connection, node.clock_us);
+  return 1;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip.toString().c_str(), port);
+}
+
+uint8_t WiFiClient::connected() {
+  if (!connection) return 0;
+  host::Pipe& in = server_end ? connection->to_server : connection->to_client;
+  bool stopped = server_end ? connection->server_stopped : connection->client_stopped;
+  if (stopped) return 0;
+  uint64_t now = Current().clock_us;
+  // as on the board a connection the far end has closed still counts while there is data left to read
+  return !(in.closed && in.closed_us <= now) || in.Available(now) > 0;
+}
+
+void WiFiClient::stop() {
+  if (!connection) return;
+  host::PlatformScope platform;
+  uint64_t at = Current().clock_us + network.latency_us;
+  if (server_end) {
+    if (!connection->server_stopped) connection->to_client.Close(at);
+    connection->server_stopped = true;
+    connection->to_server.Clear();
+  } else {
+    bool was_open = !connection->client_stopped;
+    connection->to_server.Close(at);
+    connection->client_stopped = true;
+    connection->to_client.Clear();
+    if (was_open && connection->service != nullptr) connection->service->Closed(connection, at);
+  }
+  connection.reset();
+}
+
+WiFiClient::operator bool() {
+  return connected();
+}
+
+size_t WiFiClient::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+  if (!connected() || size == 0) return 0;
+  host::PlatformScope platform;
+  uint64_t arrival = Current().clock_us + network.latency_us;
+  host::Pipe& out = server_end ? connection->to_client : connection->to_server;
+  if (out.closed) return 0;
+  out.Write(buffer, size, arrival);
+  if (!server_end && connection->service != nullptr) {
+    std::shared_ptr<Connection> keep = connection; // the service may close it
+    keep->service->Received(keep, arrival);
+  }
+  return size;
+}
+
+int WiFiClient::available() {
+  if (!connection) return 0;
+  host::Pipe& in = server_end ? connection->to_server : connection->to_client;
+  return in.Available(Current().clock_us);
+}
+
+int WiFiClient::read() {
+  if (!connection) return -1;
+  host::Pipe& in = server_end ? connection->to_server : connection->to_client;
+  return in.Read(Current().clock_us);
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+  size_t count = 0;
+  while (count < size) {
+    int c = read();
+    if (c < 0) break;
+    buffer[count++] = (uint8_t)c;
+  }
+  return count;
+}
+
+int WiFiClient::peek() {
+  if (!connection) return -1;
+  host::Pipe& in = server_end ? connection->to_server : connection->to_client;
+  return in.Peek(Current().clock_us);
+}
+
+size_t WiFiClient::peekBytes(uint8_t* buffer, size_t length) {
+  if (!connection) return 0;
+  host::Pipe& in = server_end ? connection->to_server : connection->to_client;
+  return in.Peek(Current().clock_us, buffer, length);
+}
+
+void WiFiServer::begin() {
+  node = &Current();
+  host::PlatformScope platform;
+  node->listening.insert(port);
+}
+
+WiFiClient WiFiServer::available() {
+  if (node == nullptr || node->listening.count(port) == 0) return WiFiClient();
+  host::PlatformScope platform;
+  auto& backlog = node->backlog[port];
+  while (!backlog.empty()) {
+    std::shared_ptr<Connection> connection = backlog.front();
+    backlog.pop_front();
+    if (!connection->client_stopped || connection->to_server.Available(node->clock_us) > 0) {
+      return WiFiClient(connection, true);
+    }
+  }
+  return WiFiClient();
+}
+
+void WiFiServer::stop() {
+  if (node == nullptr) return;
+  host::PlatformScope platform;
+  node->listening.erase(port);
+  node->backlog.erase(port);
+}
+
+ESP8266WiFiClass WiFi;
+
+// drops the connection without touching the station config
+static void StopStation(host::Node& node) {
+  node.wifi_started = false;
+  node.wifi_reachable = false;
+}
+
+bool ESP8266WiFiClass::mode(WiFiMode_t mode) {
+  if (mode == WIFI_OFF) StopStation(Current());
+  return true;
+}
+
+// connects with the station config, only to its BSSID if one was set
+wl_status_t ESP8266WiFiClass::begin() {
+  host::Node& node = Current();
+  if (node.radio_sleeping) return WL_DISCONNECTED;
+  bool right_network = !node.station_ssid.empty() && node.station_ssid == network.ssid && node.station_psk == network.psk;
+  bool right_bssid = !node.station_bssid_set || memcmp(node.station_bssid, network.bssid, sizeof(network.bssid)) == 0;
+  node.wifi_started = true;
+  node.wifi_reachable = right_network && right_bssid && network.wifi_up;
+  // associating and getting a lease takes a scan, a static address only skips the DHCP part
+  node.wifi_ready_us = node.clock_us + network.wifi_scan_us;
+  node.wifi_connects++;
+  return status();
+}
+
+// as on the board the network and BSSID given are saved to the station config, a later begin() uses them again
+wl_status_t ESP8266WiFiClass::begin(const char* ssid, const char* passphrase, int32_t channel, const uint8_t* bssid, bool connect) {
+  host::Node& node = Current();
+  if (ssid == nullptr) return WL_CONNECT_FAILED;
+  node.station_ssid = ssid;
+  node.station_psk = passphrase == nullptr ? "" : passphrase;
+  node.station_bssid_set = bssid != nullptr;
+  if (bssid != nullptr) memcpy(node.station_bssid, bssid, sizeof(node.station_bssid));
+  if (node.radio_sleeping || !connect) return WL_DISCONNECTED;
+  bool cached = bssid != nullptr && memcmp(bssid, network.bssid, sizeof(network.bssid)) == 0 && channel == network.channel;
+  begin();
+  // going straight to a known access point skips the scan
+  if (cached) node.wifi_ready_us = node.clock_us + network.wifi_cached_us;
+  return status();
+}
+
+bool ESP8266WiFiClass::config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress) {
+  host::Node& node = Current();
+  node.static_ip = local_ip;
+  node.static_gateway = gateway;
+  node.static_subnet = subnet;
+  node.static_dns = dns1;
+  return true;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+  return Current().WifiConnected() ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// the core clears the station config as it disconnects, and saves that to flash by default
+bool ESP8266WiFiClass::disconnect(bool) {
+  host::Node& node = Current();
+  StopStation(node);
+  node.station_ssid.clear();
+  node.station_psk.clear();
+  return true;
+}
+
+bool ESP8266WiFiClass::forceSleepBegin(uint32_t) {
+  StopStation(Current());
+  Current().radio_sleeping = true;
+  return true;
+}
+
+bool ESP8266WiFiClass::forceSleepWake() {
+  Current().radio_sleeping = false;
+  return true;
+}
+
+IPAddress ESP8266WiFiClass::localIP() {
+  host::Node& node = Current();
+  if (!node.WifiConnected()) return IPAddress();
+  return node.static_ip != 0 ? node.static_ip : node.ip;
+}
+
+IPAddress ESP8266WiFiClass::gatewayIP() {
+  host::Node& node = Current();
+  if (!node.WifiConnected()) return IPAddress();
+  return node.static_gateway != 0 ? IPAddress(node.static_gateway) : IPAddress(192, 168, 0, 1);
+}
+
+IPAddress ESP8266WiFiClass::subnetMask() {
+  host::Node& node = Current();
+  if (!node.WifiConnected()) return IPAddress();
+  return node.static_subnet != 0 ? IPAddress(node.static_subnet) : IPAddress(255, 255, 0, 0);
+}
+
+IPAddress ESP8266WiFiClass::dnsIP(uint8_t) {
+  host::Node& node = Current();
+  if (!node.WifiConnected()) return IPAddress();
+  return node.static_dns != 0 ? IPAddress(node.static_dns) : IPAddress(192, 168, 0, 1);
+}
+
+uint8_t* ESP8266WiFiClass::BSSID() {
+  static uint8_t bssid[6];
+  if (Current().WifiConnected()) {
+    memcpy(bssid, network.bssid, sizeof(bssid));
+  } else {
+    memset(bssid, 0, sizeof(bssid));
+  }
+  return bssid;
+}
+
+int32_t ESP8266WiFiClass::channel() {
+  return Current().WifiConnected() ? network.channel : 0;
+}
+
+// the station config, kept in flash by the SDK whether or not it is connected
+String ESP8266WiFiClass::SSID() const {
+  host::PlatformScope platform;
+  return String(Current().station_ssid.c_str());
+}
+
+String ESP8266WiFiClass::psk() const {
+  host::PlatformScope platform;
+  return String(Current().station_psk.c_str());
+}
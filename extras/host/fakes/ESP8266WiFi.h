@@ -0,0 +1,84 @@
+#ifndef IOTHUB_HOST_ESP8266WIFI_H
+#define IOTHUB_HOST_ESP8266WIFI_H
+
+#include "Arduino.h"
+#include <memory>
+
+namespace host {
+struct Connection;
+struct Node;
+}
+
+enum wl_status_t {
+  WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL = 1, WL_SCAN_COMPLETED = 2, WL_CONNECTED = 3, WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5, WL_WRONG_PASSWORD = 6, WL_DISCONNECTED = 7
+};
+enum WiFiMode_t { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 };
+
+// a handle on one end of a host::Connection, copies share the connection as they share the socket on a board
+class WiFiClient : public Client {
+public:
+  WiFiClient() {}
+  WiFiClient(const std::shared_ptr<host::Connection>& connection, bool server_end);
+
+  int connect(const char* host, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port);
+  uint8_t connected() override;
+  void stop() override;
+  operator bool() override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buffer, size_t size) override;
+  int peek() override;
+  size_t peekBytes(uint8_t* buffer, size_t length);
+  size_t peekBytes(char* buffer, size_t length) { return peekBytes((uint8_t*)buffer, length); }
+  void setNoDelay(bool) {}
+  void flush() override {}
+  using Print::write;
+
+private:
+  std::shared_ptr<host::Connection> connection;
+  bool server_end = false;
+};
+
+class WiFiServer {
+public:
+  WiFiServer(uint16_t port) : port(port) {}
+  void begin();
+  WiFiClient available(); // the next connection waiting to be accepted, or a client that is false
+  void stop();
+
+private:
+  uint16_t port;
+  host::Node* node = nullptr;
+};
+
+class ESP8266WiFiClass {
+public:
+  bool mode(WiFiMode_t mode);
+  wl_status_t begin(); // with the network the node last connected to
+  wl_status_t begin(const char* ssid, const char* passphrase = nullptr, int32_t channel = 0, const uint8_t* bssid = nullptr,
+  bool connect = true);
+  bool config(IPAddress local_ip, IPAddress gateway, IPAddress subnet, IPAddress dns1 = (uint32_t)0,
+  IPAddress dns2 = (uint32_t)0);
+  wl_status_t status();
+  bool disconnect(bool wifioff = false);
+  bool persistent(bool) { return true; }
+  bool setAutoConnect(bool) { return true; }
+  bool forceSleepBegin(uint32_t sleep_us = 0);
+  bool forceSleepWake();
+
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(uint8_t index = 0);
+  uint8_t* BSSID();
+  int32_t channel();
+  String SSID() const;
+  String psk() const;
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,129 @@
+#include "LittleFS.h"
+#include "host.h"
+
+FS LittleFS;
+
+File::File(const std::shared_ptr<std::string>& contents, bool readable, bool writable, bool append, size_t position) {
+  host::PlatformScope platform;
+  open_file = std::make_shared<state>(state{contents, readable, writable, append, position});
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!open_file || !open_file->writable) return 0;
+  host::PlatformScope platform;
+  std::string& contents = *open_file->contents;
+  if (open_file->append) open_file->position = contents.size();
+  if (open_file->position > contents.size()) contents.resize(open_file->position, 0);
+  contents.replace(open_file->position, size, (const char*)buffer, size);
+  open_file->position += size;
+  return size;
+}
+
+int File::available() {
+  if (!open_file || !open_file->readable) return 0;
+  size_t length = open_file->contents->size();
+  return open_file->position < length ? length - open_file->position : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+  size_t left = available();
+  if (size > left) size = left;
+  if (size == 0) return 0;
+  memcpy(buffer, open_file->contents->data() + open_file->position, size);
+  open_file->position += size;
+  return size;
+}
+
+int File::peek() {
+  if (available() == 0) return -1;
+  return (uint8_t)(*open_file->contents)[open_file->position];
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  if (!open_file) return false;
+  long target = position;
+  if (mode == SeekCur) target += open_file->position;
+  if (mode == SeekEnd) target = open_file->contents->size() - position;
+  if (target < 0 || (size_t)target > open_file->contents->size()) return false;
+  open_file->position = target;
+  return true;
+}
+
+size_t File::position() const {
+  return open_file ? open_file->position : 0;
+}
+
+size_t File::size() const {
+  return open_file ? open_file->contents->size() : 0;
+}
+
+void File::close() {
+  host::PlatformScope platform;
+  open_file.reset();
+}
+
+File::operator bool() const {
+  return open_file != nullptr;
+}
+
+bool FS::begin() {
+  host::Node& node = host::Current();
+  node.filesystem_mounted = node.has_filesystem;
+  return node.filesystem_mounted;
+}
+
+void FS::end() {
+  host::Current().filesystem_mounted = false;
+}
+
+bool FS::format() {
+  host::PlatformScope platform;
+  host::Current().files.clear();
+  return true;
+}
+
+// the modes of fopen(), which is what the core's open() takes
+File FS::open(const char* path, const char* mode) {
+  if (!host::Current().filesystem_mounted) return File();
+  host::PlatformScope platform;
+  auto& files = host::Current().files;
+  auto found = files.find(path);
+  bool plus = strchr(mode, '+') != nullptr;
+  switch (mode[0]) {
+    case 'r':
+      if (found == files.end()) return File();
+      return File(found->second, true, plus, false, 0);
+    case 'w': {
+      std::shared_ptr<std::string>& contents = files[path];
+      if (!contents) contents = std::make_shared<std::string>();
+      contents->clear();
+      return File(contents, plus, true, false, 0);
+    }
+    case 'a': {
+      std::shared_ptr<std::string>& contents = files[path];
+      if (!contents) contents = std::make_shared<std::string>();
+      return File(contents, plus, true, true, contents->size());
+    }
+    default:
+      return File();
+  }
+}
+
+bool FS::exists(const char* path) {
+  host::PlatformScope platform;
+  return host::Current().filesystem_mounted && host::Current().files.count(path) > 0;
+}
+
+bool FS::remove(const char* path) {
+  host::PlatformScope platform;
+  return host::Current().filesystem_mounted && host::Current().files.erase(path) > 0;
+}
@@ -0,0 +1,50 @@
+#ifndef IOTHUB_HOST_LITTLEFS_H
+#define IOTHUB_HOST_LITTLEFS_H
+
+#include "Arduino.h"
+#include <memory>
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+// an open file on the node's in-memory filesystem, copies share the position as they do on a board
+class File : public Stream {
+public:
+  File() {}
+  File(const std::shared_ptr<std::string>& contents, bool readable, bool writable, bool append, size_t position);
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  size_t read(uint8_t* buffer, size_t size);
+  int peek() override;
+  bool seek(uint32_t position, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void close();
+  operator bool() const;
+  using Print::write;
+
+private:
+  struct state {
+    std::shared_ptr<std::string> contents;
+    bool readable;
+    bool writable;
+    bool append;
+    size_t position;
+  };
+  std::shared_ptr<state> open_file;
+};
+
+class FS {
+public:
+  bool begin();
+  void end();
+  bool format();
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  bool remove(const char* path);
+};
+extern FS LittleFS;
+
+#endif
@@ -0,0 +1,122 @@
+#include "aWOT.h"
+
+void Request::init(Client* client, char* buffer, int buffer_length) {
+  this->client = client;
+  url_path = buffer;
+  url_path_length = buffer_length;
+  url_path[0] = 0;
+  request_method = INVALID;
+  body_left = -1;
+  handled = false;
+}
+
+// reads a line without its line ending, longer lines are truncated. False if the line hasn't fully arrived
+bool Request::ReadLine(char* line, int line_size) {
+  int length = 0;
+  while (true) {
+    int c = client->read();
+    if (c == -1) return false;
+    if (c == '\n') break;
+    if (c != '\r' && length + 1 < line_size) line[length++] = (char)c;
+  }
+  line[length] = 0;
+  return true;
+}
+
+void Request::processRequest() {
+  char line[256];
+  if (!ReadLine(line, sizeof(line))) return;
+  char* url = strchr(line, ' ');
+  if (url == nullptr) return;
+  *url++ = 0;
+  static const struct {
+    const char* name;
+    MethodType method;
+  } methods[] = {{"GET", GET}, {"HEAD", HEAD}, {"POST", POST}, {"PUT", PUT}, {"DELETE", DELETE}, {"PATCH", PATCH},
+  {"OPTIONS", OPTIONS}};
+  MethodType parsed = INVALID;
+  for (auto& known : methods) {
+    if (strcmp(line, known.name) == 0) parsed = known.method;
+  }
+  if (parsed == INVALID || *url != '/') return;
+  url++;
+  int length = 0;
+  while (url[length] != 0 && url[length] != ' ' && url[length] != '?') length++;
+  if (length >= url_path_length) return; // too long for the buffer
+  memcpy(url_path, url, length);
+  url_path[length] = 0;
+  request_method = parsed;
+}
+
+void Request::processHeaders(HeaderNode* headers) {
+  char line[256];
+  while (ReadLine(line, sizeof(line)) && line[0] != 0) {
+    char* value = strchr(line, ':');
+    if (value == nullptr) continue;
+    *value++ = 0;
+    while (*value == ' ') value++;
+    if (strcasecmp(line, "Content-Length") == 0) body_left = atol(value);
+    for (HeaderNode* header = headers; header != nullptr; header = header->next) {
+      if (strcasecmp(line, header->name) == 0) {
+        strncpy(header->buffer, value, header->bufferLength - 1);
+        header->buffer[header->bufferLength - 1] = 0;
+      }
+    }
+  }
+}
+
+bool Request::next() {
+  if (handled || request_method == INVALID) return false;
+  handled = true;
+  return true;
+}
+
+void Request::reset() {
+  handled = true;
+}
+
+int Request::available() {
+  int available = client->available();
+  if (body_left >= 0 && available > body_left) return body_left;
+  return available;
+}
+
+int Request::read() {
+  if (body_left == 0) return -1;
+  int c = client->read();
+  if (c != -1 && body_left > 0) body_left--;
+  return c;
+}
+
+int Request::peek() {
+  if (body_left == 0) return -1;
+  return client->peek();
+}
+
+void Response::Status(const char* status) {
+  print("HTTP/1.1 "); print(status); print("\r\n");
+}
+
+void Response::success(const char* content_type) {
+  Status("200 OK");
+  print("Content-Type: "); print(content_type); print("\r\n");
+  print("Connection: close\r\n\r\n");
+}
+
+void Response::fail() {
+  Status("400 Bad Request");
+  print("Content-Length: 0\r\nConnection: close\r\n\r\n");
+}
+
+void Response::notFound() {
+  Status("404 Not Found");
+  print("Content-Length: 0\r\nConnection: close\r\n\r\n");
+}
+
+size_t Response::write(uint8_t c) {
+  return client->write(c);
+}
+
+size_t Response::write(const uint8_t* buffer, size_t size) {
+  return client->write(buffer, size);
+}
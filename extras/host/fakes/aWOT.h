@@ -0,0 +1,62 @@
+#ifndef IOTHUB_HOST_AWOT_H
+#define IOTHUB_HOST_AWOT_H
+
+// the part of aWOT 1.x the library drives itself, a request is parsed from whatever has arrived on the client
+#include "Arduino.h"
+
+#define SERVER_DEFAULT_REQUEST_LENGTH 64
+
+class Request : public Stream {
+public:
+  enum MethodType { INVALID, GET, HEAD, POST, PUT, DELETE, PATCH, OPTIONS, ALL, USE };
+  struct HeaderNode {
+    const char* name;
+    char* buffer;
+    int bufferLength;
+    HeaderNode* next;
+  };
+
+  void init(Client* client, char* buffer, int buffer_length);
+  void processRequest(); // the request line, the url path is kept without its leading slash or query
+  void processHeaders(HeaderNode* headers); // fills in the headers asked for, the rest are skipped
+  bool next(); // true once per request
+  MethodType method() { return request_method; }
+  char* urlPath() { return url_path; }
+  void reset();
+
+  // the body, up to the Content-Length when the request has one
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t) override { return 0; }
+  using Print::write;
+
+private:
+  bool ReadLine(char* line, int line_size);
+  Client* client = nullptr;
+  char* url_path = nullptr;
+  int url_path_length = 0;
+  MethodType request_method = INVALID;
+  long body_left = -1; // -1 without a Content-Length
+  bool handled = false;
+};
+
+class Response : public Print {
+public:
+  void init(Client* client) { this->client = client; }
+  void success(const char* content_type = "text/html");
+  void fail();
+  void notFound();
+  void reset() {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+private:
+  void Status(const char* status);
+  Client* client = nullptr;
+};
+
+class WebApp {};
+
+#endif
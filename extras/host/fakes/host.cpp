@@ -0,0 +1,308 @@
+#include "host.h"
+
+#include <chrono>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace host {
+
+NetworkConfig network;
+
+void Pipe::Write(const uint8_t* data, size_t length, uint64_t ready_us) {
+  if (closed || length == 0) return;
+  // a write can't overtake one before it
+  if (!segments.empty() && segments.back().ready_us > ready_us) ready_us = segments.back().ready_us;
+  segments.push_back(Segment{ready_us, std::string((const char*)data, length)});
+  bytes_written += length;
+}
+
+void Pipe::Close(uint64_t at_us) {
+  if (closed) return;
+  if (!segments.empty() && segments.back().ready_us > at_us) at_us = segments.back().ready_us;
+  closed = true;
+  closed_us = at_us;
+}
+
+size_t Pipe::Available(uint64_t now_us) const {
+  size_t available = 0;
+  size_t skip = offset;
+  for (const Segment& segment : segments) {
+    if (segment.ready_us > now_us) break;
+    available += segment.bytes.size() - skip;
+    skip = 0;
+  }
+  return available;
+}
+
+int Pipe::Read(uint64_t now_us) {
+  if (segments.empty() || segments.front().ready_us > now_us) return -1;
+  uint8_t next = segments.front().bytes[offset];
+  offset++;
+  if (offset == segments.front().bytes.size()) {
+    segments.pop_front();
+    offset = 0;
+  }
+  return next;
+}
+
+int Pipe::Peek(uint64_t now_us) const {
+  if (segments.empty() || segments.front().ready_us > now_us) return -1;
+  return (uint8_t)segments.front().bytes[offset];
+}
+
+size_t Pipe::Peek(uint64_t now_us, uint8_t* buffer, size_t length) const {
+  size_t copied = 0;
+  size_t skip = offset;
+  for (const Segment& segment : segments) {
+    if (segment.ready_us > now_us || copied == length) break;
+    size_t part = segment.bytes.size() - skip;
+    if (part > length - copied) part = length - copied;
+    memcpy(buffer + copied, segment.bytes.data() + skip, part);
+    copied += part;
+    skip = 0;
+  }
+  return copied;
+}
+
+void Pipe::Clear() {
+  segments.clear();
+  offset = 0;
+}
+
+bool Pipe::ClosedBy(uint64_t now_us) const {
+  return closed && closed_us <= now_us && Available(now_us) == 0;
+}
+
+Service::~Service() {}
+void Service::Accepted(const std::shared_ptr<Connection>&, uint64_t) {}
+void Service::Closed(const std::shared_ptr<Connection>&, uint64_t) {}
+
+Socket::Socket(const std::shared_ptr<Connection>& connection, bool server_end) : connection(connection), server_end(server_end) {}
+
+Pipe& Socket::In() const {
+  return server_end ? connection->to_server : connection->to_client;
+}
+Pipe& Socket::Out() const {
+  return server_end ? connection->to_client : connection->to_server;
+}
+
+void Socket::Write(const std::string& bytes) {
+  WriteAt(bytes, Current().clock_us + network.latency_us);
+}
+
+void Socket::WriteAt(const std::string& bytes, uint64_t ready_us) {
+  if (!Valid()) return;
+  PlatformScope platform;
+  Out().Write((const uint8_t*)bytes.data(), bytes.size(), ready_us);
+  // a test writing to a service is handled straight away, as a node's writes are
+  if (!server_end && connection->service != nullptr) connection->service->Received(connection, ready_us);
+}
+
+std::string Socket::Read() {
+  if (!Valid()) return "";
+  PlatformScope platform;
+  std::string bytes;
+  uint64_t now = Current().clock_us;
+  while (In().Available(now) > 0) bytes += (char)In().Read(now);
+  return bytes;
+}
+
+std::string Socket::ReadAll() {
+  if (!Valid()) return "";
+  PlatformScope platform;
+  std::string bytes;
+  while (In().Available(UINT64_MAX) > 0) bytes += (char)In().Read(UINT64_MAX);
+  return bytes;
+}
+
+size_t Socket::Available() const {
+  return Valid() ? In().Available(Current().clock_us) : 0;
+}
+
+void Socket::Close() {
+  if (!Valid()) return;
+  PlatformScope platform;
+  uint64_t at = Current().clock_us + network.latency_us;
+  Out().Close(at);
+  if (server_end) {
+    connection->server_stopped = true;
+  } else {
+    connection->client_stopped = true;
+    if (connection->service != nullptr) connection->service->Closed(connection, at);
+  }
+}
+
+bool Socket::PeerClosed() const {
+  return Valid() && In().ClosedBy(Current().clock_us);
+}
+
+Listener::Listener(const std::string& host, uint16_t port) : host(host), port(port) {
+  Register(host, port, this);
+}
+Listener::~Listener() {
+  Unregister(host, port);
+}
+void Listener::Accepted(const std::shared_ptr<Connection>& connection, uint64_t) {
+  pending.push_back(Socket(connection, true));
+  connections++;
+}
+Socket Listener::Accept() {
+  if (pending.empty()) return Socket();
+  Socket next = pending.front();
+  pending.pop_front();
+  return next;
+}
+
+static uint32_t next_chip_id = 0x00C0FFEE;
+static uint32_t nodes_created = 0;
+
+Node::Node() {
+  chip_id = next_chip_id++;
+  // 192.168.x.y on a /16 so every node gets its own address, 192.168.0.1 is the gateway
+  uint32_t host_number = 1 + nodes_created++ % (254 * 256 - 1);
+  ip = 0xA8C0 | ((host_number / 254) << 16) | ((host_number % 254 + 1) << 24);
+  random_state = 0x9E3779B97F4A7C15ull ^ chip_id;
+  flash_eeprom.assign(4096, 0xFF); // an erased flash sector
+  station_ssid = network.ssid;
+  station_psk = network.psk;
+}
+
+static Node* current = nullptr;
+
+Node::~Node() {
+  // whatever it was connected to may already be gone, so the connections are only closed
+  for (std::weak_ptr<Connection>& weak : connections) {
+    std::shared_ptr<Connection> connection = weak.lock();
+    if (!connection) continue;
+    connection->to_server.Close(clock_us);
+    connection->to_client.Close(clock_us);
+  }
+  if (current == this) current = nullptr;
+}
+
+bool Node::WifiConnected() const {
+  return wifi_started && wifi_reachable && !radio_sleeping && network.wifi_up && clock_us >= wifi_ready_us;
+}
+
+void Node::Boot() {
+  boot_us = clock_us;
+  Advance(startup_us);
+  eeprom.clear();
+  eeprom_dirty = false;
+  filesystem_mounted = false;
+  wifi_started = false;
+  wifi_reachable = false;
+  radio_sleeping = !radio_at_boot;
+  radio_at_boot = true;
+  static_ip = static_gateway = static_subnet = static_dns = 0;
+  serial_baud = 0;
+  uart_idle_us = 0;
+  listening.clear();
+  backlog.clear();
+  // the far end of each connection sees it drop
+  for (std::weak_ptr<Connection>& weak : connections) {
+    std::shared_ptr<Connection> connection = weak.lock();
+    if (!connection) continue;
+    connection->to_server.Close(clock_us);
+    connection->to_client.Close(clock_us);
+    connection->client_stopped = true;
+    connection->server_stopped = true;
+    if (connection->service != nullptr) connection->service->Closed(connection, clock_us);
+  }
+  connections.clear();
+  boots++;
+}
+
+Node& Current() {
+  if (current == nullptr) {
+    static Node idle; // so the fakes work before any test has made a node
+    current = &idle;
+  }
+  return *current;
+}
+
+void SetCurrent(Node& node) {
+  current = &node;
+}
+
+Socket Connect(Node& node, uint16_t port) {
+  PlatformScope platform;
+  std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+  if (node.listening.count(port) == 0) {
+    connection->to_client.Close(node.clock_us); // refused
+    return Socket(connection, false);
+  }
+  node.backlog[port].push_back(connection);
+  node.connections.push_back(connection);
+  return Socket(connection, false);
+}
+
+static std::map<std::string, Service*>& Services() {
+  static std::map<std::string, Service*> services;
+  return services;
+}
+
+static std::string Address(const std::string& host, uint16_t port) {
+  return host + ":" + std::to_string(port);
+}
+
+Service* Find(const std::string& host, uint16_t port) {
+  PlatformScope platform;
+  auto found = Services().find(Address(host, port));
+  return found == Services().end() ? nullptr : found->second;
+}
+
+void Register(const std::string& host, uint16_t port, Service* service) {
+  PlatformScope platform;
+  Services()[Address(host, port)] = service;
+}
+
+void Unregister(const std::string& host, uint16_t port) {
+  PlatformScope platform;
+  Services().erase(Address(host, port));
+}
+
+static uint64_t allocations = 0;
+static int platform_depth = 0;
+static uint64_t platform_ns = 0;
+static std::chrono::steady_clock::time_point platform_entered;
+
+uint64_t Allocations() {
+  return allocations;
+}
+
+uint64_t PlatformNanos() {
+  return platform_ns;
+}
+
+PlatformScope::PlatformScope() {
+  if (platform_depth++ == 0) platform_entered = std::chrono::steady_clock::now();
+}
+PlatformScope::~PlatformScope() {
+  if (--platform_depth == 0) {
+    platform_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - platform_entered).count();
+  }
+}
+
+}
+
+// every allocation goes through these, only those made outside a PlatformScope are counted
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size) {
+  if (host::platform_depth == 0) host::allocations++;
+  return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+  if (host::platform_depth == 0) host::allocations++;
+  return __libc_calloc(count, size);
+}
+void* realloc(void* pointer, size_t size) {
+  if (host::platform_depth == 0) host::allocations++;
+  return __libc_realloc(pointer, size);
+}
+}
@@ -0,0 +1,204 @@
+#ifndef IOTHUB_HOST_H
+#define IOTHUB_HOST_H
+
+// The state behind the fakes. Every simulated board is a host::Node with its own clock, EEPROM, RTC memory, files and
+// address, and the fake Arduino APIs act on whichever node is current. Nodes talk to in-process services (the stand-in
+// hub, a test playing a broker) and tests talk to a node's WiFiServer, all through host::Connection.
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace host {
+
+// bytes in flight one way along a connection, each write becomes readable once the reader's clock reaches ready_us
+struct Pipe {
+  struct Segment {
+    uint64_t ready_us;
+    std::string bytes;
+  };
+  std::deque<Segment> segments;
+  size_t offset = 0; // how much of the front segment has been read
+  bool closed = false; // the writer has closed its end
+  uint64_t closed_us = 0;
+  uint64_t bytes_written = 0;
+
+  void Write(const uint8_t* data, size_t length, uint64_t ready_us);
+  void Close(uint64_t at_us);
+  size_t Available(uint64_t now_us) const;
+  int Read(uint64_t now_us);
+  int Peek(uint64_t now_us) const;
+  size_t Peek(uint64_t now_us, uint8_t* buffer, size_t length) const;
+  void Clear();
+  bool ClosedBy(uint64_t now_us) const; // the close has arrived and everything written before it has been read
+};
+
+class Service;
+
+// a TCP connection, the client end is a node's WiFiClient or a test's Socket, the server end a service or a node
+struct Connection {
+  Pipe to_server;
+  Pipe to_client;
+  Service* service = nullptr; // answers the connection in process, NULL when a node's WiFiServer accepted it
+  bool client_stopped = false;
+  bool server_stopped = false;
+  uint32_t client_ip = 0;
+};
+
+// something listening on the fake network, it is told about new connections and every write on them as it happens
+class Service {
+public:
+  virtual ~Service();
+  virtual void Accepted(const std::shared_ptr<Connection>& connection, uint64_t now_us);
+  // bytes have been written to the server end, now_us is when the last of them arrives
+  virtual void Received(const std::shared_ptr<Connection>& connection, uint64_t now_us) = 0;
+  virtual void Closed(const std::shared_ptr<Connection>& connection, uint64_t now_us);
+  bool refusing = false; // connections are refused as if nothing were listening on the port
+};
+
+// one end of a connection held by a test or a service rather than a node, times come from the current node's clock
+class Socket {
+public:
+  Socket() {}
+  Socket(const std::shared_ptr<Connection>& connection, bool server_end);
+  void Write(const std::string& bytes); // arrives after the network latency
+  void WriteAt(const std::string& bytes, uint64_t ready_us);
+  std::string Read(); // everything that has arrived
+  std::string ReadAll(); // everything written so far, whenever it arrives
+  size_t Available() const;
+  void Close();
+  bool PeerClosed() const; // the other end closed and everything it sent has been read
+  bool Valid() const { return connection != nullptr; }
+  std::shared_ptr<Connection> connection;
+
+private:
+  Pipe& In() const;
+  Pipe& Out() const;
+  bool server_end = false;
+};
+
+// listens on an address and keeps every accepted connection for a test to pick up, like a broker it controls
+class Listener : public Service {
+public:
+  Listener(const std::string& host, uint16_t port);
+  ~Listener();
+  void Accepted(const std::shared_ptr<Connection>& connection, uint64_t now_us) override;
+  void Received(const std::shared_ptr<Connection>&, uint64_t) override {}
+  Socket Accept(); // the oldest connection not yet picked up, or an invalid socket
+  unsigned connections = 0;
+
+private:
+  std::string host;
+  uint16_t port;
+  std::deque<Socket> pending;
+};
+
+// the conditions every node sees on the fake network and wifi, times are in microseconds
+struct NetworkConfig {
+  uint64_t latency_us = 0; // one way, every write takes this long to arrive
+  uint64_t connect_us = 0; // a TCP connect to something listening
+  uint64_t connect_timeout_us = 5000000; // a connect to nothing, WiFiClient::connect() blocks this long
+  uint64_t wifi_scan_us = 2500000; // associating after a scan and getting a DHCP lease
+  uint64_t wifi_cached_us = 300000; // associating straight to a known BSSID and channel with a static address
+  uint8_t bssid[6] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC};
+  int32_t channel = 6;
+  std::string ssid = "iothub-test";
+  std::string psk = "password";
+  bool wifi_up = true; // the access point can be reached at all
+};
+extern NetworkConfig network;
+
+// thrown by ESP.restart() and ESP.deepSleep(), which never return on a board. Whatever drives the node catches them,
+// destroys the library instance and boots it again
+struct Restart {};
+struct DeepSleep {
+  uint64_t sleep_us;
+  bool radio_enabled;
+};
+
+// one simulated board
+struct Node {
+  Node();
+  ~Node();
+  Node(const Node&) = delete;
+  Node& operator=(const Node&) = delete;
+
+  uint32_t chip_id;
+  uint32_t ip; // the address DHCP hands out, in IPAddress byte order
+  uint64_t boot_us = 1000000; // millis() and micros() count from here
+  // the node's own clock, it moves when the node waits and when a driver advances it. The SDK starts up before
+  // setup() runs, so as on a board millis() is never 0 there
+  uint64_t clock_us = 1060000;
+  uint64_t startup_us = 60000;
+
+  std::vector<uint8_t> flash_eeprom; // the flash sector EEPROM.commit() writes, survives restarts
+  std::vector<uint8_t> eeprom; // the copy EEPROM.begin() reads into RAM
+  bool eeprom_dirty = false;
+  uint32_t rtc[128] = {}; // RTC user memory, survives restarts and deep sleep
+  std::map<std::string, std::shared_ptr<std::string>> files;
+  bool has_filesystem = true; // LittleFS.begin() fails on a board without a filesystem partition
+  bool filesystem_mounted = false;
+
+  // wifi
+  bool wifi_started = false;
+  bool radio_sleeping = false;
+  bool radio_at_boot = true; // deep sleep can wake with the radio disabled
+  uint64_t wifi_ready_us = 0;
+  bool wifi_reachable = false; // the connection started will come up at wifi_ready_us
+  uint32_t static_ip = 0, static_gateway = 0, static_subnet = 0, static_dns = 0;
+  uint32_t wifi_connects = 0;
+  // the station config the SDK keeps in flash, a board starts out set up for the fake network
+  std::string station_ssid;
+  std::string station_psk;
+  bool station_bssid_set = false; // connections only go to station_bssid, as after a begin() given one
+  uint8_t station_bssid[6] = {};
+
+  std::set<uint16_t> listening;
+  std::map<uint16_t, std::deque<std::shared_ptr<Connection>>> backlog;
+  std::vector<std::weak_ptr<Connection>> connections; // every connection either end of which is this node's
+
+  uint64_t random_state;
+  uint64_t serial_bytes = 0; // at 115200 baud each byte takes about 87us of UART time on a board
+  uint64_t serial_baud = 0; // 0 until Serial.begin(), writes then take no time
+  uint64_t uart_idle_us = 0; // when the UART will have sent everything written to Serial
+  bool echo_serial = false;
+  bool capture_serial = false;
+  std::string serial; // what was written while capture_serial was set
+
+  uint32_t eeprom_commits = 0;
+  uint32_t boots = 0;
+  uint32_t deep_sleeps = 0;
+
+  uint64_t Micros() const { return clock_us - boot_us; }
+  void Advance(uint64_t us) { clock_us += us; }
+  bool WifiConnected() const;
+  void Boot(); // restarts millis() and drops everything a board loses on a reset, ready for a new library instance
+};
+
+Node& Current();
+void SetCurrent(Node& node);
+
+// opens a connection to a node's WiFiServer, as the hub does to reach its actors
+Socket Connect(Node& node, uint16_t port);
+// what WiFiClient::connect() reaches, NULL if nothing listens at the address
+Service* Find(const std::string& host, uint16_t port);
+void Register(const std::string& host, uint16_t port, Service* service);
+void Unregister(const std::string& host, uint16_t port);
+
+// Heap allocations made by the code under test. The fakes and services wrap their own work in a PlatformScope so only
+// the library's allocations are counted, a test takes the difference across the calls it measures
+uint64_t Allocations();
+// the wall time spent inside PlatformScopes, which benchmarks take off their own to leave the library's
+uint64_t PlatformNanos();
+struct PlatformScope {
+  PlatformScope();
+  ~PlatformScope();
+};
+
+}
+
+#endif
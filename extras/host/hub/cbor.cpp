@@ -0,0 +1,131 @@
+#include "cbor.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+class Decoder {
+public:
+  Decoder(const std::string& bytes) : bytes(bytes) {}
+
+  bool Document(Json* value) {
+    return Item(value, 0) && position == bytes.size();
+  }
+
+private:
+  int Next() {
+    return position < bytes.size() ? (unsigned char)bytes[position++] : -1;
+  }
+
+  bool Head(uint8_t* major, uint8_t* additional, uint64_t* argument) {
+    int first = Next();
+    if (first == -1) return false;
+    *major = (uint8_t)first >> 5;
+    *additional = (uint8_t)first & 0x1F;
+    if (*additional < 24) {
+      *argument = *additional;
+      return true;
+    }
+    if (*additional > 27) return false; // indefinite lengths and reserved values
+    *argument = 0;
+    for (int i = 0; i < (1 << (*additional - 24)); i++) {
+      int next = Next();
+      if (next == -1) return false;
+      *argument = (*argument << 8) | (uint8_t)next;
+    }
+    return true;
+  }
+
+  static double Half(uint16_t bits) {
+    int exponent = (bits >> 10) & 0x1F;
+    int mantissa = bits & 0x3FF;
+    double value;
+    if (exponent == 0) {
+      value = ldexp(mantissa, -24);
+    } else if (exponent == 31) {
+      value = mantissa == 0 ? INFINITY : NAN;
+    } else {
+      value = ldexp(mantissa + 1024, exponent - 25);
+    }
+    return (bits & 0x8000) ? -value : value;
+  }
+
+  bool Item(Json* value, int depth) {
+    if (depth > 32) return false;
+    uint8_t major, additional;
+    uint64_t argument;
+    if (!Head(&major, &additional, &argument)) return false;
+    switch (major) {
+      case 0:
+        value->type = Json::number_value;
+        value->number = (double)argument;
+        return true;
+      case 1:
+        value->type = Json::number_value;
+        value->number = -1.0 - (double)argument;
+        return true;
+      case 3:
+        if (argument > bytes.size() - position) return false;
+        value->type = Json::string_value;
+        value->string = bytes.substr(position, argument);
+        position += argument;
+        return true;
+      case 4:
+        value->type = Json::array_value;
+        if (argument > bytes.size() - position) return false; // every item takes at least a byte
+        value->items.resize(argument);
+        for (Json& item : value->items) {
+          if (!Item(&item, depth + 1)) return false;
+        }
+        return true;
+      case 5:
+        value->type = Json::object_value;
+        if (argument > (bytes.size() - position) / 2) return false;
+        for (uint64_t i = 0; i < argument; i++) {
+          Json key;
+          if (!Item(&key, depth + 1) || !key.IsString()) return false;
+          value->members.push_back(std::make_pair(key.string, Json()));
+          if (!Item(&value->members.back().second, depth + 1)) return false;
+        }
+        return true;
+      case 7:
+        return Simple(value, additional, argument);
+      default:
+        return false; // byte strings and tags have no JSON equivalent
+    }
+  }
+
+  bool Simple(Json* value, uint8_t additional, uint64_t argument) {
+    if (additional == 20 || additional == 21) {
+      value->type = Json::boolean_value;
+      value->boolean = additional == 21;
+      return true;
+    }
+    if (additional == 22) return true; // null
+    value->type = Json::number_value;
+    if (additional == 25) {
+      value->number = Half((uint16_t)argument);
+    } else if (additional == 26) {
+      uint32_t bits = (uint32_t)argument;
+      float single;
+      memcpy(&single, &bits, sizeof(single));
+      value->number = single;
+    } else if (additional == 27) {
+      memcpy(&value->number, &argument, sizeof(value->number));
+    } else {
+      return false;
+    }
+    return isfinite(value->number); // JSON has no way to write these either
+  }
+
+  const std::string& bytes;
+  size_t position = 0;
+};
+
+}
+
+bool ParseCbor(const std::string& bytes, Json* value) {
+  *value = Json();
+  return Decoder(bytes).Document(value);
+}
@@ -0,0 +1,11 @@
+#ifndef IOTHUB_HOST_CBOR_H
+#define IOTHUB_HOST_CBOR_H
+
+// decodes CBOR (RFC 7049) into the same document model as JSON, so the stand-in hub handles both encodings alike
+#include "json.h"
+
+// false if bytes aren't exactly one well formed item. Only what a JSON document can hold is accepted: text map keys,
+// definite lengths, integers, floats, booleans and null
+bool ParseCbor(const std::string& bytes, Json* value);
+
+#endif
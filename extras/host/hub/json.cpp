@@ -0,0 +1,201 @@
+#include "json.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool Json::Has(const std::string& key) const {
+  for (const auto& member : members) {
+    if (member.first == key) return true;
+  }
+  return false;
+}
+
+const Json& Json::operator[](const std::string& key) const {
+  static const Json missing;
+  for (const auto& member : members) {
+    if (member.first == key) return member.second;
+  }
+  return missing;
+}
+
+namespace {
+
+class Parser {
+public:
+  Parser(const std::string& text) : text(text) {}
+
+  bool Document(Json* value) {
+    if (!Value(value, 0)) return false;
+    Space();
+    return position == text.size();
+  }
+
+private:
+  void Space() {
+    while (position < text.size() && strchr(" \t\r\n", text[position]) != nullptr) position++;
+  }
+  bool Literal(const char* literal) {
+    size_t length = strlen(literal);
+    if (text.compare(position, length, literal) != 0) return false;
+    position += length;
+    return true;
+  }
+  int Next() {
+    return position < text.size() ? (unsigned char)text[position] : -1;
+  }
+
+  bool Value(Json* value, int depth) {
+    if (depth > 32) return false;
+    Space();
+    int c = Next();
+    if (c == '{') return Object(value, depth);
+    if (c == '[') return Array(value, depth);
+    if (c == '"') {
+      value->type = Json::string_value;
+      return String(&value->string);
+    }
+    if (Literal("true")) {
+      value->type = Json::boolean_value;
+      value->boolean = true;
+      return true;
+    }
+    if (Literal("false")) {
+      value->type = Json::boolean_value;
+      return true;
+    }
+    if (Literal("null")) return true;
+    return Number(value);
+  }
+
+  bool Object(Json* value, int depth) {
+    value->type = Json::object_value;
+    position++;
+    Space();
+    if (Next() == '}') {
+      position++;
+      return true;
+    }
+    while (true) {
+      Space();
+      std::string key;
+      if (Next() != '"' || !String(&key)) return false;
+      Space();
+      if (Next() != ':') return false;
+      position++;
+      Json member;
+      if (!Value(&member, depth + 1)) return false;
+      value->members.push_back(std::make_pair(key, member));
+      Space();
+      if (Next() == '}') {
+        position++;
+        return true;
+      }
+      if (Next() != ',') return false;
+      position++;
+    }
+  }
+
+  bool Array(Json* value, int depth) {
+    value->type = Json::array_value;
+    position++;
+    Space();
+    if (Next() == ']') {
+      position++;
+      return true;
+    }
+    while (true) {
+      Json item;
+      if (!Value(&item, depth + 1)) return false;
+      value->items.push_back(item);
+      Space();
+      if (Next() == ']') {
+        position++;
+        return true;
+      }
+      if (Next() != ',') return false;
+      position++;
+    }
+  }
+
+  bool String(std::string* out) {
+    position++;
+    while (true) {
+      int c = Next();
+      if (c == -1 || c < 0x20) return false;
+      position++;
+      if (c == '"') return true;
+      if (c != '\\') {
+        *out += (char)c;
+        continue;
+      }
+      c = Next();
+      position++;
+      switch (c) {
+        case '"': case '\\': case '/': *out += (char)c; break;
+        case 'b': *out += '\b'; break;
+        case 'f': *out += '\f'; break;
+        case 'n': *out += '\n'; break;
+        case 'r': *out += '\r'; break;
+        case 't': *out += '\t'; break;
+        case 'u': {
+          if (position + 4 > text.size()) return false;
+          unsigned code = strtoul(text.substr(position, 4).c_str(), nullptr, 16);
+          position += 4;
+          *out += code < 0x80 ? (char)code : '?';
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+  }
+
+  // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+  bool Number(Json* value) {
+    size_t start = position;
+    if (Next() == '-') position++;
+    if (Next() == '0') {
+      position++;
+    } else if (Next() >= '1' && Next() <= '9') {
+      while (isdigit(Next())) position++;
+    } else {
+      return false;
+    }
+    if (Next() == '.') {
+      position++;
+      if (!isdigit(Next())) return false;
+      while (isdigit(Next())) position++;
+    }
+    if (Next() == 'e' || Next() == 'E') {
+      position++;
+      if (Next() == '+' || Next() == '-') position++;
+      if (!isdigit(Next())) return false;
+      while (isdigit(Next())) position++;
+    }
+    value->type = Json::number_value;
+    value->number = strtod(text.substr(start, position - start).c_str(), nullptr);
+    return true;
+  }
+  static bool isdigit(int c) {
+    return c >= '0' && c <= '9';
+  }
+
+  const std::string& text;
+  size_t position = 0;
+};
+
+}
+
+bool ParseJson(const std::string& text, Json* value) {
+  *value = Json();
+  return Parser(text).Document(value);
+}
+
+std::string QuoteJson(const std::string& text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
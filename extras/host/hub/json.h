@@ -0,0 +1,34 @@
+#ifndef IOTHUB_HOST_JSON_H
+#define IOTHUB_HOST_JSON_H
+
+// a small JSON document model for the stand-in hub and the tests, strict about the grammar so that anything the
+// library writes which a real hub's parser would reject fails here too
+#include <map>
+#include <string>
+#include <vector>
+
+struct Json {
+  enum Type { null_value, boolean_value, number_value, string_value, array_value, object_value };
+  Type type = null_value;
+  bool boolean = false;
+  double number = 0;
+  std::string string;
+  std::vector<Json> items;
+  std::vector<std::pair<std::string, Json>> members;
+
+  bool IsNull() const { return type == null_value; }
+  bool IsNumber() const { return type == number_value; }
+  bool IsString() const { return type == string_value; }
+  bool IsArray() const { return type == array_value; }
+  bool IsObject() const { return type == object_value; }
+  bool Has(const std::string& key) const;
+  const Json& operator[](const std::string& key) const; // a null value if the key is missing
+  const Json& operator[](size_t index) const { return items[index]; }
+  size_t Size() const { return type == array_value ? items.size() : members.size(); }
+};
+
+// false if text isn't exactly one valid JSON value
+bool ParseJson(const std::string& text, Json* value);
+std::string QuoteJson(const std::string& text);
+
+#endif
@@ -0,0 +1,315 @@
+#include "stand_in_hub.h"
+
+#include <iterator>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+StandInHub::StandInHub(const std::string& host, uint16_t port) : host_name(host), port(port) {
+  host::Register(host, port, this);
+}
+
+StandInHub::~StandInHub() {
+  host::Unregister(host_name, port);
+}
+
+std::string StandInHub::IdOf(const std::string& name, char kind) const {
+  for (const auto& known : nodes) {
+    if (known.second.name == name && known.second.kind == kind) return known.first;
+  }
+  return "";
+}
+
+// ids look like the 24 hex character object ids the real hub hands out
+std::string StandInHub::AddNode(const std::string& name, char kind, const std::string& type) {
+  char id[25];
+  snprintf(id, sizeof(id), "5f1d%04x%016llx", port, (unsigned long long)next_id++);
+  nodes[id] = node{name, kind, type};
+  return id;
+}
+
+void StandInHub::Forget(const std::string& id) {
+  nodes.erase(id);
+}
+
+size_t StandInHub::Count(const std::string& method, const std::string& url_prefix) const {
+  size_t count = 0;
+  for (const request& seen : requests) {
+    if (seen.method == method && seen.url.compare(0, url_prefix.size(), url_prefix) == 0) count++;
+  }
+  return count;
+}
+
+const StandInHub::request* StandInHub::Last(const std::string& method, const std::string& url_prefix) const {
+  for (auto seen = requests.rbegin(); seen != requests.rend(); ++seen) {
+    if (seen->method == method && seen->url.compare(0, url_prefix.size(), url_prefix) == 0) return &*seen;
+  }
+  return nullptr;
+}
+
+void StandInHub::Clear() {
+  requests.clear();
+  readings.clear();
+}
+
+void StandInHub::Accepted(const std::shared_ptr<host::Connection>& connection, uint64_t) {
+  pending[connection.get()];
+  connections_accepted++;
+}
+
+void StandInHub::Closed(const std::shared_ptr<host::Connection>& connection, uint64_t) {
+  pending.erase(connection.get());
+  connection->to_client.Close(0);
+  connection->server_stopped = true;
+}
+
+// finds the header's value in a request head, empty if it isn't there
+static std::string HeaderValue(const std::string& head, const char* name) {
+  size_t line = head.find("\r\n");
+  while (line != std::string::npos && line + 2 < head.size()) {
+    size_t start = line + 2;
+    size_t end = head.find("\r\n", start);
+    if (end == std::string::npos) end = head.size();
+    size_t colon = head.find(':', start);
+    if (colon != std::string::npos && colon < end && colon - start == strlen(name) &&
+    strncasecmp(head.c_str() + start, name, colon - start) == 0) {
+      size_t value = colon + 1;
+      while (value < end && head[value] == ' ') value++;
+      return head.substr(value, end - value);
+    }
+    line = end;
+  }
+  return "";
+}
+
+void StandInHub::Received(const std::shared_ptr<host::Connection>& connection, uint64_t now_us) {
+  host::PlatformScope platform;
+  host::Socket socket(connection, true);
+  std::string& buffer = pending[connection.get()];
+  buffer += socket.ReadAll();
+
+  while (true) {
+    size_t head_end = buffer.find("\r\n\r\n");
+    if (head_end == std::string::npos) return;
+    std::string head = buffer.substr(0, head_end);
+    size_t body_length = atol(HeaderValue(head, "Content-Length").c_str());
+    if (buffer.size() < head_end + 4 + body_length) return;
+
+    request seen;
+    size_t method_end = head.find(' ');
+    size_t url_end = head.find(' ', method_end + 1);
+    seen.method = head.substr(0, method_end);
+    seen.url = head.substr(method_end + 1, url_end - method_end - 1);
+    seen.content_type = HeaderValue(head, "Content-Type");
+    seen.cbor = seen.content_type.compare(0, 16, "application/cbor") == 0;
+    seen.body = buffer.substr(head_end + 4, body_length);
+    seen.node_ip = connection->client_ip;
+    seen.arrival_us = now_us;
+    seen.answered_us = now_us;
+    seen.request_bytes = head_end + 4 + body_length;
+    buffer.erase(0, seen.request_bytes);
+    bool close = !keep_alive || strcasecmp(HeaderValue(head, "Connection").c_str(), "close") == 0;
+
+    std::string body;
+    std::string content_type = "application/json";
+    size_t readings_before = readings.size();
+    Handle(seen, &body, &content_type);
+    seen.answered_us = Schedule(now_us, service_us + reading_service_us * (readings.size() - readings_before));
+
+    const char* reason = seen.status == 200 ? "OK" : seen.status == 400 ? "Bad Request" : seen.status == 404 ? "Not Found" :
+    seen.status == 415 ? "Unsupported Media Type" : seen.status == 503 ? "Service Unavailable" : "Error";
+    std::string response = "HTTP/1.1 " + std::to_string(seen.status) + " " + reason + "\r\n";
+    response += "Content-Type: " + content_type + "\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+    response += body;
+    seen.response_bytes = response.size();
+    uint64_t ready = seen.answered_us + host::network.latency_us;
+    socket.WriteAt(response, ready);
+    requests.push_back(seen);
+    if (close) {
+      connection->to_client.Close(ready);
+      connection->server_stopped = true;
+      pending.erase(connection.get());
+      return;
+    }
+  }
+}
+
+// the earliest time a worker can take the whole request from its arrival, returns when it is done
+uint64_t StandInHub::Schedule(uint64_t arrival_us, uint64_t duration_us) {
+  if (workers == 0) return arrival_us + duration_us;
+  busy.resize(workers);
+  uint64_t best_start = UINT64_MAX;
+  size_t best_worker = 0;
+  for (size_t worker = 0; worker < busy.size(); worker++) {
+    uint64_t start = arrival_us;
+    auto next = busy[worker].upper_bound(arrival_us);
+    if (next != busy[worker].begin()) {
+      auto previous = std::prev(next);
+      if (previous->second > start) start = previous->second;
+    }
+    // the first gap long enough
+    while (next != busy[worker].end() && next->first < start + duration_us) {
+      if (next->second > start) start = next->second;
+      ++next;
+    }
+    if (start < best_start) {
+      best_start = start;
+      best_worker = worker;
+    }
+  }
+  if (duration_us > 0) busy[best_worker][best_start] = best_start + duration_us;
+  return best_start + duration_us;
+}
+
+void StandInHub::ForgetBusyBefore(uint64_t us) {
+  host::PlatformScope platform;
+  for (auto& worker : busy) {
+    while (!worker.empty() && worker.begin()->second <= us) worker.erase(worker.begin());
+  }
+}
+
+void StandInHub::Handle(request& seen, std::string* response_body, std::string* response_type) {
+  if (status_override != 0) {
+    seen.status = status_override;
+    return;
+  }
+  const std::string& url = seen.url;
+  if (seen.cbor && !cbor_supported) {
+    seen.status = 415;
+    return;
+  }
+  Json body;
+  bool parsed = seen.body.empty() || (seen.cbor ? ParseCbor(seen.body, &body) : ParseJson(seen.body, &body));
+  if (!parsed) {
+    seen.status = 400;
+    return;
+  }
+
+  const std::string sensors = "/api/sensors/";
+  const std::string actors = "/api/actors/";
+  if (seen.method == "POST" && url == "/api/nodes/validate") {
+    seen.status = bulk_supported ? Validate(body, response_body) : 404;
+  } else if (seen.method == "POST" && url == "/api/nodes/register") {
+    seen.status = bulk_supported ? Register(body, response_body) : 404;
+  } else if (seen.method == "POST" && url == "/api/sensors") {
+    seen.status = RegisterOne(body, 's', response_body);
+  } else if (seen.method == "POST" && url == "/api/actors") {
+    seen.status = RegisterOne(body, 'a', response_body);
+  } else if (seen.method == "POST" && url == "/api/sensors/data") {
+    seen.status = bulk_supported ? Upload(body, seen, "") : 404;
+  } else if (seen.method == "POST" && url.compare(0, sensors.size(), sensors) == 0 &&
+  url.size() == sensors.size() + 24 + 5 && url.compare(sensors.size() + 24, 5, "/data") == 0) {
+    seen.status = Upload(body, seen, url.substr(sensors.size(), 24));
+  } else if (seen.method == "GET" && url.compare(0, actors.size(), actors) == 0) {
+    auto found = nodes.find(url.substr(actors.size()));
+    if (found == nodes.end() || found->second.kind != 'a') {
+      seen.status = 404;
+    } else {
+      seen.status = 200;
+      *response_body = "{\"id\":\"" + found->first + "\",\"name\":" + QuoteJson(found->second.name) + "}";
+    }
+  } else {
+    seen.status = 404;
+  }
+  if (response_body->empty() && seen.status == 200) *response_type = "text/plain";
+}
+
+// {"ids": [...]} is answered with the ones the hub doesn't know, {"missing": [...]}
+int StandInHub::Validate(const Json& body, std::string* response_body) {
+  if (!body["ids"].IsArray()) return 400;
+  std::string missing;
+  for (const Json& id : body["ids"].items) {
+    if (!id.IsString()) return 400;
+    if (nodes.count(id.string) > 0) continue;
+    if (!missing.empty()) missing += ",";
+    missing += QuoteJson(id.string);
+  }
+  *response_body = "{\"missing\":[" + missing + "]}";
+  return 200;
+}
+
+// {"sensors": [{"name", "data_type"}...], "actors": [{"name", "state_type"}...]} is answered with an id for each in
+// the same order
+int StandInHub::Register(const Json& body, std::string* response_body) {
+  const Json& sensors = body["sensors"];
+  const Json& actors = body["actors"];
+  if (!sensors.IsArray() || !actors.IsArray()) return 400;
+  std::string sensor_ids;
+  for (const Json& sensor : sensors.items) {
+    if (!sensor["name"].IsString() || !sensor["data_type"].IsString()) return 400;
+    if (!sensor_ids.empty()) sensor_ids += ",";
+    sensor_ids += QuoteJson(AddNode(sensor["name"].string, 's', sensor["data_type"].string));
+  }
+  std::string actor_ids;
+  for (const Json& actor : actors.items) {
+    if (!actor["name"].IsString() || !actor["state_type"].IsString()) return 400;
+    if (!actor_ids.empty()) actor_ids += ",";
+    actor_ids += QuoteJson(AddNode(actor["name"].string, 'a', actor["state_type"].string));
+  }
+  *response_body = "{\"sensors\":[" + sensor_ids + "],\"actors\":[" + actor_ids + "]}";
+  return 200;
+}
+
+int StandInHub::RegisterOne(const Json& body, char kind, std::string* response_body) {
+  const char* type_key = kind == 's' ? "data_type" : "state_type";
+  if (!body["name"].IsString() || !body[type_key].IsString()) return 400;
+  *response_body = "{\"id\":" + QuoteJson(AddNode(body["name"].string, kind, body[type_key].string)) + "}";
+  return 200;
+}
+
+// a single {"value": ...} to a sensor's url, or a batch of [{"id", "value", "age"}...] to /api/sensors/data. Nothing
+// from an upload is kept unless all of it is valid, and any unknown sensor 404s the whole upload
+int StandInHub::Upload(const Json& body, const request& seen, const std::string& sensor_id) {
+  size_t before = readings.size();
+  bool valid = true;
+  if (!sensor_id.empty()) {
+    if (nodes.count(sensor_id) == 0) return 404;
+    valid = body.IsObject() && AddReading(body, seen, sensor_id, false);
+  } else if (body.IsArray() && body.Size() > 0) {
+    for (const Json& entry : body.items) {
+      if (!entry.IsObject() || !entry["id"].IsString()) {
+        valid = false;
+        break;
+      }
+      if (nodes.count(entry["id"].string) == 0) {
+        readings.resize(before);
+        return 404;
+      }
+      if (!AddReading(entry, seen, entry["id"].string, true)) {
+        valid = false;
+        break;
+      }
+    }
+  } else {
+    valid = false;
+  }
+  if (!valid) {
+    readings.resize(before);
+    return 400;
+  }
+  return 200;
+}
+
+bool StandInHub::AddReading(const Json& entry, const request& seen, const std::string& sensor_id, bool batched) {
+  reading added;
+  added.sensor_id = sensor_id;
+  if (!entry["value"].IsNumber()) return false;
+  added.value = entry["value"].number;
+  // a single reading is sent as it is taken, in a batch each reading says how long ago it was sampled
+  added.age_known = !batched || entry["age"].IsNumber();
+  added.age_ms = entry["age"].IsNumber() ? entry["age"].number : 0;
+  if (batched && !entry.Has("age")) return false;
+  bool aggregate = entry.Has("count");
+  if (aggregate && (!entry["count"].IsNumber() || !entry["min"].IsNumber() || !entry["max"].IsNumber())) return false;
+  added.count = aggregate ? (unsigned)entry["count"].number : 1;
+  added.min = aggregate ? entry["min"].number : added.value;
+  added.max = aggregate ? entry["max"].number : added.value;
+  added.node_ip = seen.node_ip;
+  added.arrival_us = seen.arrival_us;
+  readings.push_back(added);
+  return true;
+}
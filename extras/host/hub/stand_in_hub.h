@@ -0,0 +1,99 @@
+#ifndef IOTHUB_HOST_STAND_IN_HUB_H
+#define IOTHUB_HOST_STAND_IN_HUB_H
+
+// An in-process stand-in for the iotHub server, answering the endpoints the library uses over keep-alive HTTP/1.1.
+// It registers nodes, checks uploads against the sensors it knows and records every request and reading, so tests and
+// benchmarks can see exactly what reached the hub and when by the virtual clock. Request bodies may be JSON or CBOR,
+// responses are always JSON.
+#include "host.h"
+#include "json.h"
+#include "cbor.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class StandInHub : public host::Service {
+public:
+  StandInHub(const std::string& host = "hub.local", uint16_t port = 3000);
+  ~StandInHub();
+
+  struct request {
+    std::string method;
+    std::string url;
+    std::string content_type;
+    bool cbor; // the body was CBOR
+    std::string body;
+    uint32_t node_ip;
+    uint64_t arrival_us; // when the last byte of the request arrived
+    uint64_t answered_us; // when the response was sent, after waiting for a worker and being handled
+    int status;
+    size_t request_bytes; // head and body
+    size_t response_bytes;
+  };
+  struct reading {
+    std::string sensor_id;
+    double value;
+    bool age_known; // false for batch entries without an age, or with a null one
+    double age_ms;
+    double min;
+    double max;
+    unsigned count; // how many samples the reading stands for
+    uint32_t node_ip;
+    uint64_t arrival_us;
+  };
+  struct node {
+    std::string name;
+    char kind; // 's' or 'a'
+    std::string type; // data_type or state_type
+  };
+
+  std::vector<request> requests;
+  std::vector<reading> readings;
+  std::map<std::string, node> nodes; // by id
+
+  // how the hub behaves, tests change these between steps
+  bool bulk_supported = true; // the /api/nodes endpoints and the batch upload, 404 when false
+  bool keep_alive = true; // otherwise every response closes its connection
+  bool cbor_supported = true; // CBOR bodies are answered with 415 when false, as by a hub that predates them
+  int status_override = 0; // answer every request with this status when it is not 0, 503 to play a hub that is down
+  // A hub with this many workers, each taking service_us over a request and reading_service_us more for every reading
+  // it stores. Requests wait for a free worker. With no workers every request is answered as it arrives
+  unsigned workers = 0;
+  uint64_t service_us = 0;
+  uint64_t reading_service_us = 0;
+  // drops the record of when workers are busy before this time, nothing may arrive earlier afterwards
+  void ForgetBusyBefore(uint64_t us);
+
+  // the id the hub has given a node, empty if it has none
+  std::string IdOf(const std::string& name, char kind) const;
+  std::string AddNode(const std::string& name, char kind, const std::string& type);
+  void Forget(const std::string& id);
+  size_t Count(const std::string& method, const std::string& url_prefix) const;
+  const request* Last(const std::string& method, const std::string& url_prefix) const;
+  void Clear(); // forgets the recorded requests and readings, not the nodes
+  unsigned connections_accepted = 0;
+
+  void Accepted(const std::shared_ptr<host::Connection>& connection, uint64_t now_us) override;
+  void Received(const std::shared_ptr<host::Connection>& connection, uint64_t now_us) override;
+  void Closed(const std::shared_ptr<host::Connection>& connection, uint64_t now_us) override;
+
+private:
+  void Handle(request& request, std::string* response_body, std::string* response_type);
+  int Register(const Json& body, std::string* response_body);
+  int Validate(const Json& body, std::string* response_body);
+  int RegisterOne(const Json& body, char kind, std::string* response_body);
+  int Upload(const Json& body, const request& request, const std::string& sensor_id);
+  bool AddReading(const Json& entry, const request& request, const std::string& sensor_id, bool batched);
+  uint64_t Schedule(uint64_t arrival_us, uint64_t duration_us);
+
+  std::string host_name;
+  uint16_t port;
+  uint64_t next_id = 1;
+  std::map<host::Connection*, std::string> pending; // bytes of requests that haven't fully arrived, per connection
+  // when each worker is busy, start to end. Nodes run in turn on their own clocks, so requests don't arrive in time
+  // order and a worker can have a gap before a request that has already been given to it
+  std::vector<std::map<uint64_t, uint64_t>> busy;
+};
+
+#endif
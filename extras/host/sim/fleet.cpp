@@ -0,0 +1,232 @@
+// Runs a fleet of sensor nodes against the stand-in hub, each on its own virtual clock with its own EEPROM, RTC memory
+// and address, and reports the load the hub sees. Nodes are stepped one loop() at a time, always the one furthest
+// behind. The first phase is the boot storm as every node powers on, registers and starts uploading, the second is
+// the steady state after it. Compare runs before and after a library change to see its effect on hub traffic.
+//   fleet --nodes=2000 --period=60 --batch=5 --workers=2
+#include "support.h"
+#include "stand_in_hub.h"
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+typedef iotHubLib<2,0> fleet_lib;
+
+struct fleet_options {
+  uint nodes = 500;
+  uint64_t period_s = 60; // how often each node samples its two sensors
+  uint batch = 1; // samples of both sensors per upload, with deep sleep the wakes per upload
+  bool deep_sleep = false;
+  uint64_t boot_spread_ms = 0; // nodes power on at random over this long, 0 for all at once as after a power cut
+  uint64_t storm_s = 60; // how long after the first node powers on the boot storm is measured
+  uint64_t steady_s = 3600;
+  unsigned workers = 4;
+  uint64_t service_us = 2000;
+  uint64_t reading_service_us = 200;
+  uint64_t latency_us = 2000; // one way, between every node and the hub
+};
+static fleet_options options;
+
+static float ReadSensor() {
+  return 20 + (ESP.random() % 1000) / 100.0f;
+}
+
+static void StartNode(fleet_lib& iothub) {
+  unsigned long period_ms = options.period_s * 1000;
+  if (options.deep_sleep) {
+    iothub.EnableDeepSleep(period_ms, (options.batch - 1) * period_ms);
+  }
+  iothub.Start();
+  iothub.RegisterSensor("Fleet Temperature", "number", ReadSensor, period_ms);
+  iothub.RegisterSensor("Fleet Humidity", "number", ReadSensor, period_ms);
+  iothub.SetFlushThresholds(options.batch * 2, 0, 0);
+}
+
+static uint64_t Percentile(std::vector<uint64_t>& values, double fraction) {
+  if (values.empty()) return 0;
+  return values[(size_t)(fraction * (values.size() - 1))];
+}
+
+static void PrintTimes(const char* name, std::vector<uint64_t> us) {
+  std::sort(us.begin(), us.end());
+  printf("  %-22s p50 %8.1fms  p95 %8.1fms  p99 %8.1fms  max %8.1fms\n", name, Percentile(us, 0.5) / 1000.0,
+  Percentile(us, 0.95) / 1000.0, Percentile(us, 0.99) / 1000.0, (us.empty() ? 0 : us.back()) / 1000.0);
+}
+
+// the url with any 24 character id replaced, so requests group by endpoint
+static std::string Endpoint(const StandInHub::request& request) {
+  std::string url = request.url;
+  const std::string sensors = "/api/sensors/";
+  if (url.compare(0, sensors.size(), sensors) == 0 && url.size() >= sensors.size() + 24 &&
+  url.compare(sensors.size(), 4, "data") != 0) {
+    url.replace(sensors.size(), 24, ":id");
+  }
+  return request.method + " " + url;
+}
+
+// everything that arrived at the hub in [from_us, to_us)
+static void ReportPhase(const char* name, const StandInHub& hub, uint64_t from_us, uint64_t to_us) {
+  double seconds = (to_us - from_us) / 1e6;
+  std::vector<uint64_t> latencies;
+  std::map<uint64_t, uint64_t> per_second;
+  std::map<std::string, uint64_t> per_endpoint;
+  uint64_t requests = 0, bytes_in = 0, bytes_out = 0, failed = 0, too_late = 0;
+  for (const StandInHub::request& request : hub.requests) {
+    if (request.arrival_us < from_us || request.arrival_us >= to_us) continue;
+    requests++;
+    bytes_in += request.request_bytes;
+    bytes_out += request.response_bytes;
+    if (request.status < 200 || request.status >= 300) failed++;
+    uint64_t latency = request.answered_us - request.arrival_us;
+    latencies.push_back(latency);
+    // the node stops waiting after hub_response_timeout, whatever the hub then answers is lost
+    if (latency + 2 * options.latency_us > (uint64_t)hub_response_timeout * 1000) too_late++;
+    per_second[(request.arrival_us - from_us) / 1000000]++;
+    per_endpoint[Endpoint(request)]++;
+  }
+  uint64_t readings = 0;
+  for (const StandInHub::reading& reading : hub.readings) {
+    if (reading.arrival_us >= from_us && reading.arrival_us < to_us) readings++;
+  }
+  uint64_t peak = 0;
+  for (const auto& second : per_second) peak = std::max(peak, second.second);
+
+  printf("%s, %.0fs\n", name, seconds);
+  printf("  %-22s %llu, %.1f/s, peak %llu/s\n", "requests", (unsigned long long)requests, requests / seconds,
+  (unsigned long long)peak);
+  printf("  %-22s %.0f B/s in, %.0f B/s out\n", "bytes", bytes_in / seconds, bytes_out / seconds);
+  printf("  %-22s %llu, %.1f/s\n", "readings stored", (unsigned long long)readings, readings / seconds);
+  printf("  %-22s %llu not 2xx, %llu answered after the node gave up\n", "failures", (unsigned long long)failed,
+  (unsigned long long)too_late);
+  PrintTimes("hub latency", latencies);
+  for (const auto& endpoint : per_endpoint) {
+    printf("  %-40s %llu\n", endpoint.first.c_str(), (unsigned long long)endpoint.second);
+  }
+}
+
+// how long each node took from power on until the hub answered its registration
+static void ReportRegistration(const StandInHub& hub, const std::vector<std::unique_ptr<Board<fleet_lib>>>& boards,
+const std::vector<uint64_t>& power_on_us) {
+  std::map<uint32_t, uint64_t> registered_us;
+  for (const StandInHub::request& request : hub.requests) {
+    if (request.url != "/api/nodes/register" || request.status != 200) continue;
+    uint64_t answered = request.answered_us + options.latency_us;
+    auto known = registered_us.find(request.node_ip);
+    if (known == registered_us.end() || answered < known->second) registered_us[request.node_ip] = answered;
+  }
+  std::vector<uint64_t> times;
+  for (size_t i = 0; i < boards.size(); i++) {
+    auto registered = registered_us.find(boards[i]->node.ip);
+    if (registered != registered_us.end()) times.push_back(registered->second - power_on_us[i]);
+  }
+  printf("  %-22s %zu of %zu nodes\n", "registered", times.size(), boards.size());
+  PrintTimes("power on to registered", times);
+}
+
+static bool Option(const char* argument, const char* name, uint64_t* value) {
+  size_t length = strlen(name);
+  if (strncmp(argument, name, length) != 0 || argument[length] != '=') return false;
+  *value = strtoull(argument + length + 1, nullptr, 10);
+  return true;
+}
+
+static bool ParseOptions(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    uint64_t value;
+    if (strcmp(argv[i], "--deep-sleep") == 0) {
+      options.deep_sleep = true;
+    } else if (Option(argv[i], "--nodes", &value)) {
+      options.nodes = value;
+    } else if (Option(argv[i], "--period", &value)) {
+      options.period_s = value;
+    } else if (Option(argv[i], "--batch", &value)) {
+      options.batch = value;
+    } else if (Option(argv[i], "--boot-spread-ms", &value)) {
+      options.boot_spread_ms = value;
+    } else if (Option(argv[i], "--storm", &value)) {
+      options.storm_s = value;
+    } else if (Option(argv[i], "--steady", &value)) {
+      options.steady_s = value;
+    } else if (Option(argv[i], "--workers", &value)) {
+      options.workers = value;
+    } else if (Option(argv[i], "--service-us", &value)) {
+      options.service_us = value;
+    } else if (Option(argv[i], "--reading-service-us", &value)) {
+      options.reading_service_us = value;
+    } else if (Option(argv[i], "--latency-us", &value)) {
+      options.latency_us = value;
+    } else {
+      printf("usage: fleet [--nodes=N] [--period=s] [--batch=N] [--deep-sleep] [--boot-spread-ms=ms] [--storm=s]\n"
+      "  [--steady=s] [--workers=N] [--service-us=us] [--reading-service-us=us] [--latency-us=us]\n");
+      return false;
+    }
+  }
+  if (options.nodes == 0 || options.period_s == 0) return false;
+  if (options.batch == 0) options.batch = 1;
+  if (options.batch * 2 > reading_queue_length) options.batch = reading_queue_length / 2;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!ParseOptions(argc, argv)) return 1;
+  host::network.latency_us = options.latency_us;
+  StandInHub hub;
+  hub.workers = options.workers;
+  hub.service_us = options.service_us;
+  hub.reading_service_us = options.reading_service_us;
+
+  std::vector<std::unique_ptr<Board<fleet_lib>>> boards;
+  std::vector<uint64_t> power_on_us;
+  uint64_t start_us = 1000000;
+  // later nodes, ordered by their clocks
+  typedef std::pair<uint64_t, size_t> due_node;
+  std::priority_queue<due_node, std::vector<due_node>, std::greater<due_node>> due;
+  uint64_t spread_state = 1;
+  for (uint i = 0; i < options.nodes; i++) {
+    boards.emplace_back(new Board<fleet_lib>(StartNode));
+    host::Node& node = boards.back()->node;
+    spread_state = spread_state * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t offset_us = options.boot_spread_ms == 0 ? 0 : (spread_state >> 16) % (options.boot_spread_ms * 1000);
+    node.boot_us = start_us + offset_us;
+    node.clock_us = node.boot_us + node.startup_us;
+    power_on_us.push_back(node.boot_us);
+    due.push(due_node(node.clock_us, i));
+  }
+
+  uint64_t storm_end_us = start_us + options.storm_s * 1000000;
+  uint64_t steady_end_us = storm_end_us + options.steady_s * 1000000;
+  std::vector<bool> booted(boards.size(), false);
+  uint64_t steps = 0;
+  while (!due.empty() && due.top().first < steady_end_us) {
+    size_t index = due.top().second;
+    due.pop();
+    Board<fleet_lib>& board = *boards[index];
+    uint64_t before = board.node.clock_us;
+    if (!booted[index]) {
+      board.Boot();
+      booted[index] = true;
+    } else {
+      board.Loop();
+    }
+    if (board.node.clock_us == before) board.node.Advance(1000);
+    due.push(due_node(board.node.clock_us, index));
+    // nothing can arrive at the hub before the node furthest behind
+    if (++steps % 1024 == 0) hub.ForgetBusyBefore(due.top().first);
+  }
+
+  printf("%u nodes sampling 2 sensors every %llus, %u readings per upload%s, powered on over %llums\n", options.nodes,
+  (unsigned long long)options.period_s, options.batch * 2, options.deep_sleep ? " deep sleeping" : "",
+  (unsigned long long)options.boot_spread_ms);
+  printf("hub with %u workers, %lluus a request and %lluus a reading, %lluus network latency each way\n\n",
+  options.workers, (unsigned long long)options.service_us, (unsigned long long)options.reading_service_us,
+  (unsigned long long)options.latency_us);
+  ReportPhase("boot storm", hub, start_us, storm_end_us);
+  ReportRegistration(hub, boards, power_on_us);
+  printf("\n");
+  ReportPhase("steady state", hub, storm_end_us, steady_end_us);
+  printf("  %-22s %u\n", "hub connections", hub.connections_accepted);
+  return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef IOTHUB_HOST_SUPPORT_H
+#define IOTHUB_HOST_SUPPORT_H
+
+// runs the library on a host::Node the way a board runs a sketch, shared by the tests, benchmarks and simulator
+#include "iotHubLib.h"
+#include "host.h"
+#include "json.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// One board: setup runs on every boot and loop over and over after it, Tick() by default. A restart or deep sleep
+// throws out of the library, the instance is then destroyed and the board boots again keeping only what survives
+template<typename Lib> class Board {
+public:
+  typedef std::function<void(Lib&)> sketch_function;
+
+  Board(sketch_function setup, sketch_function loop = nullptr, const char* hub_host = "hub.local", int hub_port = 3000) :
+  setup(setup), loop(loop), hub_port(hub_port) {
+    snprintf(server, sizeof(server), "%s", hub_host);
+  }
+
+  host::Node node;
+  uint restarts = 0;
+  uint deep_sleeps = 0;
+  uint64_t last_sleep_us = 0;
+
+  Lib& lib() { return *instance; }
+
+  // powers the board on, or boots it again after a restart
+  void Boot() {
+    host::SetCurrent(node);
+    instance.reset();
+    if (booted) node.Boot();
+    booted = true;
+    Run([this] {
+      instance.reset(new Lib(server, hub_port));
+      setup(*instance);
+    });
+  }
+
+  // one pass of loop(), false if it ended in a restart or deep sleep
+  bool Loop() {
+    host::SetCurrent(node);
+    if (!instance) Boot();
+    return Run([this] {
+      if (loop) {
+        loop(*instance);
+      } else {
+        instance->Tick();
+      }
+    });
+  }
+
+  // loops until ms have passed on the board's clock, a pass that doesn't wait is taken to last a millisecond
+  void RunFor(uint64_t ms) {
+    host::SetCurrent(node);
+    uint64_t until = node.clock_us + ms * 1000;
+    while (node.clock_us < until) {
+      uint64_t before = node.clock_us;
+      Loop();
+      if (node.clock_us == before) node.Advance(1000);
+    }
+  }
+
+private:
+  bool Run(std::function<void()> body) {
+    try {
+      body();
+      return true;
+    } catch (host::Restart&) {
+      restarts++;
+      Boot();
+    } catch (host::DeepSleep& sleep) {
+      deep_sleeps++;
+      last_sleep_us = sleep.sleep_us;
+      instance.reset();
+      node.Advance(sleep.sleep_us);
+      Boot();
+    }
+    return false;
+  }
+
+  sketch_function setup;
+  sketch_function loop;
+  char server[32];
+  int hub_port;
+  bool booted = false;
+  std::unique_ptr<Lib> instance;
+};
+
+// Sends one HTTP request to the board's actor server and loops it until the response is complete. Only the loops
+// are outside a PlatformScope, so the allocations counted are those the library made serving the request
+template<typename Lib> std::string Serve(Board<Lib>& board, const std::string& request, uint max_loops = 100) {
+  host::SetCurrent(board.node);
+  std::string response;
+  host::Socket socket;
+  {
+    host::PlatformScope platform;
+    socket = host::Connect(board.node, 80);
+    socket.Write(request);
+  }
+  for (uint i = 0; i < max_loops && !socket.PeerClosed(); i++) {
+    board.Loop();
+    host::PlatformScope platform;
+    board.node.Advance(1000);
+    response += socket.Read();
+  }
+  host::PlatformScope platform;
+  response += socket.Read();
+  return response;
+}
+
+inline int ResponseStatus(const std::string& response) {
+  if (response.compare(0, 9, "HTTP/1.1 ") != 0) return -1;
+  return atoi(response.c_str() + 9);
+}
+
+inline std::string ResponseBody(const std::string& response) {
+  size_t head_end = response.find("\r\n\r\n");
+  return head_end == std::string::npos ? "" : response.substr(head_end + 4);
+}
+
+inline std::string ResponseHeader(const std::string& response, const std::string& name) {
+  size_t start = response.find("\r\n" + name + ": ");
+  if (start == std::string::npos) return "";
+  start += name.size() + 4;
+  return response.substr(start, response.find("\r\n", start) - start);
+}
+
+// the parsed document, or a null value if text isn't valid JSON
+inline Json ParsedJson(const std::string& text) {
+  Json value;
+  if (!ParseJson(text, &value)) return Json();
+  return value;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef IOTHUB_HOST_TEST_H
+#define IOTHUB_HOST_TEST_H
+
+// a minimal test runner, TEST() registers a function and the CHECKs in it report failures without stopping it
+#include <stdio.h>
+#include <string>
+#include <sstream>
+
+struct test_case {
+  const char* name;
+  void (*run)();
+  test_case* next;
+};
+test_case*& TestList();
+void TestFailed(const char* file, int line, const std::string& message);
+
+struct test_registration {
+  test_registration(test_case* test) {
+    test_case** last = &TestList();
+    while (*last != nullptr) last = &(*last)->next;
+    *last = test;
+  }
+};
+
+#define TEST(name) \
+  static void name(); \
+  static test_case name##_case = {#name, name, nullptr}; \
+  static test_registration name##_registration(&name##_case); \
+  static void name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) TestFailed(__FILE__, __LINE__, "CHECK(" #condition ")"); \
+  } while (0)
+
+#define CHECK_EQ(expected, actual) \
+  do { \
+    auto check_expected = (expected); \
+    auto check_actual = (actual); \
+    if (!(check_expected == check_actual)) { \
+      std::ostringstream check_message; \
+      check_message << "CHECK_EQ(" #expected ", " #actual ") expected " << check_expected << " got " << check_actual; \
+      TestFailed(__FILE__, __LINE__, check_message.str()); \
+    } \
+  } while (0)
+
+#endif
@@ -0,0 +1,73 @@
+// the steady state paths never touch the heap, only allocations made by the library itself are counted
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartSensorNode(iotHubLib<2,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Allocation Test Sensor A", "number");
+  iothub.RegisterSensor("Allocation Test Sensor B", "number");
+}
+
+// uploads a reading of each sensor and ticks until the hub has answered both
+static void SendAndWait(Board<iotHubLib<2,0>>& board, float value) {
+  board.lib().Send(0, value);
+  board.lib().Send(1, value + 1);
+  board.Loop();
+  board.Loop();
+}
+
+TEST(AllocationsAreCounted) {
+  uint64_t before = host::Allocations();
+  int* allocated = new int(1);
+  CHECK_EQ((uint64_t)1, host::Allocations() - before);
+  delete allocated;
+}
+
+TEST(SendDoesNotAllocate) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  SendAndWait(board, 20); // the hub connection is opened on the first upload
+
+  uint64_t before = host::Allocations();
+  for (int i = 0; i < 50; i++) {
+    SendAndWait(board, 20 + i * 0.5);
+  }
+  CHECK_EQ((uint64_t)0, host::Allocations() - before);
+  CHECK_EQ((size_t)102, hub.readings.size());
+}
+
+TEST(BatchedSendDoesNotAllocate) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  board.lib().SetFlushThresholds(10, 0, 0);
+  SendAndWait(board, 20);
+
+  uint64_t before = host::Allocations();
+  for (int i = 0; i < 50; i++) {
+    SendAndWait(board, 20 + i * 0.5);
+    board.node.Advance(1000);
+  }
+  board.lib().Flush();
+  CHECK_EQ((uint64_t)0, host::Allocations() - before);
+  CHECK_EQ((size_t)102, hub.readings.size());
+  CHECK(hub.Count("POST", "/api/sensors/data") >= 10);
+}
+
+// an upload the hub refuses is drained and logged without keeping its body
+TEST(FailedSendDoesNotAllocate) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  SendAndWait(board, 20);
+  hub.status_override = 503;
+
+  uint64_t before = host::Allocations();
+  for (int i = 0; i < 10; i++) {
+    SendAndWait(board, 20 + i * 0.5);
+  }
+  CHECK_EQ((uint64_t)0, host::Allocations() - before);
+  CHECK_EQ((size_t)2, hub.readings.size());
+}
@@ -0,0 +1,87 @@
+// readings held back by a sensor's deadband, and the heartbeat and window that still get one through
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartDeadbandNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Deadband Sensor", "number");
+  iothub.SetSensorDeadband(0, 0.5, 60000);
+}
+
+TEST(ReadingInsideTheDeadbandIsNotQueued) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartDeadbandNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+
+  iothub.Send(0, 20);
+  iothub.Flush();
+  CHECK_EQ((size_t)1, hub.readings.size());
+
+  iothub.Send(0, 20.4);
+  iothub.Send(0, 19.6);
+  CHECK_EQ(0u, iothub.QueuedReadings());
+  iothub.Flush();
+  CHECK_EQ((size_t)1, hub.readings.size());
+
+  // measured from the last reading queued, not the last one sent
+  iothub.Send(0, 20.6);
+  iothub.Flush();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  iothub.Send(0, 20.2);
+  CHECK_EQ(0u, iothub.QueuedReadings());
+  CHECK(fabs(hub.readings.back().value - 20.6) < 0.001);
+}
+
+TEST(HeartbeatSendsAnUnchangedReading) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartDeadbandNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+
+  iothub.Send(0, 20);
+  iothub.Flush();
+  board.node.Advance(59000000);
+  iothub.Send(0, 20);
+  CHECK_EQ(0u, iothub.QueuedReadings());
+
+  board.node.Advance(1000000);
+  iothub.Send(0, 20);
+  iothub.Flush();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  // and the heartbeat starts over from there
+  iothub.Send(0, 20);
+  CHECK_EQ(0u, iothub.QueuedReadings());
+}
+
+// no heartbeat, each loop of a sensor only node sleeps longer than one
+static void StartWindowNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Deadband Sensor", "number");
+  iothub.SetSensorDeadband(0, 0.5);
+  iothub.SetSensorWindow(0, 10000);
+}
+
+// a window's samples queue nothing until it closes, the mean of the next one is then held back by the deadband
+TEST(WindowQueuesOnceItCloses) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartWindowNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+
+  iothub.Send(0, 19);
+  iothub.Send(0, 21);
+  CHECK_EQ(0u, iothub.QueuedReadings());
+  board.Loop(); // the window closes in Tick() and its upload completes in the next
+  board.Loop();
+  CHECK_EQ((size_t)1, hub.readings.size());
+  if (hub.readings.empty()) return;
+  CHECK_EQ(20.0, hub.readings[0].value);
+  CHECK_EQ(2u, hub.readings[0].count);
+
+  iothub.Send(0, 20.2);
+  board.Loop();
+  board.Loop();
+  CHECK_EQ((size_t)1, hub.readings.size());
+}
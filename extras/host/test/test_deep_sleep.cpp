@@ -0,0 +1,125 @@
+// the deep sleep cycle, each Tick() ends in ESP.deepSleep() which the board catches and boots again from
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+#define test_sleep_ms 300000
+#define test_upload_age_ms 3600000
+
+static float battery_level = 0;
+static float ReadBattery() {
+  battery_level += 1;
+  return battery_level;
+}
+
+static void StartDeepSleepNode(iotHubLib<1,0>& iothub) {
+  iothub.EnableDeepSleep(test_sleep_ms, test_upload_age_ms);
+  iothub.Start();
+  iothub.RegisterSensor("Deep Sleep Battery", "number", ReadBattery, test_sleep_ms);
+}
+
+static void StartNeverUploadingNode(iotHubLib<1,0>& iothub) {
+  iothub.EnableDeepSleep(test_sleep_ms, 0xFFFFFFFF);
+  iothub.Start();
+  iothub.RegisterSensor("Deep Sleep Battery", "number", ReadBattery, test_sleep_ms);
+}
+
+TEST(ReadingsWaitInRtcMemoryUntilTheUploadAge) {
+  StandInHub hub;
+  battery_level = 0;
+  Board<iotHubLib<1,0>> board(StartDeepSleepNode);
+  board.Boot();
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/register"));
+  uint32_t connects_after_boot = board.node.wifi_connects;
+
+  // every wake but the one that uploads keeps the radio off
+  uint wakes = test_upload_age_ms / test_sleep_ms;
+  for (uint i = 0; i < wakes - 1; i++) {
+    CHECK(!board.Loop());
+  }
+  CHECK_EQ((uint)wakes - 1, board.deep_sleeps);
+  CHECK_EQ((uint64_t)test_sleep_ms * 1000, board.last_sleep_us);
+  CHECK_EQ(connects_after_boot, board.node.wifi_connects);
+
+  // the wake before the upload leaves the radio on, so the next one starts connecting as soon as it boots
+  CHECK(!board.Loop());
+  CHECK_EQ(connects_after_boot + 1, board.node.wifi_connects);
+  CHECK_EQ((size_t)0, hub.readings.size());
+
+  CHECK(!board.Loop());
+  CHECK_EQ((size_t)wakes + 1, hub.readings.size());
+  CHECK_EQ(connects_after_boot + 1, board.node.wifi_connects);
+  // oldest first, each sampled a sleep apart, and ids came from RTC memory without asking the hub
+  for (size_t i = 0; i < hub.readings.size(); i++) {
+    CHECK_EQ((double)(i + 1), hub.readings[i].value);
+    CHECK(hub.readings[i].age_known);
+    double expected_age = (double)(wakes - i) * test_sleep_ms;
+    CHECK(hub.readings[i].age_ms >= expected_age && hub.readings[i].age_ms < expected_age + test_sleep_ms);
+  }
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/register"));
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/nodes/validate"));
+
+  // the buffer starts again after the upload
+  hub.Clear();
+  CHECK(!board.Loop());
+  CHECK_EQ((size_t)0, hub.readings.size());
+}
+
+TEST(FullRtcBufferUploadsBeforeTheAge) {
+  StandInHub hub;
+  battery_level = 0;
+  Board<iotHubLib<1,0>> board(StartNeverUploadingNode);
+  board.Boot();
+
+  uint wakes = 0;
+  while (hub.readings.empty() && wakes < 200) {
+    board.Loop();
+    wakes++;
+  }
+  CHECK(!hub.readings.empty());
+  CHECK(wakes < 200);
+  CHECK_EQ((size_t)wakes, hub.readings.size()); // nothing was dropped to make room
+  for (size_t i = 0; i < hub.readings.size(); i++) {
+    CHECK_EQ((double)(i + 1), hub.readings[i].value);
+  }
+}
+
+TEST(FailedUploadKeepsReadingsBuffered) {
+  StandInHub hub;
+  battery_level = 0;
+  Board<iotHubLib<1,0>> board(StartDeepSleepNode);
+  board.Boot();
+  uint wakes = test_upload_age_ms / test_sleep_ms;
+  for (uint i = 0; i < wakes; i++) {
+    board.Loop();
+  }
+
+  hub.status_override = 503;
+  board.Loop();
+  CHECK_EQ((size_t)0, hub.readings.size());
+  CHECK(hub.Count("POST", "/api/sensors/data") >= 1);
+
+  hub.status_override = 0;
+  board.Loop();
+  CHECK_EQ((size_t)wakes + 2, hub.readings.size());
+  for (size_t i = 0; i < hub.readings.size(); i++) {
+    CHECK_EQ((double)(i + 1), hub.readings[i].value);
+  }
+}
+
+// a power cycle loses RTC memory, the node then loads its ids from EEPROM and checks them with the hub
+TEST(LostRtcMemoryFallsBackToEeprom) {
+  StandInHub hub;
+  battery_level = 0;
+  Board<iotHubLib<1,0>> board(StartDeepSleepNode);
+  board.Boot();
+  std::string id = hub.IdOf("Deep Sleep Battery", 's');
+  board.Loop();
+  board.Loop();
+
+  memset(board.node.rtc, 0, sizeof(board.node.rtc));
+  board.Boot();
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/register"));
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/validate"));
+  CHECK_EQ(id, hub.IdOf("Deep Sleep Battery", 's'));
+}
@@ -0,0 +1,138 @@
+// uploads and actor requests in CBOR, which the stand-in hub decodes into the same documents as JSON
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartSensorNode(iotHubLib<2,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Encoding Test Sensor A", "number");
+  iothub.RegisterSensor("Encoding Test Sensor B", "number");
+}
+
+static int int_actor_state = 0;
+static void IntActorChanged(int state) {
+  int_actor_state = state;
+}
+
+static void StartActorNode(iotHubLib<0,1>& iothub) {
+  iothub.Start();
+  iothub.RegisterActor("Encoding Test Actor", IntActorChanged);
+}
+
+// sends the same batch in each encoding and returns the readings the hub took from it
+static std::vector<StandInHub::reading> UploadBatch(iothub_encoding encoding, size_t* body_size) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<2,0>& iothub = board.lib();
+  iothub.SetEncoding(encoding);
+  iothub.SetFlushThresholds(10, 0, 0);
+  for (int i = 0; i < 5; i++) {
+    iothub.Send(0, 21.5f + i * 0.1f);
+    iothub.Send(1, -1.234567e-20f * (i + 1));
+    board.node.Advance(250000);
+  }
+  board.Loop();
+  const StandInHub::request* upload = hub.Last("POST", "/api/sensors/data");
+  CHECK(upload != nullptr);
+  if (upload == nullptr) return std::vector<StandInHub::reading>();
+  CHECK_EQ(200, upload->status);
+  CHECK_EQ(encoding == encoding_cbor, upload->cbor);
+  *body_size = upload->body.size();
+  return hub.readings;
+}
+
+TEST(CborBatchCarriesTheSameReadings) {
+  size_t json_size = 0;
+  size_t cbor_size = 0;
+  std::vector<StandInHub::reading> json = UploadBatch(encoding_json, &json_size);
+  std::vector<StandInHub::reading> cbor = UploadBatch(encoding_cbor, &cbor_size);
+  CHECK_EQ((size_t)10, json.size());
+  CHECK_EQ((size_t)10, cbor.size());
+  for (size_t i = 0; i < json.size() && i < cbor.size(); i++) {
+    CHECK_EQ(json[i].age_ms, cbor[i].age_ms);
+    // JSON carries seven significant digits, CBOR the float's bits
+    CHECK(fabs(json[i].value - cbor[i].value) <= fabs(cbor[i].value) * 1e-6);
+  }
+  CHECK(cbor_size < json_size);
+}
+
+TEST(CborSingleAndWindowedReadings) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<2,0>& iothub = board.lib();
+  iothub.SetEncoding(encoding_cbor);
+  iothub.Send(0, 19.25);
+  board.Loop();
+  CHECK_EQ((size_t)1, hub.readings.size());
+  CHECK_EQ(hub.IdOf("Encoding Test Sensor A", 's'), hub.readings[0].sensor_id);
+  CHECK_EQ(19.25, hub.readings[0].value);
+
+  iothub.SetSensorWindow(1, 1000);
+  iothub.Send(1, 1);
+  iothub.Send(1, 2);
+  iothub.Send(1, 6);
+  board.node.Advance(1001000);
+  board.Loop();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  if (hub.readings.size() == 2) {
+    CHECK_EQ(3.0, hub.readings[1].value);
+    CHECK_EQ(1.0, hub.readings[1].min);
+    CHECK_EQ(6.0, hub.readings[1].max);
+    CHECK_EQ(3u, hub.readings[1].count);
+  }
+}
+
+TEST(FallsBackToJsonWhenTheHubRefusesCbor) {
+  StandInHub hub;
+  hub.cbor_supported = false;
+  Board<iotHubLib<2,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<2,0>& iothub = board.lib();
+  iothub.SetEncoding(encoding_cbor);
+  iothub.Send(0, 19.25);
+  board.Loop();
+  CHECK_EQ(415, hub.requests.back().status);
+  CHECK_EQ((size_t)0, hub.readings.size());
+
+  iothub.Send(0, 19.5);
+  board.Loop();
+  CHECK(!hub.requests.back().cbor);
+  CHECK_EQ((size_t)1, hub.readings.size());
+}
+
+TEST(ActorServerSpeaksCbor) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+  std::string id = hub.IdOf("Encoding Test Actor", 'a');
+
+  // {"state": 300}
+  std::string body = std::string("\xA1\x65state\x19\x01\x2C", 10);
+  std::string response = Serve(board, "POST /actors/" + id + " HTTP/1.1\r\nContent-Type: application/cbor\r\n"
+  "Accept: application/cbor\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+  CHECK_EQ(200, ResponseStatus(response));
+  CHECK_EQ(300, int_actor_state);
+
+  response = Serve(board, "GET /actors/" + id + " HTTP/1.1\r\nAccept: application/cbor\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(response));
+  CHECK_EQ(std::string("application/cbor"), ResponseHeader(response, "Content-Type"));
+  Json state;
+  CHECK(ParseCbor(ResponseBody(response), &state));
+  CHECK_EQ(300.0, state["state"].number);
+  CHECK_EQ(id, state["id"].string);
+}
+
+TEST(CborDecoderRejectsWhatJsonCannotHold) {
+  Json value;
+  CHECK(ParseCbor(std::string("\xA2\x61" "a\x01\x61" "b\x83\xF5\xF6\xF9\x3C\x00", 12), &value));
+  CHECK_EQ(1.0, value["a"].number);
+  CHECK_EQ((size_t)3, value["b"].Size());
+  CHECK_EQ(1.0, value["b"][2].number); // half precision 1.0
+  CHECK(!ParseCbor(std::string("\xFA\x7F\xC0\x00\x00", 5), &value)); // NaN
+  CHECK(!ParseCbor(std::string("\xA1\x01\x01", 3), &value)); // integer key
+  CHECK(!ParseCbor(std::string("\x9F\x01\xFF", 3), &value)); // indefinite length
+  CHECK(!ParseCbor(std::string("\x01\x01", 2), &value)); // trailing bytes
+  CHECK(!ParseCbor(std::string("\x9B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 9), &value)); // impossible length
+}
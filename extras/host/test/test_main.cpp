@@ -0,0 +1,41 @@
+#include "test.h"
+#include "host.h"
+
+#include <string.h>
+
+test_case*& TestList() {
+  static test_case* tests = nullptr;
+  return tests;
+}
+
+static int failures = 0;
+
+void TestFailed(const char* file, int line, const std::string& message) {
+  printf("  %s:%d: %s\n", file, line, message.c_str());
+  failures++;
+}
+
+// runs every test, or only those whose names contain the first argument
+int main(int argc, char** argv) {
+  int run = 0;
+  int failed = 0;
+  for (test_case* test = TestList(); test != nullptr; test = test->next) {
+    if (argc > 1 && strstr(test->name, argv[1]) == nullptr) continue;
+    host::network = host::NetworkConfig();
+    int failures_before = failures;
+    try {
+      test->run();
+    } catch (...) {
+      TestFailed(__FILE__, __LINE__, "unexpected exception");
+    }
+    run++;
+    if (failures != failures_before) {
+      failed++;
+      printf("FAIL %s\n", test->name);
+    } else {
+      printf("ok   %s\n", test->name);
+    }
+  }
+  printf("%d tests, %d failed\n", run, failed);
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+// the metrics endpoint, read the way Prometheus would scrape it
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void ActorChanged(int state) {}
+
+static void StartMetricsNode(iotHubLib<1,1>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Metrics Test Sensor", "number");
+  iothub.RegisterActor("Metrics Test Actor", ActorChanged);
+}
+
+// the value of the sample with this name and labels, -1 if the scrape doesn't have it
+static double Sample(const std::string& metrics, const std::string& name) {
+  size_t start = metrics.find("\n" + name + " ");
+  if (start == std::string::npos) return -1;
+  return atof(metrics.c_str() + start + name.size() + 2);
+}
+
+static std::string Scrape(Board<iotHubLib<1,1>>& board) {
+  std::string response = Serve(board, "GET /metrics HTTP/1.1\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(response));
+  return ResponseBody(response);
+}
+
+TEST(UploadsMoveTheCounters) {
+  StandInHub hub;
+  Board<iotHubLib<1,1>> board(StartMetricsNode);
+  board.Boot();
+
+  std::string before = Scrape(board);
+  CHECK_EQ(0.0, Sample(before, "iothub_upload_time_ms_count"));
+  CHECK_EQ(0.0, Sample(before, "iothub_upload_time_ms_bucket{le=\"+Inf\"}"));
+  CHECK_EQ(0.0, Sample(before, "iothub_readings_queued"));
+  CHECK(Sample(before, "iothub_registered_after_ms") > 0);
+  double answered = Sample(before, "iothub_hub_responses_total{class=\"2xx\"}");
+  double failed = Sample(before, "iothub_hub_responses_total{class=\"5xx\"}");
+  CHECK(answered >= 1); // the registration
+
+  board.lib().Send(0, 1);
+  board.lib().Flush();
+  hub.status_override = 503;
+  board.lib().Send(0, 2);
+  board.lib().Flush();
+  hub.status_override = 0;
+
+  std::string after = Scrape(board);
+  CHECK_EQ(2.0, Sample(after, "iothub_upload_time_ms_count"));
+  CHECK_EQ(2.0, Sample(after, "iothub_upload_time_ms_bucket{le=\"+Inf\"}"));
+  CHECK(Sample(after, "iothub_upload_time_ms_sum") >= 0);
+  CHECK_EQ(answered + 1, Sample(after, "iothub_hub_responses_total{class=\"2xx\"}"));
+  CHECK_EQ(failed + 1, Sample(after, "iothub_hub_responses_total{class=\"5xx\"}"));
+  CHECK_EQ(1.0, Sample(after, "iothub_readings_dropped_total")); // no offline log to keep it
+  CHECK(Sample(after, "iothub_request_time_us_count") >= 1); // the first scrape
+}
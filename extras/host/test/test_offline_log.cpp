@@ -0,0 +1,118 @@
+// readings that fail to upload go to the offline log in the fake LittleFS and are replayed once the hub answers
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartLoggingNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.EnableOfflineLog();
+  iothub.RegisterSensor("Offline Log Sensor", "number");
+}
+
+static const StandInHub::reading* FindReading(const StandInHub& hub, double value) {
+  for (const StandInHub::reading& reading : hub.readings) {
+    if (reading.value == value) return &reading;
+  }
+  return nullptr;
+}
+
+TEST(LoggedReadingIsReplayedWithItsAge) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartLoggingNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+
+  hub.status_override = 503;
+  iothub.Send(0, 5);
+  board.Loop();
+  CHECK_EQ(1u, iothub.LoggedReadings());
+
+  board.node.Advance(30000000);
+  hub.status_override = 0;
+  iothub.Send(0, 6);
+  board.Loop();
+  board.Loop();
+  CHECK_EQ(0u, iothub.LoggedReadings());
+  const StandInHub::reading* replayed = FindReading(hub, 5);
+  CHECK(replayed != nullptr);
+  if (replayed == nullptr) return;
+  CHECK(replayed->age_known);
+  CHECK(replayed->age_ms >= 30000);
+}
+
+// millis() restarts with the board, so a reading logged before it has no age the node could send
+TEST(ReadingLoggedBeforeARestartIsSentWithAnUnknownAge) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartLoggingNode);
+  board.Boot();
+
+  hub.status_override = 503;
+  board.lib().Send(0, 5);
+  board.Loop();
+  CHECK_EQ(1u, board.lib().LoggedReadings());
+
+  hub.status_override = 0;
+  board.Boot();
+  board.Loop();
+  CHECK_EQ(0u, board.lib().LoggedReadings());
+  const StandInHub::reading* replayed = FindReading(hub, 5);
+  CHECK(replayed != nullptr);
+  if (replayed == nullptr) return;
+  CHECK(!replayed->age_known);
+  const StandInHub::request* upload = hub.Last("POST", "/api/sensors/data");
+  CHECK(upload != nullptr);
+  if (upload != nullptr) CHECK(upload->body.find("\"age\":null") != std::string::npos);
+}
+
+// a hub without the batch url is replayed to a reading at a time on the sensor's own url, a restart doesn't change that
+TEST(ReplayWithoutBulkSupportGoesToTheSensorUrl) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartLoggingNode);
+  board.Boot();
+
+  hub.status_override = 503;
+  board.lib().Send(0, 5);
+  board.Loop();
+  board.lib().Send(0, 6);
+  board.Loop();
+  CHECK_EQ(2u, board.lib().LoggedReadings());
+
+  hub.status_override = 0;
+  hub.bulk_supported = false;
+  board.Boot();
+  board.Loop();
+  board.Loop();
+  CHECK_EQ(0u, board.restarts);
+  CHECK_EQ(0u, board.lib().LoggedReadings());
+  CHECK(FindReading(hub, 5) != nullptr);
+  CHECK(FindReading(hub, 6) != nullptr);
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ((size_t)1, hub.nodes.size()); // not registered again
+}
+
+// a replayed batch the hub 404s stays in the log and is replayed again a reading at a time
+TEST(RefusedReplayBatchStaysLogged) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartLoggingNode);
+  board.Boot();
+
+  hub.status_override = 503;
+  board.lib().Send(0, 5);
+  board.Loop();
+  board.lib().Send(0, 6);
+  board.Loop();
+  CHECK_EQ(2u, board.lib().LoggedReadings());
+
+  // logged readings are replayed once a live one gets through
+  hub.status_override = 0;
+  hub.bulk_supported = false;
+  board.lib().Send(0, 7);
+  for (uint i = 0; i < 4; i++) {
+    board.Loop();
+  }
+  CHECK_EQ(0u, board.restarts);
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ(0u, board.lib().LoggedReadings());
+  CHECK(FindReading(hub, 5) != nullptr);
+  CHECK(FindReading(hub, 6) != nullptr);
+}
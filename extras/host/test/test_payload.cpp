@@ -0,0 +1,65 @@
+// batched uploads at the largest size their readings can format to
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartSensorNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Payload Test Sensor", "number");
+}
+
+// every reading has the longest value and, but for the last, a ten digit age
+TEST(FullBatchOfLongestReadingsFits) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(reading_queue_length, 0, 0);
+
+  for (uint i = 0; i < reading_queue_length - 1; i++) {
+    iothub.Send(0, -1.234567e-37);
+  }
+  board.node.Advance(4100000000000ull); // 4.1e9ms, all ten digits of the age
+  iothub.Send(0, -1.234567e-37);
+  board.Loop();
+
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ((size_t)reading_queue_length, hub.readings.size());
+  const StandInHub::request* batch = hub.Last("POST", "/api/sensors/data");
+  if (batch != nullptr) {
+    CHECK_EQ(200, batch->status);
+    // the estimate is what keeps uploads from overflowing, it has to hold for the longest reading
+    CHECK(batch->body.size() <= (size_t)reading_queue_length * reading_json_length + 2);
+    CHECK(batch->body.size() > (size_t)(reading_queue_length - 1) * (reading_json_length - 1));
+  }
+  if (!hub.readings.empty()) {
+    CHECK(hub.readings[0].age_ms >= 4100000000.0);
+  }
+}
+
+// windowed readings are too long for a full batch to fit, they are split rather than dropped
+TEST(WindowedReadingsAreSplitIntoBatches) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  iotHubLib<1,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(reading_queue_length, 0, 0);
+  iothub.SetSensorWindow(0, 1000);
+
+  for (uint i = 0; i < reading_queue_length; i++) {
+    iothub.Send(0, -1.234567e-37);
+    iothub.Send(0, -3.402823e+38);
+    board.node.Advance(1001000);
+    board.Loop(); // closes the window
+  }
+  iothub.Flush();
+
+  CHECK(hub.Count("POST", "/api/sensors/data") >= 2);
+  CHECK_EQ((size_t)reading_queue_length, hub.readings.size());
+  for (const StandInHub::request& request : hub.requests) {
+    CHECK_EQ(200, request.status);
+  }
+  for (const StandInHub::reading& received : hub.readings) {
+    CHECK_EQ(2u, received.count);
+  }
+}
@@ -0,0 +1,87 @@
+// push updates over MQTT, with the test playing the broker through a host::Listener
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static int int_actor_state = 0;
+static void IntActorChanged(int state) {
+  int_actor_state = state;
+}
+
+static void StartPushNode(iotHubLib<0,1>& iothub) {
+  iothub.Start();
+  iothub.EnablePushUpdates("broker.local");
+  iothub.RegisterActor("Push Test Actor", IntActorChanged);
+}
+
+// a broker that keeps accepting connections and dropping them before its CONNACK
+TEST(ReconnectsBackOffWhileTheBrokerFails) {
+  StandInHub hub;
+  host::Listener broker("broker.local", 1883);
+  Board<iotHubLib<0,1>> board(StartPushNode);
+  board.Boot();
+
+  std::vector<uint64_t> attempts_us;
+  for (uint i = 0; i < 1800; i++) {
+    board.RunFor(1000);
+    host::Socket connection = broker.Accept();
+    if (!connection.Valid()) continue;
+    attempts_us.push_back(board.node.clock_us);
+    host::PlatformScope platform;
+    connection.Close();
+  }
+  CHECK(attempts_us.size() >= 6);
+  uint64_t expected_gap_ms = push_reconnect_interval;
+  for (size_t i = 1; i < attempts_us.size(); i++) {
+    // the drop is noticed on a later Tick(), so a gap can run a second or two over
+    uint64_t gap_ms = (attempts_us[i] - attempts_us[i - 1]) / 1000;
+    CHECK(gap_ms >= expected_gap_ms && gap_ms <= expected_gap_ms + 2000);
+    expected_gap_ms = expected_gap_ms * 2 < push_reconnect_max_interval ? expected_gap_ms * 2 : push_reconnect_max_interval;
+  }
+}
+
+static void Connack(host::Socket& connection) {
+  host::PlatformScope platform;
+  connection.Write(std::string("\x20\x02\x00\x00", 4));
+}
+
+// a PUBLISH whose remaining length takes two bytes, the second arriving in a later segment than the first
+TEST(RemainingLengthSplitAcrossSegments) {
+  StandInHub hub;
+  host::Listener broker("broker.local", 1883);
+  Board<iotHubLib<0,1>> board(StartPushNode);
+  board.Boot();
+  std::string id = hub.IdOf("Push Test Actor", 'a');
+  int_actor_state = 0;
+
+  board.RunFor(100);
+  host::Socket connection = broker.Accept();
+  CHECK(connection.Valid());
+  if (!connection.Valid()) return;
+  Connack(connection);
+  board.RunFor(100);
+  CHECK(board.lib().PushConnected());
+
+  std::string topic = "iothub/actors/" + id + "/state";
+  std::string payload = "{\"state\":42,\"padding\":\"" + std::string(100, 'a') + "\"}";
+  size_t remaining = 2 + topic.size() + payload.size();
+  CHECK(remaining >= 128 && remaining < 16384);
+  std::string rest;
+  rest += (char)(remaining >> 7);
+  rest += (char)(topic.size() >> 8);
+  rest += (char)topic.size();
+  rest += topic + payload;
+  {
+    host::PlatformScope platform;
+    connection.Write(std::string("\x30", 1) + (char)(0x80 | (remaining & 0x7F)));
+  }
+  board.RunFor(100);
+  CHECK(board.lib().PushConnected());
+  {
+    host::PlatformScope platform;
+    connection.Write(rest);
+  }
+  board.RunFor(100);
+  CHECK(board.lib().PushConnected());
+  CHECK_EQ(42, int_actor_state);
+}
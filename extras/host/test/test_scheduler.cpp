@@ -0,0 +1,79 @@
+// sensors registered with a period are sampled by Tick() on their own schedules
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static std::vector<unsigned long> fast_samples;
+static std::vector<unsigned long> slow_samples;
+
+static float ReadFast() {
+  fast_samples.push_back(millis());
+  return 1;
+}
+static float ReadSlow() {
+  slow_samples.push_back(millis());
+  return 2;
+}
+
+// each sample comes a period after the one before it, give or take the few ms a tick can run late
+static void CheckPeriod(const std::vector<unsigned long>& samples, unsigned long period) {
+  for (size_t i = 1; i < samples.size(); i++) {
+    unsigned long gap = samples[i] - samples[i - 1];
+    CHECK(gap + 10 >= period && gap <= period + 10);
+  }
+}
+
+static void StartScheduledNode(iotHubLib<2,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Scheduler Fast Sensor", "number", ReadFast, 10000);
+  iothub.RegisterSensor("Scheduler Slow Sensor", "number", ReadSlow, 25000);
+}
+
+// a sensor only node sleeps in Tick() until the next sensor is due rather than for its whole sleep interval
+TEST(ScheduledSensorsRunAtTheirPeriods) {
+  StandInHub hub;
+  fast_samples.clear();
+  slow_samples.clear();
+  Board<iotHubLib<2,0>> board(StartScheduledNode);
+  board.Boot();
+
+  board.RunFor(100000);
+  CHECK(fast_samples.size() >= 10 && fast_samples.size() <= 11);
+  CHECK(slow_samples.size() >= 4 && slow_samples.size() <= 5);
+  CheckPeriod(fast_samples, 10000);
+  CheckPeriod(slow_samples, 25000);
+  CHECK(board.lib().TimeUntilNextJob() <= 10000);
+  board.lib().Flush();
+  CHECK_EQ(fast_samples.size() + slow_samples.size(), hub.readings.size());
+}
+
+static void ActorChanged(int state) {}
+
+static void StartScheduledActorNode(iotHubLib<1,1>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Scheduler Fast Sensor", "number", ReadFast, 10000);
+  iothub.RegisterActor("Scheduler Actor", ActorChanged);
+}
+
+// with actors Tick() returns straight away, so the server is still polled every loop between samples
+TEST(ScheduledSensorsLeaveTheServerPolled) {
+  StandInHub hub;
+  fast_samples.clear();
+  Board<iotHubLib<1,1>> board(StartScheduledActorNode);
+  board.Boot();
+
+  uint64_t before = board.node.clock_us;
+  board.Loop();
+  CHECK(board.node.clock_us - before < 1000000);
+
+  board.RunFor(25000);
+  CHECK(fast_samples.size() >= 3 && fast_samples.size() <= 4);
+  CheckPeriod(fast_samples, 10000);
+
+  size_t samples = fast_samples.size();
+  std::string response = Serve(board, "GET /actors HTTP/1.1\r\n\r\n", 5);
+  CHECK_EQ(200, ResponseStatus(response));
+  CHECK_EQ(samples, fast_samples.size()); // not due again yet
+  board.RunFor(10000);
+  CHECK_EQ(samples + 1, fast_samples.size());
+}
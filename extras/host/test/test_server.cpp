@@ -0,0 +1,205 @@
+// how the actor server takes requests: only once all of a request has arrived, and only with states its actors can hold
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static int int_actor_state = 0;
+static void IntActorChanged(int state) {
+  int_actor_state = state;
+}
+
+static void StartActorNode(iotHubLib<0,1>& iothub) {
+  iothub.Start();
+  iothub.RegisterActor("Server Test Actor", IntActorChanged);
+}
+
+// writes the request in parts, looping the board between them, and returns what the board answered
+static std::string ServeInParts(Board<iotHubLib<0,1>>& board, const std::vector<std::string>& parts,
+uint loops_between = 5) {
+  host::SetCurrent(board.node);
+  host::Socket socket;
+  std::string response;
+  {
+    host::PlatformScope platform;
+    socket = host::Connect(board.node, 80);
+  }
+  for (const std::string& part : parts) {
+    {
+      host::PlatformScope platform;
+      socket.Write(part);
+    }
+    for (uint i = 0; i < loops_between; i++) {
+      board.Loop();
+      board.node.Advance(1000);
+    }
+    host::PlatformScope platform;
+    response += socket.Read();
+  }
+  for (uint i = 0; i < 100 && !socket.PeerClosed(); i++) {
+    board.Loop();
+    board.node.Advance(1000);
+    host::PlatformScope platform;
+    response += socket.Read();
+  }
+  return response;
+}
+
+TEST(SplitHeadIsServedOnceComplete) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+  std::string id = hub.IdOf("Server Test Actor", 'a');
+
+  std::string response = ServeInParts(board, {"GET /act", "ors/" + id + " HTTP/1.1\r\nHo", "st: node\r\n", "\r\n"});
+  CHECK_EQ(200, ResponseStatus(response));
+  CHECK_EQ(id, ParsedJson(ResponseBody(response))["id"].string);
+}
+
+TEST(BodyIsWaitedFor) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+  std::string id = hub.IdOf("Server Test Actor", 'a');
+  int_actor_state = 0;
+
+  std::string response = ServeInParts(board, {"POST /actors/" + id + " HTTP/1.1\r\nContent-Type: application/json\r\n"
+  "content-length: 13\r\n\r\n", "{\"state\":", "123}"});
+  CHECK_EQ(200, ResponseStatus(response));
+  CHECK_EQ(123, int_actor_state);
+}
+
+TEST(OversizedHeadIsRefused) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+
+  std::string response = ServeInParts(board, {"GET /actors HTTP/1.1\r\nX-Padding: " +
+  std::string(max_request_head_length, 'a') + "\r\n\r\n"});
+  CHECK_EQ(431, ResponseStatus(response));
+}
+
+TEST(UnfinishedRequestTimesOut) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+
+  host::SetCurrent(board.node);
+  host::Socket socket;
+  {
+    host::PlatformScope platform;
+    socket = host::Connect(board.node, 80);
+    socket.Write("GET /actors HTTP/1.1\r\n");
+  }
+  board.RunFor(server_request_timeout - 100);
+  CHECK(!socket.PeerClosed());
+  board.RunFor(200);
+  host::PlatformScope platform;
+  CHECK(socket.PeerClosed());
+  CHECK_EQ(std::string(""), socket.Read());
+}
+
+static float float_actor_state = 0;
+static void FloatActorChanged(float state) {
+  float_actor_state = state;
+}
+
+static void StartRangeNode(iotHubLib<0,2>& iothub) {
+  iothub.Start();
+  iothub.RegisterActor("Range Test Int Actor", IntActorChanged);
+  iothub.RegisterActor("Range Test Float Actor", FloatActorChanged);
+}
+
+static std::string PostState(Board<iotHubLib<0,2>>& board, const std::string& url, const std::string& body,
+const char* content_type = "application/json") {
+  return Serve(board, "POST " + url + " HTTP/1.1\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+  std::to_string(body.size()) + "\r\n\r\n" + body);
+}
+
+// only JSON's number grammar is a number, and a state has to fit the actor's type or nothing changes
+TEST(StatesOutsideTheGrammarOrRangeAreRefused) {
+  StandInHub hub;
+  Board<iotHubLib<0,2>> board(StartRangeNode);
+  board.Boot();
+  std::string int_url = "/actors/" + hub.IdOf("Range Test Int Actor", 'a');
+  std::string float_url = "/actors/" + hub.IdOf("Range Test Float Actor", 'a');
+  int_actor_state = 7;
+  float_actor_state = 7;
+
+  const char* refused[] = {"nan", "inf", "-inf", "0x10", "1e999", "1e30", "2147483648", "01", "1.", ".5", "+1", "1e"};
+  for (const char* state : refused) {
+    CHECK_EQ(400, ResponseStatus(PostState(board, int_url, std::string("{\"state\":") + state + "}")));
+  }
+  CHECK_EQ(7, int_actor_state);
+  CHECK_EQ(400, ResponseStatus(PostState(board, float_url, "{\"state\":1e39}")));
+  CHECK_EQ(7.0f, float_actor_state);
+
+  CHECK_EQ(200, ResponseStatus(PostState(board, int_url, "{\"state\":-2147483648}")));
+  CHECK_EQ(INT_MIN, int_actor_state);
+  CHECK_EQ(200, ResponseStatus(PostState(board, int_url, "{\"state\":true}")));
+  CHECK_EQ(1, int_actor_state);
+  CHECK_EQ(200, ResponseStatus(PostState(board, float_url, "{\"state\":1e30}")));
+  CHECK_EQ(1e30f, float_actor_state);
+  CHECK_EQ(200, ResponseStatus(PostState(board, float_url, "{\"state\":-0.5E-3}")));
+  CHECK_EQ(-0.5e-3f, float_actor_state);
+
+  // CBOR {"state": float32 infinity} and {"state": 2^32}
+  CHECK_EQ(400, ResponseStatus(PostState(board, float_url, std::string("\xA1\x65state\xFA\x7F\x80\x00\x00", 11),
+  "application/cbor")));
+  CHECK_EQ(400, ResponseStatus(PostState(board, int_url, std::string("\xA1\x65state\x1B\x00\x00\x00\x01\x00\x00\x00\x00",
+  15), "application/cbor")));
+  CHECK_EQ(1, int_actor_state);
+}
+
+TEST(BulkUpdateWithAnOutOfRangeStateChangesNothing) {
+  StandInHub hub;
+  Board<iotHubLib<0,2>> board(StartRangeNode);
+  board.Boot();
+  std::string int_id = hub.IdOf("Range Test Int Actor", 'a');
+  std::string float_id = hub.IdOf("Range Test Float Actor", 'a');
+  int_actor_state = 7;
+  float_actor_state = 7;
+
+  std::string body = "[{\"id\":\"" + float_id + "\",\"state\":2},{\"id\":\"" + int_id + "\",\"state\":1e10}]";
+  CHECK_EQ(400, ResponseStatus(PostState(board, "/actors", body)));
+  CHECK_EQ(7, int_actor_state);
+  CHECK_EQ(7.0f, float_actor_state);
+}
+
+// a GET with the ETag of the states the hub already has is answered 304 with no body, until a state changes
+TEST(MatchingEtagIsNotModified) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+  std::string url = "/actors/" + hub.IdOf("Server Test Actor", 'a');
+
+  std::string listing = Serve(board, "GET /actors HTTP/1.1\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(listing));
+  std::string etag = ResponseHeader(listing, "ETag");
+  CHECK(!etag.empty());
+  std::string single = Serve(board, "GET " + url + " HTTP/1.1\r\n\r\n");
+  CHECK_EQ(etag, ResponseHeader(single, "ETag"));
+
+  for (const std::string& path : {std::string("/actors"), url}) {
+    std::string cached = Serve(board, "GET " + path + " HTTP/1.1\r\nIf-None-Match: " + etag + "\r\n\r\n");
+    CHECK_EQ(304, ResponseStatus(cached));
+    CHECK_EQ(etag, ResponseHeader(cached, "ETag"));
+    CHECK_EQ(std::string(""), ResponseBody(cached));
+  }
+  CHECK_EQ(200, ResponseStatus(Serve(board, "GET /actors HTTP/1.1\r\nIf-None-Match: \"stale\"\r\n\r\n")));
+}
+
+TEST(EtagChangesWithActorState) {
+  StandInHub hub;
+  Board<iotHubLib<0,1>> board(StartActorNode);
+  board.Boot();
+  std::string url = "/actors/" + hub.IdOf("Server Test Actor", 'a');
+  std::string etag = ResponseHeader(Serve(board, "GET /actors HTTP/1.1\r\n\r\n"), "ETag");
+
+  std::string body = "{\"state\":5}";
+  CHECK_EQ(200, ResponseStatus(Serve(board, "POST " + url + " HTTP/1.1\r\nContent-Type: application/json\r\n"
+  "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body)));
+  std::string listing = Serve(board, "GET /actors HTTP/1.1\r\nIf-None-Match: " + etag + "\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(listing));
+  CHECK(ResponseHeader(listing, "ETag") != etag);
+  CHECK_EQ(5.0, ParsedJson(ResponseBody(listing))[0]["state"].number);
+}
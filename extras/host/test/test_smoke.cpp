@@ -0,0 +1,216 @@
+// end to end checks that a node registers with the stand-in hub, uploads and serves its actors on the host build
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static int int_actor_state = 0;
+static void IntActorChanged(int state) {
+  int_actor_state = state;
+}
+static bool bool_actor_state = false;
+static void BoolActorChanged(bool state) {
+  bool_actor_state = state;
+}
+
+static void StartSensorNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Smoke Test Sensor", "number");
+}
+
+static void SendReading(iotHubLib<1,0>& iothub) {
+  iothub.Send(0, 21.5);
+  iothub.Tick();
+}
+
+static void StartTwinSensorNode(iotHubLib<2,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Smoke Test Twin", "number");
+  iothub.RegisterSensor("Smoke Test Twin", "number");
+}
+
+static void SendTwinReadings(iotHubLib<2,0>& iothub) {
+  iothub.SetFlushThresholds(2, 0, 0);
+  iothub.Send(0, 1);
+  iothub.Send(1, 2);
+  iothub.Tick();
+}
+
+static void StartActorNode(iotHubLib<0,2>& iothub) {
+  iothub.Start();
+  iothub.RegisterActor("Smoke Test Int Actor", IntActorChanged);
+  iothub.RegisterActor("Smoke Test Bool Actor", BoolActorChanged);
+}
+
+TEST(SensorNodeRegistersAndUploads) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode, SendReading);
+  board.Boot();
+
+  std::string id = hub.IdOf("Smoke Test Sensor", 's');
+  CHECK(!id.empty());
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/register"));
+
+  board.Loop();
+  board.Loop(); // the upload started by Send() completes in a later Tick()
+  CHECK(!hub.readings.empty());
+  if (!hub.readings.empty()) {
+    CHECK_EQ(id, hub.readings[0].sensor_id);
+    CHECK_EQ(21.5, hub.readings[0].value);
+  }
+}
+
+TEST(IdsSurviveARestart) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode, SendReading);
+  board.Boot();
+  std::string id = hub.IdOf("Smoke Test Sensor", 's');
+  hub.Clear();
+
+  board.Boot();
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/nodes/register"));
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/nodes/validate"));
+  board.Loop();
+  board.Loop();
+  CHECK(!hub.readings.empty());
+  if (!hub.readings.empty()) CHECK_EQ(id, hub.readings[0].sensor_id);
+}
+
+// sensors sharing a name are stored under their own keys, so each gets back its own id after a restart
+TEST(SameNamedSensorsKeepTheirOwnIds) {
+  StandInHub hub;
+  Board<iotHubLib<2,0>> board(StartTwinSensorNode, SendTwinReadings);
+  board.Boot();
+  board.Loop();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  if (hub.readings.size() != 2) return;
+  std::string first_id = hub.readings[0].sensor_id;
+  std::string second_id = hub.readings[1].sensor_id;
+  CHECK(first_id != second_id);
+  hub.Clear();
+
+  board.Boot();
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/nodes/register"));
+  board.Loop();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  if (hub.readings.size() != 2) return;
+  CHECK_EQ(first_id, hub.readings[0].sensor_id);
+  CHECK_EQ(second_id, hub.readings[1].sensor_id);
+}
+
+// before the id store, byte 0 was 128 and the ids followed it as 24 chars each in the order nodes were declared
+TEST(IdsInTheOldLayoutAreMigrated) {
+  StandInHub hub;
+  std::string int_id = hub.AddNode("Smoke Test Int Actor", 'a', "int");
+  std::string bool_id = hub.AddNode("Smoke Test Bool Actor", 'a', "bool");
+  Board<iotHubLib<0,2>> board(StartActorNode);
+  std::string old_layout = "\x80" + int_id + bool_id;
+  std::copy(old_layout.begin(), old_layout.end(), board.node.flash_eeprom.begin());
+  board.Boot();
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/nodes/register"));
+  CHECK_EQ(200, ResponseStatus(Serve(board, "GET /actors/" + int_id + " HTTP/1.1\r\n\r\n")));
+  CHECK_EQ(200, ResponseStatus(Serve(board, "GET /actors/" + bool_id + " HTTP/1.1\r\n\r\n")));
+
+  // the ids are in the id store now, which has overwritten the old layout
+  board.Boot();
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/nodes/register"));
+  CHECK_EQ(200, ResponseStatus(Serve(board, "GET /actors/" + bool_id + " HTTP/1.1\r\n\r\n")));
+}
+
+TEST(RegistersEachNodeWithoutBulkSupport) {
+  StandInHub hub;
+  hub.bulk_supported = false;
+  Board<iotHubLib<1,0>> board(StartSensorNode, SendReading);
+  board.Boot();
+
+  CHECK(!hub.IdOf("Smoke Test Sensor", 's').empty());
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/sensors"));
+  board.Loop();
+  board.Loop();
+  CHECK_EQ((size_t)2, hub.readings.size());
+  CHECK_EQ((size_t)2, hub.Count("POST", "/api/sensors/"));
+}
+
+static void StartTripleSensorNode(iotHubLib<3,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Smoke Test Sensor A", "number");
+  iothub.RegisterSensor("Smoke Test Sensor B", "number");
+  iothub.RegisterSensor("Smoke Test Sensor C", "number");
+}
+
+// readings queue up behind the upload in flight, so most uploads would be batches
+static void SendTripleReadings(iotHubLib<3,0>& iothub) {
+  iothub.Send(0, 1);
+  iothub.Send(1, 2);
+  iothub.Send(2, 3);
+  iothub.Tick();
+}
+
+// a hub without the batch url is sent every reading on its own, and never taken to have forgotten the sensors
+TEST(UploadsEachReadingWithoutBulkSupport) {
+  StandInHub hub;
+  hub.bulk_supported = false;
+  Board<iotHubLib<3,0>> board(StartTripleSensorNode, SendTripleReadings);
+  board.Boot();
+  for (uint i = 0; i < 30; i++) {
+    board.Loop();
+  }
+  board.lib().Flush();
+
+  CHECK_EQ(0u, board.restarts);
+  CHECK_EQ((size_t)3, hub.nodes.size()); // none registered again
+  CHECK_EQ((size_t)0, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ((size_t)90, hub.readings.size());
+}
+
+// a batch the hub 404s is sent again a reading at a time, as are later uploads
+TEST(RefusedBatchFallsBackToEachReading) {
+  StandInHub hub;
+  Board<iotHubLib<3,0>> board(StartTripleSensorNode);
+  board.Boot();
+  iotHubLib<3,0>& iothub = board.lib();
+  iothub.SetFlushThresholds(3, 0, 0);
+  hub.bulk_supported = false;
+
+  iothub.Send(0, 1);
+  iothub.Send(1, 2);
+  iothub.Send(2, 3);
+  for (uint i = 0; i < 10; i++) {
+    board.Loop();
+  }
+  CHECK_EQ(0u, board.restarts);
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ((size_t)3, hub.readings.size());
+  CHECK_EQ(0u, iothub.QueuedReadings());
+
+  iothub.Send(0, 4);
+  iothub.Send(1, 5);
+  CHECK(iothub.Flush());
+  CHECK_EQ((size_t)1, hub.Count("POST", "/api/sensors/data"));
+  CHECK_EQ((size_t)5, hub.readings.size());
+}
+
+TEST(ActorNodeServesItsActors) {
+  StandInHub hub;
+  Board<iotHubLib<0,2>> board(StartActorNode);
+  board.Boot();
+  std::string id = hub.IdOf("Smoke Test Int Actor", 'a');
+  CHECK(!id.empty());
+
+  std::string listing = Serve(board, "GET /actors HTTP/1.1\r\nHost: node\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(listing));
+  Json actors = ParsedJson(ResponseBody(listing));
+  CHECK(actors.IsArray());
+  CHECK_EQ((size_t)2, actors.Size());
+
+  std::string body = "{\"state\":42}";
+  std::string update = Serve(board, "POST /actors/" + id + " HTTP/1.1\r\nHost: node\r\nContent-Type: application/json\r\n"
+  "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+  CHECK_EQ(200, ResponseStatus(update));
+  CHECK_EQ(42, int_actor_state);
+
+  std::string state = Serve(board, "GET /actors/" + id + " HTTP/1.1\r\nHost: node\r\n\r\n");
+  CHECK_EQ(200, ResponseStatus(state));
+  CHECK_EQ(42.0, ParsedJson(ResponseBody(state))["state"].number);
+
+  CHECK_EQ(404, ResponseStatus(Serve(board, "GET /actors/000000000000000000000000 HTTP/1.1\r\n\r\n")));
+}
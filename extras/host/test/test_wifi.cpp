@@ -0,0 +1,54 @@
+// the wifi cache takes a node straight back to the access point it last used, and a scan finds another if that fails
+#include "test.h"
+#include "support.h"
+#include "stand_in_hub.h"
+
+static void StartSensorNode(iotHubLib<1,0>& iothub) {
+  iothub.Start();
+  iothub.RegisterSensor("Wifi Test Sensor", "number");
+}
+
+// puts the access point back where it was when the test moves it
+struct access_point_restore {
+  uint8_t bssid[6];
+  int32_t channel;
+  access_point_restore() {
+    memcpy(bssid, host::network.bssid, sizeof(bssid));
+    channel = host::network.channel;
+  }
+  ~access_point_restore() {
+    memcpy(host::network.bssid, bssid, sizeof(bssid));
+    host::network.channel = channel;
+  }
+};
+
+TEST(ReconnectsFromTheWifiCache) {
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  CHECK(board.lib().WifiConnectMillis() >= host::network.wifi_scan_us / 1000);
+
+  board.Boot();
+  CHECK(board.lib().WifiConnectMillis() < wifi_fast_connect_timeout);
+}
+
+// the access point the cache holds has been replaced, the node scans for the new one with the credentials it had
+TEST(StaleWifiCacheFallsBackToAScan) {
+  access_point_restore restore;
+  StandInHub hub;
+  Board<iotHubLib<1,0>> board(StartSensorNode);
+  board.Boot();
+  host::network.bssid[5] ^= 1;
+  host::network.channel = 11;
+
+  board.Boot();
+  CHECK(board.lib().WifiConnectMillis() > wifi_fast_connect_timeout);
+  CHECK_EQ(host::network.ssid, board.node.station_ssid);
+  CHECK_EQ(host::network.psk, board.node.station_psk);
+  CHECK(!board.node.station_bssid_set);
+  CHECK(!hub.IdOf("Wifi Test Sensor", 's').empty());
+
+  // the new access point is cached, and the credentials are still in flash after a restart
+  board.Boot();
+  CHECK(board.lib().WifiConnectMillis() < wifi_fast_connect_timeout);
+}
@@ -1,579 +1,3466 @@
-#include "ArduinoJson.h"
+#ifndef IOTHUBLIB_H
+#define IOTHUBLIB_H
+
+// the platform headers are found on the include path, a host build can put its own fakes of these first
 #include <ESP8266WiFi.h>
-#include <ESP8266HTTPClient.h>
 #include <EEPROM.h>
 #include <aWOT.h>
-
-// both these values are currently unused
-#define wifi_connection_time 2000 // how long it takes on average to reconnect to wifi
-#define sensor_aquisition_time 2000 // how long it takes to retrieve the sensor values
+#include <float.h>
+#include <limits.h>
+// the offline log needs a LittleFS partition, so the filesystem is only pulled in by boards that opt in to it
+#ifdef IOTHUB_OFFLINE_LOG
+#include <LittleFS.h>
+#endif
+
+// log levels, define IOTHUB_LOG_LEVEL before including this library to choose how much is logged over Serial.
+// Anything above the chosen level is compiled out entirely, along with its strings.
+#define IOTHUB_LOG_NONE 0
+#define IOTHUB_LOG_ERROR 1
+#define IOTHUB_LOG_WARN 2
+#define IOTHUB_LOG_INFO 3
+#define IOTHUB_LOG_DEBUG 4
+#ifndef IOTHUB_LOG_LEVEL
+#define IOTHUB_LOG_LEVEL IOTHUB_LOG_INFO
+#endif
+
+// the clock the library schedules by, a simulator can define these before including the library to run nodes on a
+// virtual clock
+#ifndef IOTHUB_MILLIS
+#define IOTHUB_MILLIS() millis()
+#endif
+#ifndef IOTHUB_MICROS
+#define IOTHUB_MICROS() micros()
+#endif
+#ifndef IOTHUB_DELAY
+#define IOTHUB_DELAY(ms) delay(ms)
+#endif
+
+inline void IotHubLogPrint() {}
+template<typename T, typename... Rest> void IotHubLogPrint(T value, Rest... rest) {
+  Serial.print(value);
+  IotHubLogPrint(rest...);
+}
+// prints each argument in turn followed by a newline, pass string literals wrapped in F() so they stay in flash
+template<typename... Args> void IotHubLogLine(Args... args) {
+  IotHubLogPrint(args...);
+  Serial.println();
+}
+
+#if IOTHUB_LOG_LEVEL >= IOTHUB_LOG_ERROR
+#define IOTHUB_ERROR(...) IotHubLogLine(__VA_ARGS__)
+#else
+#define IOTHUB_ERROR(...) do {} while (0)
+#endif
+#if IOTHUB_LOG_LEVEL >= IOTHUB_LOG_WARN
+#define IOTHUB_WARN(...) IotHubLogLine(__VA_ARGS__)
+#else
+#define IOTHUB_WARN(...) do {} while (0)
+#endif
+#if IOTHUB_LOG_LEVEL >= IOTHUB_LOG_INFO
+#define IOTHUB_INFO(...) IotHubLogLine(__VA_ARGS__)
+#else
+#define IOTHUB_INFO(...) do {} while (0)
+#endif
+#if IOTHUB_LOG_LEVEL >= IOTHUB_LOG_DEBUG
+#define IOTHUB_DEBUG(...) IotHubLogLine(__VA_ARGS__)
+#else
+#define IOTHUB_DEBUG(...) do {} while (0)
+#endif
+
+#define wifi_fast_connect_timeout 2000 // how long to try the cached access point and lease before scanning and using DHCP
+#define wifi_poll_interval 10 // how often the wifi status is checked while connecting
+#define sensor_aquisition_time 2000 // how long it takes to retrieve the sensor values, currently unused
 #define max_node_name_length 100 // the maxiumum length of a nodes (sensor / actor) name
+#define wifi_connect_timeout 10000 // how long a deep sleeping node waits for wifi before giving up on an upload
+#define rtc_memory_size 512 // bytes of RTC user memory, kept across deep sleep
+#define rtc_state_magic 0x10748B03 // marks RTC memory as holding this library's state
+#define wifi_store_magic 0x3F1C0A5E // marks EEPROM after the id store as holding a wifi cache
+#define id_store_magic 0x1D5702E5 // marks an EEPROM slot as holding an id store
+#define id_store_version 1 // bumped whenever the id store layout changes, older stores are ignored
+#define registration_retry_interval 60000 // how long to wait before retrying nodes the hub failed to register
+#define max_route_parameters 2 // the most :parameters any one route pattern may have
+#define max_request_body_length 1024 // request bodies larger than this are refused by the embedded server with a 413
+#define offline_log_path "/iothub_readings.log"
+#define offline_log_length 512 // how many failed readings the offline log keeps before dropping the oldest
+#define offline_replay_batch 10 // how many logged readings are replayed per upload, live readings always go first
+#define offline_log_magic 0x0FF1106E
+#define histogram_buckets 9 // how many bounded buckets each metrics histogram has, plus one for everything above
+#define push_topic_prefix "iothub/actors/" // actor states are pushed to push_topic_prefix + id + push_topic_suffix
+#define push_topic_suffix "/state"
+#define push_keep_alive 60 // seconds, the broker drops the connection if it hears nothing for one and a half of these
+#define push_reconnect_interval 5000 // how long to wait before reconnecting to the broker, doubled after each failed attempt
+#define push_reconnect_max_interval 300000 // the longest wait between attempts while the broker can't be reached
+#define push_max_packet_length 512 // larger packets from the broker are skipped
+#define actor_listing_cache_length 512 // the JSON actor listing is kept serialized while it fits in this many bytes
+#define response_chunk_length 64 // responses are collected into chunks of this many bytes before being written out
+#define max_server_connections 4 // how many hub connections the embedded server holds while their requests arrive
+#define server_request_timeout 2000 // how long a connection may take to send its whole request before it is closed
+#define max_request_head_length 512 // requests whose line and headers don't fit are refused with a 431
+#define hub_response_timeout 5000 // how long to wait for the hub to respond before giving up on a request
+#define hub_response_length 200 // the largest hub response body that is kept, longer bodies are truncated
+#define reading_queue_length 20 // the maximum number of readings held before a flush is forced
+#define json_float_length 14 // the most characters PrintJsonFloat writes, as in -1.234567e-38
+// the most bytes a reading adds to a batched upload, {"id":"<24>","value":<float>,"age":<10 digits>} and a comma
+#define reading_json_length (60 + json_float_length)
+// the most bytes the min, max and count of a windowed reading add to it
+#define aggregate_json_length (28 + 2 * json_float_length)
+// room for a full batch of plain readings, windowed readings are split into more batches when they don't fit
+#define payload_buffer_length (reading_queue_length * reading_json_length + 2)
 
 
 struct sensor {
   char id[25]; // ids are 24 alphanumeric keys long, the extra char is for the null character
+  char data_url[43]; // "/api/sensors/" + id + "/data", built once the id is known so Send() never has to
   const char* name; // sensor name limited to 99 characters
-  enum {is_int, is_float, is_bool, is_string} data_type;
+  const char* data_type_name; // the data type the sensor is registered with, readings are always sent as floats
+  // sensors registered with a read callback are sampled by Tick() every period ms
+  float (*read_callback)();
+  unsigned long period;
+  unsigned long next_due; // the millis() at which the sensor should next be sampled
+  // readings are only queued when they move more than deadband from the last one queued, or heartbeat ms have passed
+  float deadband;
+  unsigned long heartbeat;
+  bool has_queued;
+  float last_queued_value;
+  unsigned long last_queued_time;
+  // with a window, readings are collected for window ms and queued as one record of their mean, min, max and count
+  unsigned long window;
+  unsigned long window_start;
+  uint16_t window_count;
+  float window_min;
+  float window_max;
+  double window_sum;
+};
+// a :parameter captured while matching a route, it points into the request url rather than being a copy
+struct route_parameter {
+  char* value;
+  uint length;
+};
+
+// a sensor or actor id kept in EEPROM, found again on the next boot by the hash of its name and occurrence
+struct id_store_entry {
+  uint32_t name_hash;
+  uint32_t packed_id[3];
+};
+
+// the access point and lease of the last good wifi connection, so the next one can skip the scan and DHCP
+struct wifi_cache {
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t valid;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+// a reading buffered in RTC memory while a deep sleeping node keeps its radio off
+struct rtc_reading {
+  uint32_t sample_time; // ms on the clock kept across deep sleeps, millis() restarts on every wake
+  float value;
+  uint32_t sensor_index;
+};
+
+// a reading that failed to upload, kept in the offline log in flash until the hub answers again
+struct logged_reading {
+  uint32_t sensor_index;
+  float value;
+  uint32_t sample_time; // the millis() at which the value was sampled, only meaningful on the boot that logged it
+  uint32_t boot; // which boot logged the reading, counted in the log header
+};
+
+// counts of values at or below each bound for the metrics endpoint, recording one is a scan of a few bounds
+struct histogram {
+  uint32_t buckets[histogram_buckets + 1]; // the last bucket counts values above every bound
+  uint32_t count;
+  uint64_t sum;
+
+  void Record(uint32_t value, const uint32_t* bounds) {
+    uint bucket = 0;
+    while (bucket < histogram_buckets && value > bounds[bucket]) {
+      bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    sum += value;
+  }
 };
+
+// a single reading waiting to be uploaded, kept until the next Flush()
+struct reading {
+  uint sensor_index;
+  float value; // the mean when the reading stands for a window of samples
+  unsigned long sample_time; // the millis() at which the value was sampled
+  bool age_known; // false for readings logged before a restart, which are sent with a null age
+  uint16_t count; // how many samples the reading stands for, min and max are only sent when it is more than one
+  float min;
+  float max;
+};
+struct actor;
+class CborWriter;
+
+// how an actor of one state type is updated and encoded. There is one of these per type, chosen when the actor is
+// registered, so the handlers call through it rather than switching on the type for every request
+struct actor_type_info {
+  const char* state_type_name; // the state type the actor is registered with the hub as
+  bool (*accepts)(double new_state); // whether the state type can hold a value, apply must only be given those
+  void (*apply)(actor* actor, double new_state); // sets the state and runs the callback
+  void (*print_json)(Print& out, actor* actor); // writes just the state value
+  void (*write_cbor)(CborWriter& cbor, actor* actor);
+};
+
 struct actor {
   char id[25]; // ids are 24 alphanumeric keys long, the extra char is for the null character
+  uint32_t packed_id[3]; // the 24 hex characters of the id packed into 12 bytes, so ids compare as three words
   const char* name; // actor name limited to 99 characters
-  // for good example of using these "tagged unions" go to: http://stackoverflow.com/questions/18577404/how-can-a-mixed-data-type-int-float-char-etc-be-stored-in-an-array
-  enum {is_int, is_float, is_bool} state_type;
+  const actor_type_info* type;
+  // only the member for the actor's type is used, see actor_state below
   union {
     int istate;
-    double fstate;
+    float fstate;
     bool bstate;
   } state;
-  // pointer to a function that is run when a new actor state is received, this will also vary by state_type
+  // pointer to a function that is run when a new actor state is received
   union {
     void (*icallback)(int);
-    void (*fcallback)(double);
+    void (*fcallback)(float);
     void (*bcallback)(bool);
   } on_update;
 };
 
-template<const uint number_sensor_ids,const uint number_actor_ids> class iotHubLib {
+// standard CRC-32, used to check state kept in RTC memory and EEPROM. Pass the previous result as crc to continue it
+inline uint32_t Crc32(const uint8_t* data, size_t length, uint32_t crc = 0) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (uint bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+// a Print that writes into a fixed buffer and keeps it null terminated, anything past the end is dropped and flagged
+class BufferPrint : public Print {
+public:
+  BufferPrint(char* buffer, size_t size) : buffer(buffer), size(size) {
+    Rewind(0);
+  }
+  size_t write(uint8_t c) {
+    if (length >= size - 1) {
+      overflowed = true;
+      return 0;
+    }
+    buffer[length] = (char)c;
+    length++;
+    buffer[length] = 0;
+    return 1;
+  }
+  // goes back to an earlier length, so something that didn't fit can be taken out again
+  void Rewind(size_t to) {
+    length = to;
+    buffer[length] = 0;
+    overflowed = false;
+  }
+  char* buffer;
+  size_t size;
+  size_t length;
+  bool overflowed;
+};
+
+// prints value as a quoted JSON string
+inline void PrintJsonString(Print& out, const char* value) {
+  out.print('"');
+  for (; *value != 0; value++) {
+    char c = *value;
+    if (c == '"' || c == '\\') {
+      out.print('\\');
+      out.print(c);
+    } else if ((uint8_t)c < 0x20) {
+      out.print(' '); // control characters have no place in node names or ids
+    } else {
+      out.print(c);
+    }
+  }
+  out.print('"');
+}
+
+// prints a float as a JSON number with the 7 significant digits a float holds, switching to an exponent for very large
+// and small values so it never takes more than json_float_length characters. NaN and infinity are written as null
+inline void PrintJsonFloat(Print& out, float value) {
+  if (!isfinite(value)) {
+    out.print("null");
+    return;
+  }
+  if (value == 0) {
+    out.print('0');
+    return;
+  }
+  if (value < 0) {
+    out.print('-');
+    value = -value;
+  }
+  int exponent = (int)floor(log10((double)value));
+  uint32_t digits = (uint32_t)(value / pow(10, exponent - 6) + 0.5);
+  // log10 can land either side of a power of ten, and rounding can carry into an eighth digit
+  if (digits < 1000000) {
+    exponent--;
+    digits = (uint32_t)(value / pow(10, exponent - 6) + 0.5);
+  }
+  if (digits >= 10000000) {
+    exponent++;
+    digits = (digits + 5) / 10;
+  }
+  char text[7];
+  for (int i = 6; i >= 0; i--) {
+    text[i] = '0' + digits % 10;
+    digits /= 10;
+  }
+  int length = 7;
+  while (length > 1 && text[length - 1] == '0') length--;
+
+  if (exponent < -5 || exponent > 6) {
+    out.print(text[0]);
+    if (length > 1) {
+      out.print('.');
+      out.write(text + 1, length - 1);
+    }
+    out.print('e');
+    out.print(exponent);
+  } else if (exponent < 0) {
+    out.print("0.");
+    for (int i = -1; i > exponent; i--) out.print('0');
+    out.write(text, length);
+  } else {
+    for (int i = 0; i <= exponent; i++) out.print(i < length ? text[i] : '0');
+    if (length > exponent + 1) {
+      out.print('.');
+      out.write(text + exponent + 1, length - exponent - 1);
+    }
+  }
+}
+
+// prints a number or boolean as a JSON value
+inline void PrintJsonValue(Print& out, int value) {
+  out.print(value);
+}
+inline void PrintJsonValue(Print& out, float value) {
+  PrintJsonFloat(out, value);
+}
+inline void PrintJsonValue(Print& out, bool value) {
+  out.print(value ? "true" : "false");
+}
+
+// collects small writes into a fixed buffer and passes them on a chunk at a time, so a response written a field at a
+// time goes out in a few large writes. Whatever is left is written by flush() or when it goes out of scope
+class ChunkedPrint : public Print {
+public:
+  ChunkedPrint(Print& out) : out(out) {}
+  ~ChunkedPrint() {
+    flush();
+  }
+  size_t write(uint8_t value) {
+    if (length == sizeof(chunk)) flush();
+    chunk[length] = value;
+    length++;
+    return 1;
+  }
+  size_t write(const uint8_t* data, size_t size) {
+    if (size >= sizeof(chunk)) { // already a large write, no point copying it
+      flush();
+      return out.write(data, size);
+    }
+    for (size_t i = 0; i < size; i++) {
+      write(data[i]);
+    }
+    return size;
+  }
+  void flush() {
+    if (length > 0) out.write(chunk, length);
+    length = 0;
+  }
+  using Print::write;
+
 private:
-  char* iothub_server; // the location of the server
-  int iothub_port;
+  Print& out;
+  uint8_t chunk[response_chunk_length];
+  size_t length = 0;
+};
 
-  WiFiServer server{80}; // the server that accepts requests from the hub, note the () initialisation syntax in not supported in class bodies
-  WebApp app; // the class used by aWOT
+// how request and response bodies are encoded, every hub understands JSON, CBOR is smaller and has no float formatting
+enum iothub_encoding { encoding_json, encoding_cbor };
+
+// writes CBOR (RFC 7049) items straight to a Print, maps and arrays are written as a header followed by their items
+class CborWriter {
+public:
+  CborWriter(Print& out) : out(out) {}
+
+  // every item starts with its major type and an argument, which is written in as few bytes as possible
+  void WriteHead(uint8_t major, uint32_t argument) {
+    major <<= 5;
+    if (argument < 24) {
+      out.write((uint8_t)(major | argument));
+    } else if (argument <= 0xFF) {
+      out.write((uint8_t)(major | 24));
+      out.write((uint8_t)argument);
+    } else if (argument <= 0xFFFF) {
+      out.write((uint8_t)(major | 25));
+      WriteBigEndian(argument, 2);
+    } else {
+      out.write((uint8_t)(major | 26));
+      WriteBigEndian(argument, 4);
+    }
+  }
+  void WriteMap(uint32_t pairs) {
+    WriteHead(5, pairs);
+  }
+  void WriteArray(uint32_t items) {
+    WriteHead(4, items);
+  }
+  void WriteString(const char* value) {
+    uint32_t length = strlen(value);
+    WriteHead(3, length);
+    out.write((const uint8_t*)value, length);
+  }
+  void WriteInt(long value) {
+    if (value >= 0) {
+      WriteHead(0, value);
+    } else {
+      WriteHead(1, -1 - value);
+    }
+  }
+  void WriteFloat(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    out.write((uint8_t)0xFA);
+    WriteBigEndian(bits, 4);
+  }
+  void WriteBool(bool value) {
+    out.write((uint8_t)(value ? 0xF5 : 0xF4));
+  }
+  void WriteNull() {
+    out.write((uint8_t)0xF6);
+  }
 
-  uint sleep_interval = 120000; // default of 120 seconds
-  const int ids_eeprom_offset = 1; // memory location for ids start +1, skipping zero
+private:
+  void WriteBigEndian(uint32_t value, uint bytes) {
+    while (bytes > 0) {
+      bytes--;
+      out.write((uint8_t)(value >> (bytes * 8)));
+    }
+  }
+  Print& out;
+};
 
-  boolean first_boot_bit; // memory location for ids start +1, skipping zero
+// reads CBOR items from a Stream as they arrive, only definite length items are supported
+class CborReader {
+public:
+  CborReader(Stream& in) : in(in) {}
+
+  // reads the major type and argument of the next item, for floats the argument holds the raw bits
+  bool ReadHead(uint8_t* major, uint8_t* additional, uint64_t* argument) {
+    int first = in.read();
+    if (first == -1) return false;
+    *major = (uint8_t)first >> 5;
+    *additional = (uint8_t)first & 0x1F;
+    if (*additional < 24) {
+      *argument = *additional;
+      return true;
+    }
+    if (*additional > 27) return false; // indefinite lengths and reserved values
+    uint bytes = 1 << (*additional - 24);
+    *argument = 0;
+    while (bytes > 0) {
+      int next = in.read();
+      if (next == -1) return false;
+      *argument = (*argument << 8) | (uint8_t)next;
+      bytes--;
+    }
+    return true;
+  }
 
-  sensor sensors[number_sensor_ids];
-  actor actors[number_actor_ids];
-  uint last_sensor_added_index;
-  uint last_actor_added_index; // the index of the last actor added
+  // reads an integer, float or boolean item as a number
+  bool ReadNumber(double* number) {
+    uint8_t major, additional;
+    uint64_t argument;
+    if (!ReadHead(&major, &additional, &argument)) return false;
+    return ToNumber(major, additional, argument, number);
+  }
 
-  // takes in the request object whose body is desired, and a pointer to c_string to write the string
-  void CStringReqBody (Request &req, char* c_string_body) {
-    uint c_string_body_len = 0;
+  bool ToNumber(uint8_t major, uint8_t additional, uint64_t argument, double* number) {
+    if (major == 0) {
+      *number = (double)argument;
+    } else if (major == 1) {
+      *number = -1.0 - (double)argument;
+    } else if (major == 7 && (additional == 20 || additional == 21)) {
+      *number = (additional == 21) ? 1 : 0;
+    } else if (major == 7 && additional == 25) {
+      *number = HalfToFloat((uint16_t)argument);
+    } else if (major == 7 && additional == 26) {
+      uint32_t bits = (uint32_t)argument;
+      float value;
+      memcpy(&value, &bits, sizeof(value));
+      *number = value;
+    } else if (major == 7 && additional == 27) {
+      memcpy(number, &argument, sizeof(*number));
+    } else {
+      return false;
+    }
+    return isfinite(*number); // NaN and the infinities aren't states, as JSON can't carry them either
+  }
 
-    int bytebuff;
-    while ((bytebuff = req.read()) != -1 && c_string_body_len < 50) {
-      c_string_body[c_string_body_len] = (char)bytebuff;
-      c_string_body_len++;
-      // and a proper null terminator to the end
-      if (c_string_body_len > 0) {
-        c_string_body[c_string_body_len] = (char)0;
+  // reads a text string item into buffer, strings longer than the buffer come back truncated
+  bool ReadText(uint64_t length, char* buffer, uint buffer_size) {
+    uint kept = 0;
+    for (uint64_t i = 0; i < length; i++) {
+      int next = in.read();
+      if (next == -1) return false;
+      if (kept + 1 < buffer_size) {
+        buffer[kept] = (char)next;
+        kept++;
       }
     }
-    //Serial.print(" Len: "); Serial.print(c_string_body_len); Serial.println("FIN");
+    buffer[kept] = 0;
+    return true;
   }
 
-  // This finds and updates the actor with an id that matches that passed in. It also runs the corresponding callback.
-  void PostActorStateHandler(Request &req, Response &res, char* actor_id, uint actor_id_length) {
-    if (actor_id_length != 24) {
-      Serial.println("The passed in actor_id was not the standard 24 characters long");
-      return;
+  // reads a text string item and reports whether it equals expected, the string is never buffered
+  bool ReadStringEquals(uint64_t length, const char* expected, bool* equals) {
+    *equals = (strlen(expected) == length);
+    for (uint64_t i = 0; i < length; i++) {
+      int next = in.read();
+      if (next == -1) return false;
+      if (*equals && expected[i] != (char)next) *equals = false;
     }
-    actor* actor = FindActor(actor_id);
-    if (actor == NULL) { // make sure the id exists before sending anything
-      Serial.println("Was unable to find matching actor");
-      return;
+    return true;
+  }
+
+  // skips the rest of an item whose head has been read, nested items are limited to a small depth
+  bool SkipItem(uint8_t major, uint64_t argument, uint depth = 0) {
+    if (depth > 8) return false;
+    switch (major) {
+      case 2: case 3: // byte and text strings
+        for (uint64_t i = 0; i < argument; i++) {
+          if (in.read() == -1) return false;
+        }
+        return true;
+      case 4: case 5: { // arrays and maps, maps have two items per entry
+        uint64_t items = (major == 5) ? argument * 2 : argument;
+        for (uint64_t i = 0; i < items; i++) {
+          uint8_t item_major, item_additional;
+          uint64_t item_argument;
+          if (!ReadHead(&item_major, &item_additional, &item_argument)) return false;
+          if (!SkipItem(item_major, item_argument, depth + 1)) return false;
+        }
+        return true;
+      }
+      case 6: { // a tag is followed by the item it tags
+        uint8_t item_major, item_additional;
+        uint64_t item_argument;
+        if (!ReadHead(&item_major, &item_additional, &item_argument)) return false;
+        return SkipItem(item_major, item_argument, depth + 1);
+      }
+      default: // integers and simple values are complete once their head is read
+        return true;
+    }
+  }
+
+private:
+  static float HalfToFloat(uint16_t half) {
+    int exponent = (half >> 10) & 0x1F;
+    int mantissa = half & 0x3FF;
+    float value;
+    if (exponent == 0) {
+      value = ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+      value = ldexp(mantissa + 1024, exponent - 25);
+    } else {
+      value = mantissa == 0 ? INFINITY : NAN;
     }
+    return (half & 0x8000) ? -value : value;
+  }
+  Stream& in;
+};
 
-    // update the actor state
-    char c_string_body[50];
-    CStringReqBody(req, c_string_body);
-    Serial.print("Actor state JSON: "); Serial.println(c_string_body);
-    StaticJsonBuffer<50> request_json_buff;
-    JsonObject& request_json = request_json_buff.parseObject(c_string_body);
+// passes through at most limit bytes of a stream, then reports the end and notes whether there was more
+class LimitedStream : public Stream {
+public:
+  LimitedStream(Stream& in, uint limit) : in(in), remaining(limit) {}
+  bool exceeded = false;
 
-    if (!request_json.success()) {
-      Serial.println("Failed to parse actor state JSON");
-      return;
+  int available() {
+    int available = in.available();
+    if (available <= 0) return available;
+    return (uint)available > remaining ? remaining : available;
+  }
+  int read() {
+    if (remaining == 0) {
+      if (in.peek() != -1) exceeded = true;
+      return -1;
     }
+    int next = in.read();
+    if (next != -1) remaining--;
+    return next;
+  }
+  int peek() {
+    return remaining == 0 ? -1 : in.peek();
+  }
+  size_t write(uint8_t) {
+    return 0;
+  }
 
-    Serial.println("Running callback...");
+private:
+  Stream& in;
+  uint remaining;
+};
 
-    // run the callback with the new state
-    switch (actor->state_type) {
-      case actor::is_int:
-      Serial.println("Run int callback");
-      actor->state.istate = request_json["state"];
-      actor->on_update.icallback(actor->state.istate);
-      break;
+// reads back a null terminated buffer as a Stream, so a response kept in memory can be parsed with JsonReader
+class BufferStream : public Stream {
+public:
+  BufferStream(const char* buffer) : next(buffer) {}
 
-      case actor::is_float:
-      actor->state.fstate = request_json["state"];
-      actor->on_update.fcallback(actor->state.fstate);
-      break;
+  int available() {
+    return strlen(next);
+  }
+  int read() {
+    if (*next == 0) return -1;
+    return (uint8_t)*next++;
+  }
+  int peek() {
+    return *next == 0 ? -1 : (uint8_t)*next;
+  }
+  size_t write(uint8_t) {
+    return 0;
+  }
 
-      case actor::is_bool:
-      actor->state.bstate = request_json["state"];
-      actor->on_update.bcallback(actor->state.bstate);
-      break;
+private:
+  const char* next;
+};
+
+// pulls JSON values from a Stream as they arrive without building a document, only the values asked for are kept.
+// Any error sets failed, and the results of later calls are meaningless once it is set
+class JsonReader {
+public:
+  JsonReader(Stream& in) : in(in) {}
+  bool failed = false;
+
+  // the next character that isn't whitespace, without consuming it, or -1 at the end of the stream
+  int Peek() {
+    while (lookahead == -2 || lookahead == ' ' || lookahead == '\t' || lookahead == '\r' || lookahead == '\n') {
+      lookahead = in.read();
+    }
+    return lookahead;
+  }
+  bool Expect(char expected) {
+    if (Peek() != expected) {
+      failed = true;
+      return false;
     }
+    lookahead = -2;
+    return true;
+  }
 
-    // send a response with the new state to confirm the action has completed
-    StaticJsonBuffer<200> jsonBuffer;
-    JsonObject& json_obj = jsonBuffer.createObject();
+  // call before each member of an object or item of an array, false once close has been consumed.
+  // first should start as true for each object or array
+  bool More(char close, bool* first) {
+    if (failed) return false;
+    if (Peek() == close) {
+      lookahead = -2;
+      return false;
+    }
+    if (!*first && !Expect(',')) return false;
+    *first = false;
+    return true;
+  }
 
-    // determine type of actor so we can figure out which tagged union var to send
-    switch (actor->state_type) {
-      case actor::is_int:
-      json_obj["state"] = actor->state.istate;
-      break;
+  // reads the key of an object member and its colon, keys longer than the buffer come back truncated
+  bool ReadKey(char* key, uint key_size) {
+    return ReadString(key, key_size) && Expect(':');
+  }
 
-      case actor::is_float:
-      json_obj["state"] = actor->state.fstate;
-      break;
+  // reads a string into buffer, escapes other than the simple ones become '?'. A NULL buffer skips the string
+  bool ReadString(char* buffer, uint buffer_size) {
+    if (!Expect('"')) return false;
+    uint length = 0;
+    while (true) {
+      int next = in.read();
+      if (next == -1) {
+        failed = true;
+        return false;
+      }
+      if (next == '"') break;
+      if (next == '\\') {
+        next = in.read();
+        switch (next) {
+          case '"': case '\\': case '/': break;
+          case 'b': next = '\b'; break;
+          case 'f': next = '\f'; break;
+          case 'n': next = '\n'; break;
+          case 'r': next = '\r'; break;
+          case 't': next = '\t'; break;
+          case 'u':
+            for (uint i = 0; i < 4; i++) {
+              if (!isxdigit(in.read())) {
+                failed = true;
+                return false;
+              }
+            }
+            next = '?';
+            break;
+          default:
+            failed = true;
+            return false;
+        }
+      }
+      if (buffer != NULL && length + 1 < buffer_size) {
+        buffer[length] = (char)next;
+        length++;
+      }
+    }
+    if (buffer != NULL) buffer[length] = 0;
+    return true;
+  }
 
-      case actor::is_bool:
-      json_obj["state"] = actor->state.bstate;
-      break;
+  // true if text is a number as JSON's grammar has it, which strtod() alone would widen to hex, inf and nan
+  static bool IsJsonNumber(const char* text) {
+    if (*text == '-') text++;
+    if (*text == '0') {
+      text++;
+    } else if (isdigit(*text)) {
+      while (isdigit(*text)) text++;
+    } else {
+      return false;
+    }
+    if (*text == '.') {
+      text++;
+      if (!isdigit(*text)) return false;
+      while (isdigit(*text)) text++;
     }
+    if (*text == 'e' || *text == 'E') {
+      text++;
+      if (*text == '+' || *text == '-') text++;
+      if (!isdigit(*text)) return false;
+      while (isdigit(*text)) text++;
+    }
+    return *text == 0;
+  }
 
-    res.success("application/json");
-    json_obj.printTo(res); // send straight to http output
+  // reads a number, or true and false as 1 and 0. Numbers too large for a double fail like any malformed one
+  bool ReadNumber(double* number) {
+    char text[24];
+    uint length = 0;
+    Peek();
+    while (lookahead != -1 && (isdigit(lookahead) || isalpha(lookahead) || lookahead == '-' || lookahead == '+' || lookahead == '.')) {
+      if (length + 1 >= sizeof(text)) {
+        failed = true;
+        return false;
+      }
+      text[length] = (char)lookahead;
+      length++;
+      lookahead = in.read();
+    }
+    text[length] = 0;
+    if (strcmp(text, "true") == 0) {
+      *number = 1;
+    } else if (strcmp(text, "false") == 0) {
+      *number = 0;
+    } else {
+      if (!IsJsonNumber(text)) {
+        failed = true;
+        return false;
+      }
+      *number = strtod(text, NULL);
+      if (!isfinite(*number)) {
+        failed = true;
+        return false;
+      }
+    }
+    return true;
   }
 
-  void GetActorsHandler(Request &req, Response &res) {
-    Serial.println("Sensor Listing Requested");
+  // skips any value, nested objects and arrays are limited to a small depth
+  bool SkipValue(uint depth = 0) {
+    if (depth > 8) {
+      failed = true;
+      return false;
+    }
+    int next = Peek();
+    if (next == '"') return ReadString(NULL, 0);
+    if (next == '{' || next == '[') {
+      char close = (next == '{') ? '}' : ']';
+      lookahead = -2;
+      bool first = true;
+      while (More(close, &first)) {
+        if (close == '}' && !ReadKey(NULL, 0)) return false;
+        if (!SkipValue(depth + 1)) return false;
+      }
+      return !failed;
+    }
+    if (next == 'n') { // null is the one literal ReadNumber doesn't take
+      const char* rest = "null";
+      lookahead = -2;
+      for (uint i = 1; i < 4; i++) {
+        if (in.read() != rest[i]) {
+          failed = true;
+          return false;
+        }
+      }
+      return true;
+    }
+    double ignored;
+    return ReadNumber(&ignored);
+  }
 
-    Serial.print("Number actor ids: ");
-    Serial.println(number_actor_ids);
+private:
+  Stream& in;
+  int lookahead = -2; // -2 when nothing has been read ahead
+};
 
-    StaticJsonBuffer<600> jsonBuffer;
-    JsonArray& json_array = jsonBuffer.createArray();
+// which union members an actor of state type T uses, and how its state is encoded
+template<typename T> struct actor_state;
+template<> struct actor_state<int> {
+  typedef void (*callback)(int);
+  static constexpr const char* state_type_name = "number";
+  static int& State(actor* actor) { return actor->state.istate; }
+  static callback& Callback(actor* actor) { return actor->on_update.icallback; }
+  // the conversion truncates, so anything that truncates into range fits
+  static bool Accepts(double state) { return state > (double)INT_MIN - 1 && state < (double)INT_MAX + 1; }
+  static void WriteCbor(CborWriter& cbor, int state) { cbor.WriteInt(state); }
+};
+template<> struct actor_state<float> {
+  typedef void (*callback)(float);
+  static constexpr const char* state_type_name = "number";
+  static float& State(actor* actor) { return actor->state.fstate; }
+  static callback& Callback(actor* actor) { return actor->on_update.fcallback; }
+  static bool Accepts(double state) { return state >= -FLT_MAX && state <= FLT_MAX; }
+  static void WriteCbor(CborWriter& cbor, float state) { cbor.WriteFloat(state); }
+};
+template<> struct actor_state<bool> {
+  typedef void (*callback)(bool);
+  static constexpr const char* state_type_name = "boolean";
+  static bool& State(actor* actor) { return actor->state.bstate; }
+  static callback& Callback(actor* actor) { return actor->on_update.bcallback; }
+  static bool Accepts(double state) { return isfinite(state); }
+  static void WriteCbor(CborWriter& cbor, bool state) { cbor.WriteBool(state); }
+};
 
-    for (uint i = 0; i < number_actor_ids; i++) {
-      Serial.print("Actor ID:"); Serial.println(actors[i].id);
-      JsonObject& json_obj = json_array.createNestedObject();
-      json_obj["id"] = actors[i].id;
-      json_obj["name"] = actors[i].name;
-
-      switch (actors[i].state_type) {
-        case actor::is_int:
-        json_obj["state"] = actors[i].state.istate;
-        break;
+// the actor_type_info for state type T, built from actor_state<T> at compile time
+template<typename T> struct actor_type {
+  static void Apply(actor* actor, double new_state) {
+    actor_state<T>::State(actor) = static_cast<T>(new_state);
+    actor_state<T>::Callback(actor)(actor_state<T>::State(actor));
+  }
+  static void PrintJson(Print& out, actor* actor) {
+    PrintJsonValue(out, actor_state<T>::State(actor));
+  }
+  static void WriteCbor(CborWriter& cbor, actor* actor) {
+    actor_state<T>::WriteCbor(cbor, actor_state<T>::State(actor));
+  }
+  static const actor_type_info info;
+};
+template<typename T> const actor_type_info actor_type<T>::info = {
+  actor_state<T>::state_type_name, &actor_state<T>::Accepts, &actor_type<T>::Apply, &actor_type<T>::PrintJson,
+  &actor_type<T>::WriteCbor
+};
 
-        case actor::is_float:
-        json_obj["state"] = actors[i].state.fstate;
-        break;
+// the smallest power of two at least twice n, used to size the actor id hash index so it never gets more than half full
+constexpr uint HashIndexSize(uint n, uint size = 1) {
+  return size >= 2 * n ? size : HashIndexSize(n, size * 2);
+}
 
-        case actor::is_bool:
-        json_obj["state"] = actors[i].state.bstate;
-        break;
-      }
+template<const uint number_sensor_ids,const uint number_actor_ids> class iotHubLib {
+private:
+  char* iothub_server; // the location of the server
+  int iothub_port;
+
+  WiFiServer server{80}; // the server that accepts requests from the hub, note the () initialisation syntax in not supported in class bodies
+  WebApp app; // the class used by aWOT
+
+  uint sleep_interval = 120000; // default of 120 seconds, only used by sensor nodes that call Send() themselves
+  uint scheduled_sensor_count = 0; // how many sensors Tick() samples through a read callback
+  // Ids are kept in EEPROM in one of two slots, each save goes to the other slot with a higher sequence number and the
+  // newest slot with a valid CRC is loaded. The whole store is read once at Start() and written with a single commit
+  static const uint id_store_length = number_sensor_ids + number_actor_ids;
+  struct id_store {
+    uint32_t crc; // of everything after this field
+    uint32_t magic;
+    uint16_t version;
+    uint16_t sequence;
+    uint32_t count;
+    id_store_entry entries[id_store_length];
+  };
+  static const uint id_store_eeprom_size = 2 * sizeof(id_store);
+  // the wifi cache follows the two id store slots, so a new lease never rewrites the ids
+  struct wifi_store {
+    uint32_t crc; // of everything after this field
+    uint32_t magic;
+    wifi_cache wifi;
+  };
+  static const uint eeprom_size = id_store_eeprom_size + sizeof(wifi_store);
+  static_assert(eeprom_size <= 4096, "too many sensors and actors to fit their ids in EEPROM");
+  id_store ids;
+  uint id_store_slot = 1; // the slot the store was loaded from, so the first save goes to slot 0
+  bool ids_loaded = false;
+  bool ids_dirty = false; // ids have changed since the store was last saved
+  bool legacy_ids = false; // EEPROM holds ids in the layout from before the id store, see ReadLegacyId()
+
+  // registration happens in bulk once every node has been declared, nodes the hub failed to register are retried
+  bool registration_complete = false;
+  bool registration_attempted = false;
+  bool ids_validated = false; // stored ids are checked with the hub once per boot
+  bool hub_bulk_supported = true; // cleared if the hub 404s the bulk endpoints, nodes are then handled one at a time
+  unsigned long last_registration_attempt;
+
+  sensor sensors[number_sensor_ids];
+  actor actors[number_actor_ids];
+  uint last_sensor_added_index;
+  uint last_actor_added_index; // the index of the last actor added
+
+  // open addressing hash index from packed actor id to position in actors, empty slots hold actor_index_empty
+  static const uint actor_index_size = HashIndexSize(number_actor_ids);
+  static const uint8_t actor_index_empty = 0xFF;
+  static_assert(number_actor_ids < actor_index_empty, "actor positions are stored in a byte");
+  uint8_t actor_index[actor_index_size];
+
+  // deep sleep state, the sensor ids and readings of a sensor only node kept in RTC memory while it sleeps
+  static const uint rtc_cached_ids = (number_actor_ids == 0) ? number_sensor_ids : 0;
+  static const uint rtc_header_size = 20 + sizeof(wifi_cache);
+  static const uint rtc_reading_length = (rtc_header_size + rtc_cached_ids * 12 < rtc_memory_size) ?
+    (rtc_memory_size - rtc_header_size - rtc_cached_ids * 12) / sizeof(rtc_reading) : 0;
+  struct rtc_state {
+    uint32_t crc; // of everything after this field
+    uint32_t magic;
+    uint32_t clock; // ms spent awake and asleep since the RTC state was created
+    uint16_t reading_count;
+    uint8_t ids_cached; // sensor ids are loaded from here rather than EEPROM or the hub
+    uint8_t upload_next_wake; // the radio was left enabled for the next wake as it will upload
+    uint8_t batches_refused; // the hub 404'd a batched upload, later wakes send readings one at a time straight away
+    wifi_cache wifi; // read from here rather than EEPROM on a deep sleep wake
+    uint32_t packed_ids[rtc_cached_ids][3];
+    rtc_reading readings[rtc_reading_length];
+  };
+  // only sensor only nodes can deep sleep, so nodes with actors have no RTC state at all and never reach the code using it
+  rtc_state rtc_memory[number_actor_ids == 0 ? 1 : 0];
+  rtc_state& Rtc() {
+    return rtc_memory[0];
+  }
+  bool deep_sleep_enabled = false;
+  bool rtc_valid = false;
+  bool radio_off = false;
+  unsigned long upload_age = 0;
+
+  wifi_cache wifi; // the cache in use, from RTC memory when waking from deep sleep, otherwise from EEPROM
+  bool wifi_fast_connect = false; // the connection in progress is using the cache
+  // the network the SDK last connected to, read before the cached access point is pinned so the scan can use it
+  char wifi_ssid[33];
+  char wifi_psk[65];
+  unsigned long wifi_connect_start = 0;
+  unsigned long wifi_connect_ms = 0; // how long the last connection took
+
+  unsigned long last_request_micros = 0; // how long the embedded server took to handle the last request
+
+  // connections accepted by the embedded server that haven't sent their request yet, or are being served
+  struct server_connection {
+    WiFiClient client;
+    unsigned long accepted; // the millis() at which the connection was accepted
+    uint checked_length; // how many bytes had arrived when the request was last checked for completeness
+  };
+  server_connection server_connections[max_server_connections];
+
+  WiFiClient hub_client; // the keep-alive connection to the hub shared by all outbound requests
+  uint hub_connections_opened = 0;
+  uint hub_connections_reused = 0;
+
+  // the hub request in flight, advanced a step at a time by StepHubRequest() so it never blocks for a response
+  enum hub_request_state {
+    hub_idle, hub_connecting, hub_writing, hub_reading_status, hub_reading_headers, hub_reading_body,
+    hub_reading_until_close, hub_reading_chunk_size, hub_reading_chunk, hub_reading_chunk_end, hub_reading_trailer
+  };
+  hub_request_state hub_state = hub_idle;
+  const char* hub_method;
+  const char* hub_url;
+  const char* hub_body;
+  uint hub_body_length;
+  const char* hub_content_type;
+  char* hub_response_body; // where the response body is copied, NULL to drain it
+  uint hub_response_body_size;
+  uint hub_response_body_len;
+  bool hub_request_reused; // the request went out on a reused connection, so may be retried if the hub had closed it
+  bool hub_request_retried;
+  bool hub_upload_in_flight; // the request is an upload of queued readings started by StartFlush()
+  unsigned long hub_deadline;
+  int hub_http_code; // the result of the last finished request
+  char hub_line[64]; // status, header and chunk size lines are assembled here as bytes arrive
+  uint hub_line_len;
+  long hub_remaining; // bytes left in the body or the current chunk
+  long hub_content_length;
+  bool hub_chunked;
+  bool hub_keep_alive;
+  void (*upload_callback)(int http_code) = NULL;
+
+#ifdef IOTHUB_OFFLINE_LOG
+  // the offline log is a ring of logged_reading records in a LittleFS file, after this header
+  struct offline_log_header {
+    uint32_t crc; // of the rest of the header
+    uint32_t magic;
+    uint32_t head; // the slot of the oldest record
+    uint32_t count;
+    uint32_t boot;
+  };
+  offline_log_header offline_log;
+  bool hub_answered = false; // whether the last upload got an answer from the hub, logged readings are only replayed then
+#endif
+  bool offline_log_enabled = false;
+  uint replay_in_flight = 0; // how many logged readings the upload in flight replays
+
+  // push updates, actor states published by the hub over one MQTT connection the node keeps open
+  enum push_connection_state {push_off, push_disconnected, push_awaiting_connack, push_connected};
+  push_connection_state push_state = push_off;
+  WiFiClient push_client;
+  const char* push_broker;
+  uint16_t push_port;
+  unsigned long push_last_attempt = 0;
+  uint push_failed_attempts = 0; // connects since the broker last accepted one, each waits longer before the next
+  unsigned long push_last_sent = 0;
+  unsigned long push_last_received = 0;
+  bool push_have_header = false; // the fixed header of the next packet has been read, its body may still be arriving
+  bool push_have_type = false; // the type byte of the next packet has been read, its remaining length may not have
+  uint push_length_shift = 0; // how many bits of the remaining length have been read
+  uint8_t push_packet_type;
+  uint32_t push_remaining;
+
+  // served by the metrics endpoint, all fixed size so recording never allocates
+  histogram upload_time_ms = {};
+  histogram request_time_us = {};
+  uint32_t hub_status_counts[6] = {}; // hub responses by the hundreds digit of their status, 0 for no response
+  uint32_t readings_dropped = 0;
+  unsigned long registered_after_ms = 0; // when registration first completed, zero until it has
+  unsigned long hub_request_start = 0;
+  static constexpr uint32_t upload_time_bounds[histogram_buckets] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+  static constexpr uint32_t request_time_bounds[histogram_buckets] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000};
+
+  char payload_buffer[payload_buffer_length]; // outbound request bodies are formatted here rather than on the heap
+  uint payload_length; // the length of an upload in the payload buffer, CBOR payloads may contain zeros
+  iothub_encoding upload_encoding = encoding_json;
+  iothub_encoding request_encoding; // how the body of the request being handled by the embedded server is encoded
+  iothub_encoding response_encoding; // how its response should be encoded
+
+  reading reading_queue[reading_queue_length];
+  uint reading_queue_count = 0;
+  // the upload in flight carries the readings at the front of the queue, they stay there until the hub has answered
+  uint uploading_count = 0;
+  bool uploading_batch = false; // the upload in flight went to the batch url rather than a sensor's own
+  uint flush_remaining = 0; // readings a flush has still to send, a hub without the batch url takes them one at a time
+  // thresholds that trigger a flush, a count of 1 sends each reading as soon as it is queued, zero disables bytes and age
+  uint flush_count = 1;
+  uint flush_bytes = 0;
+  unsigned long flush_age = 0;
+
+  // This finds and updates the actor with an id that matches that passed in. It also runs the corresponding callback.
+  void PostActorStateHandler(Request &req, Response &res, route_parameter* params) {
+    actor* actor = FindActor(params[0].value, params[0].length);
+    if (actor == NULL) { // make sure the id exists before sending anything
+      IOTHUB_WARN(F("Was unable to find matching actor"));
+      res.notFound();
+      return;
+    }
+
+    // update the actor state, the body is parsed as it is read so its size doesn't matter up to the limit
+    LimitedStream body(req, max_request_body_length);
+    double new_state;
+    bool parsed;
+    if (request_encoding == encoding_cbor) {
+      parsed = ReadCborState(body, &new_state);
+    } else {
+      parsed = ReadJsonState(body, &new_state);
+    }
+    if (body.exceeded) {
+      IOTHUB_WARN(F("Actor state body was too large"));
+      SendStatus(res, 413, "Payload Too Large");
+      return;
+    }
+    if (!parsed) {
+      IOTHUB_WARN(F("Failed to parse actor state"));
+      res.fail();
+      return;
+    }
+    if (!actor->type->accepts(new_state)) {
+      IOTHUB_WARN(F("Actor state out of range for its type"));
+      res.fail();
+      return;
     }
 
+    ApplyActorState(actor, new_state);
+
+    // send a response with the new state to confirm the action has completed
+    if (response_encoding == encoding_cbor) {
+      res.success("application/cbor");
+      ChunkedPrint out(res);
+      CborWriter cbor(out);
+      cbor.WriteMap(1);
+      WriteCborState(cbor, actor);
+      return;
+    }
     res.success("application/json");
-    json_array.printTo(res);
+    ChunkedPrint out(res);
+    PrintActorJson(out, actor, false, false);
   }
 
-  void DebugRequest(Request &request) {
-    Serial.print("Request Type: ");
-    switch(request.method()){
-      case Request::MethodType::GET:
-        Serial.println("GET");
-      break;
-      case Request::MethodType::POST:
-        Serial.println("GET");
-      break;
+  // sets an actor's state and runs its callback with it
+  void ApplyActorState(actor* actor, double new_state) {
+    IOTHUB_DEBUG(F("Running callback..."));
+    ActorStatesChanged();
+    actor->type->apply(actor, new_state);
+  }
+
+  // writes an actor straight out as a JSON object, with its id and name when asked for and always its state
+  void PrintActorJson(Print& out, actor* actor, bool with_id, bool with_name) {
+    out.print('{');
+    if (with_id) {
+      out.print("\"id\":"); PrintJsonString(out, actor->id); out.print(',');
+    }
+    if (with_name) {
+      out.print("\"name\":"); PrintJsonString(out, actor->name); out.print(',');
+    }
+    out.print("\"state\":");
+    actor->type->print_json(out, actor);
+    out.print('}');
+  }
+
+  // writes the listing of every declared actor, memory use is the same however many there are
+  void PrintActorsJson(Print& out) {
+    out.print('[');
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (i > 0) out.print(',');
+      PrintActorJson(out, &actors[i], true, true);
     }
-    Serial.print("Location: ");
-    Serial.println(request.urlPath());
-    /* This is disabled as it actually consumes the request body so it cannot be later routes
-    Serial.print("Request Body: ");
-    char c_string_body[50];
-    CStringReqBody(request, c_string_body);
-    Serial.println(c_string_body);
-    */
+    out.print(']');
   }
 
-  void PrintStringFragment (char * string_fragment, uint string_fragment_length) {
-    if (string_fragment == NULL) {
-      Serial.println("String fragment pointer was null");
+  // bumped whenever an actor's state or id changes, it versions the cached listing and the ETags of actor responses
+  uint32_t actor_states_version = 1;
+  uint32_t etag_epoch = 0; // random per boot, so an ETag from before a restart never matches
+  char request_if_none_match[32]; // the If-None-Match header of the request being handled
+
+  // the JSON listing of every actor, rebuilt on the first request after a change. Single actor responses are
+  // slices of it, listing_cache_offsets holds where each actor's object starts plus where the last one ends. Sensor
+  // only nodes have no actor server, so no cache either
+  char listing_cache[number_actor_ids > 0 ? actor_listing_cache_length : 0];
+  uint listing_cache_length = 0;
+  uint32_t listing_cache_version = 0;
+  bool listing_cache_valid = false;
+  uint16_t listing_cache_offsets[(number_actor_ids > 0 ? number_actor_ids : 1) + 1];
+
+  void ActorStatesChanged() {
+    actor_states_version++;
+  }
+
+  // serializes the listing into the cache if it has changed since, false if it doesn't fit
+  bool UpdateListingCache() {
+    if (listing_cache_version == actor_states_version) return listing_cache_valid;
+    BufferPrint cache(listing_cache, sizeof(listing_cache));
+    cache.print('[');
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (i > 0) cache.print(',');
+      listing_cache_offsets[i] = cache.length;
+      PrintActorJson(cache, &actors[i], true, true);
+    }
+    listing_cache_offsets[last_actor_added_index] = cache.length;
+    cache.print(']');
+    listing_cache_length = cache.length;
+    listing_cache_valid = !cache.overflowed;
+    listing_cache_version = actor_states_version;
+    if (!listing_cache_valid) {
+      IOTHUB_DEBUG(F("Actor listing too large to cache"));
+    }
+    return listing_cache_valid;
+  }
+
+  // the ETag of the current actor states in the response encoding, single actor responses share it with the listing
+  void FormatEtag(char* etag, uint etag_size) {
+    snprintf(etag, etag_size, "\"%08lx-%lx%s\"", (unsigned long)etag_epoch, (unsigned long)actor_states_version,
+    response_encoding == encoding_cbor ? "c" : "");
+  }
+
+  // answers 304 Not Modified if the hub already has this version, true if it did
+  bool SendNotModified(Print &res, const char* etag) {
+    if (strcmp(request_if_none_match, etag) != 0) return false;
+    res.print("HTTP/1.1 304 Not Modified\r\nETag: "); res.print(etag);
+    res.print("\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    return true;
+  }
+
+  // writes a 200 response head with an ETag, aWOT's success() ends the headers before one could be added
+  void SendSuccess(Print &res, const char* content_type, const char* etag, int content_length = -1) {
+    res.print("HTTP/1.1 200 OK\r\nContent-Type: "); res.print(content_type);
+    res.print("\r\nETag: "); res.print(etag);
+    if (content_length >= 0) {
+      res.print("\r\nContent-Length: "); res.print(content_length);
+    }
+    res.print("\r\nConnection: close\r\n\r\n");
+  }
+
+  // one update of a bulk state change, held until the whole request has been validated
+  struct actor_update {
+    actor* target;
+    double state;
+  };
+  static const uint max_actor_updates = number_actor_ids > 0 ? number_actor_ids : 1;
+
+  // Updates many actors from a list of {"id": ..., "state": ...} in one request. Nothing is changed unless every
+  // entry parses and names a known actor, then the callbacks run in list order and the new states are returned
+  void PostActorStatesHandler(Request &req, Response &res, route_parameter* params) {
+    actor_update updates[max_actor_updates];
+    uint update_count = 0;
+    bool too_many = false;
+    LimitedStream body(req, max_request_body_length);
+    bool parsed;
+    if (request_encoding == encoding_cbor) {
+      parsed = ReadCborUpdates(body, updates, &update_count, &too_many);
+    } else {
+      parsed = ReadJsonUpdates(body, updates, &update_count, &too_many);
+    }
+    if (body.exceeded || too_many) {
+      IOTHUB_WARN(F("Bulk actor update was too large"));
+      SendStatus(res, 413, "Payload Too Large");
       return;
     }
-    Serial.print("String Fragment: ");
-    for (uint i =0; i < string_fragment_length; i++) {
-      Serial.print(string_fragment[i]);
+    if (!parsed) {
+      IOTHUB_WARN(F("Failed to parse bulk actor update"));
+      res.fail();
+      return;
+    }
+
+    for (uint i = 0; i < update_count; i++) {
+      ApplyActorState(updates[i].target, updates[i].state);
+    }
+
+    if (response_encoding == encoding_cbor) {
+      res.success("application/cbor");
+      ChunkedPrint out(res);
+      CborWriter cbor(out);
+      cbor.WriteArray(update_count);
+      for (uint i = 0; i < update_count; i++) {
+        cbor.WriteMap(2);
+        cbor.WriteString("id"); cbor.WriteString(updates[i].target->id);
+        WriteCborState(cbor, updates[i].target);
+      }
+      return;
+    }
+    res.success("application/json");
+    ChunkedPrint out(res);
+    out.print('[');
+    for (uint i = 0; i < update_count; i++) {
+      if (i > 0) out.print(',');
+      PrintActorJson(out, updates[i].target, true, false);
+    }
+    out.print(']');
+  }
+
+  // adds an update to the list if the id is known and there is room, too_many is set if there isn't
+  bool AddActorUpdate(const char* id, double state, actor_update* updates, uint* update_count, bool* too_many) {
+    actor* target = FindActor(id, strlen(id));
+    if (target == NULL) {
+      IOTHUB_WARN(F("Bulk update names an unknown actor: "), id);
+      return false;
+    }
+    if (!target->type->accepts(state)) {
+      IOTHUB_WARN(F("Bulk update state out of range for actor: "), id);
+      return false;
+    }
+    if (*update_count >= max_actor_updates) {
+      *too_many = true;
+      return false;
+    }
+    updates[*update_count].target = target;
+    updates[*update_count].state = state;
+    (*update_count)++;
+    return true;
+  }
+
+  bool ReadJsonUpdates(Stream &body, actor_update* updates, uint* update_count, bool* too_many) {
+    JsonReader json(body);
+    if (!json.Expect('[')) return false;
+    bool first_update = true;
+    while (json.More(']', &first_update)) {
+      char id[sizeof(actor::id) + 1]; // one spare so an over long id doesn't get truncated into a valid one
+      double state;
+      bool has_id = false;
+      bool has_state = false;
+      if (!json.Expect('{')) return false;
+      bool first = true;
+      while (json.More('}', &first)) {
+        char key[8];
+        if (!json.ReadKey(key, sizeof(key))) return false;
+        if (strcmp(key, "id") == 0) {
+          if (!json.ReadString(id, sizeof(id))) return false;
+          has_id = true;
+        } else if (strcmp(key, "state") == 0) {
+          if (!json.ReadNumber(&state)) return false;
+          has_state = true;
+        } else if (!json.SkipValue()) {
+          return false;
+        }
+      }
+      if (json.failed || !has_id || !has_state) return false;
+      if (!AddActorUpdate(id, state, updates, update_count, too_many)) return false;
+    }
+    return !json.failed;
+  }
+
+  // the same for a CBOR array of maps
+  bool ReadCborUpdates(Stream &body, actor_update* updates, uint* update_count, bool* too_many) {
+    CborReader cbor(body);
+    uint8_t major, additional;
+    uint64_t update_total;
+    if (!cbor.ReadHead(&major, &additional, &update_total) || major != 4) return false;
+    for (uint64_t u = 0; u < update_total; u++) {
+      char id[sizeof(actor::id) + 1];
+      double state;
+      bool has_id = false;
+      bool has_state = false;
+      uint64_t pairs;
+      if (!cbor.ReadHead(&major, &additional, &pairs) || major != 5) return false;
+      for (uint64_t i = 0; i < pairs; i++) {
+        uint64_t argument;
+        bool is_id = false;
+        bool is_state = false;
+        if (!cbor.ReadHead(&major, &additional, &argument)) return false;
+        if (major != 3) return false;
+        char key[8];
+        if (!cbor.ReadText(argument, key, sizeof(key))) return false;
+        is_id = (strcmp(key, "id") == 0);
+        is_state = (strcmp(key, "state") == 0);
+        if (!cbor.ReadHead(&major, &additional, &argument)) return false;
+        if (is_id && major == 3) {
+          if (!cbor.ReadText(argument, id, sizeof(id))) return false;
+          has_id = true;
+        } else if (is_state) {
+          if (!cbor.ToNumber(major, additional, argument, &state)) return false;
+          has_state = true;
+        } else if (!cbor.SkipItem(major, argument)) {
+          return false;
+        }
+      }
+      if (!has_id || !has_state) return false;
+      if (!AddActorUpdate(id, state, updates, update_count, too_many)) return false;
+    }
+    return true;
+  }
+
+  void GetActorsHandler(Request &req, Response &response, route_parameter* params) {
+    IOTHUB_DEBUG(F("Sensor Listing Requested"));
+
+    IOTHUB_DEBUG(F("Number actor ids: "), number_actor_ids);
+
+    ChunkedPrint res(response);
+    char etag[32];
+    FormatEtag(etag, sizeof(etag));
+    if (SendNotModified(res, etag)) return;
+
+    if (response_encoding == encoding_cbor) {
+      SendSuccess(res, "application/cbor", etag);
+      CborWriter cbor(res);
+      cbor.WriteArray(last_actor_added_index);
+      for (uint i = 0; i < last_actor_added_index; i++) {
+        WriteCborActor(cbor, &actors[i]);
+      }
+      return;
+    }
+
+    if (UpdateListingCache()) {
+      SendSuccess(res, "application/json", etag, listing_cache_length);
+      res.write((const uint8_t*)listing_cache, listing_cache_length);
+      return;
+    }
+
+    // too long to cache, written out actor by actor instead
+    SendSuccess(res, "application/json", etag);
+    PrintActorsJson(res);
+  }
+
+  // reads the state out of a JSON object such as {"state": 1}, other keys are skipped
+  bool ReadJsonState(Stream &body, double* state) {
+    JsonReader json(body);
+    if (!json.Expect('{')) return false;
+    bool found = false;
+    bool first = true;
+    while (json.More('}', &first)) {
+      char key[8];
+      if (!json.ReadKey(key, sizeof(key))) return false;
+      if (strcmp(key, "state") == 0) {
+        if (!json.ReadNumber(state)) return false;
+        found = true;
+      } else if (!json.SkipValue()) {
+        return false;
+      }
+    }
+    return found && !json.failed;
+  }
+
+  // the same for a CBOR map
+  bool ReadCborState(Stream &body, double* state) {
+    CborReader cbor(body);
+    uint8_t major, additional;
+    uint64_t pairs;
+    if (!cbor.ReadHead(&major, &additional, &pairs) || major != 5) return false;
+    bool found = false;
+    for (uint64_t i = 0; i < pairs; i++) {
+      uint64_t argument;
+      bool is_state = false;
+      if (!cbor.ReadHead(&major, &additional, &argument)) return false;
+      if (major == 3) {
+        if (!cbor.ReadStringEquals(argument, "state", &is_state)) return false;
+      } else if (!cbor.SkipItem(major, argument)) {
+        return false;
+      }
+      if (!cbor.ReadHead(&major, &additional, &argument)) return false;
+      if (is_state) {
+        if (!cbor.ToNumber(major, additional, argument, state)) return false;
+        found = true;
+      } else if (!cbor.SkipItem(major, argument)) {
+        return false;
+      }
+    }
+    return found;
+  }
+
+  // writes the "state" key and value of an actor into a CBOR map
+  void WriteCborState(CborWriter& cbor, actor* actor) {
+    cbor.WriteString("state");
+    actor->type->write_cbor(cbor, actor);
+  }
+
+  void WriteCborActor(CborWriter& cbor, actor* actor) {
+    cbor.WriteMap(3);
+    cbor.WriteString("id"); cbor.WriteString(actor->id);
+    cbor.WriteString("name"); cbor.WriteString(actor->name);
+    WriteCborState(cbor, actor);
+  }
+
+  // Prometheus text format, histograms are cumulative so each bucket includes the ones below it
+  void PrintHistogram(Print& out, const char* name, const char* help, const histogram& values, const uint32_t* bounds) {
+    out.print("# HELP "); out.print(name); out.print(" "); out.print(help); out.print("\n");
+    out.print("# TYPE "); out.print(name); out.print(" histogram\n");
+    uint32_t cumulative = 0;
+    for (uint i = 0; i <= histogram_buckets; i++) {
+      cumulative += values.buckets[i];
+      out.print(name); out.print("_bucket{le=\"");
+      if (i < histogram_buckets) {
+        out.print(bounds[i]);
+      } else {
+        out.print("+Inf");
+      }
+      out.print("\"} "); out.print(cumulative); out.print("\n");
+    }
+    out.print(name); out.print("_sum "); out.print((double)values.sum, 0); out.print("\n");
+    out.print(name); out.print("_count "); out.print(values.count); out.print("\n");
+  }
+
+  void PrintMetric(Print& out, const char* name, const char* type, const char* help, uint32_t value) {
+    out.print("# HELP "); out.print(name); out.print(" "); out.print(help); out.print("\n");
+    out.print("# TYPE "); out.print(name); out.print(" "); out.print(type); out.print("\n");
+    out.print(name); out.print(" "); out.print(value); out.print("\n");
+  }
+
+  void GetMetricsHandler(Request &req, Response &response, route_parameter* params) {
+    response.success("text/plain; version=0.0.4");
+    ChunkedPrint res(response);
+    PrintHistogram(res, "iothub_upload_time_ms", "Time from starting a reading upload to the hub answering.",
+    upload_time_ms, upload_time_bounds);
+    PrintHistogram(res, "iothub_request_time_us", "Time the embedded server took to handle a request.",
+    request_time_us, request_time_bounds);
+
+    res.print("# HELP iothub_hub_responses_total Hub responses by status class, class 0 is no response.\n");
+    res.print("# TYPE iothub_hub_responses_total counter\n");
+    for (uint i = 0; i < 6; i++) {
+      res.print("iothub_hub_responses_total{class=\""); res.print(i); res.print("xx\"} ");
+      res.print(hub_status_counts[i]); res.print("\n");
+    }
+
+    PrintMetric(res, "iothub_hub_connections_opened_total", "counter", "Hub connections opened, each one after the first is a reconnect.",
+    hub_connections_opened);
+    PrintMetric(res, "iothub_hub_connections_reused_total", "counter", "Hub requests sent on an open connection.", hub_connections_reused);
+    PrintMetric(res, "iothub_readings_dropped_total", "counter", "Readings lost without being uploaded.", readings_dropped);
+    PrintMetric(res, "iothub_readings_queued", "gauge", "Readings waiting to be uploaded.", reading_queue_count);
+    PrintMetric(res, "iothub_readings_logged", "gauge", "Readings waiting in the offline log.", LoggedReadings());
+    PrintMetric(res, "iothub_registered_after_ms", "gauge", "Time from boot to registration completing, 0 until it has.",
+    registered_after_ms);
+    PrintMetric(res, "iothub_wifi_connect_ms", "gauge", "Time the last wifi connection took to come up.", wifi_connect_ms);
+    PrintMetric(res, "iothub_uptime_ms", "gauge", "Time since boot.", IOTHUB_MILLIS());
+    PrintMetric(res, "iothub_free_heap_bytes", "gauge", "Free heap.", ESP.getFreeHeap());
+    PrintMetric(res, "iothub_max_free_block_bytes", "gauge", "Largest block the heap can allocate.", ESP.getMaxFreeBlockSize());
+    PrintMetric(res, "iothub_heap_fragmentation_percent", "gauge", "Heap fragmentation.", ESP.getHeapFragmentation());
+  }
+
+  // sends a bodyless response for statuses aWOT has no method for
+  void SendStatus(Response &res, int code, const char* reason) {
+    res.print("HTTP/1.1 "); res.print(code); res.print(" "); res.print(reason); res.print("\r\n");
+    res.print("Content-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+
+  void DebugRequest(Request &request) {
+    switch(request.method()){
+      case Request::MethodType::GET:
+        IOTHUB_DEBUG(F("Request Type: GET"));
+      break;
+      case Request::MethodType::POST:
+        IOTHUB_DEBUG(F("Request Type: POST"));
+      break;
+    }
+    IOTHUB_DEBUG(F("Location: "), request.urlPath());
+    // the request body is not logged as reading it consumes it before the route handler gets to it
+  }
+
+  // packs a 24 character hex id into three words, returns false if it is the wrong length or not hex
+  bool PackId(const char* id, uint id_length, uint32_t* packed_id) {
+    if (id_length != 24) return false;
+    for (uint word = 0; word < 3; word++) {
+      uint32_t value = 0;
+      for (uint digit = 0; digit < 8; digit++) {
+        char c = id[word * 8 + digit];
+        uint32_t nibble;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else return false;
+        value = (value << 4) | nibble;
+      }
+      packed_id[word] = value;
+    }
+    return true;
+  }
+
+  // the reverse of PackId, writes 24 lower case hex characters and a null terminator
+  void UnpackId(const uint32_t* packed_id, char* id) {
+    const char* hex_digits = "0123456789abcdef";
+    for (uint word = 0; word < 3; word++) {
+      for (uint digit = 0; digit < 8; digit++) {
+        id[word * 8 + digit] = hex_digits[(packed_id[word] >> (28 - digit * 4)) & 0xF];
+      }
+    }
+    id[24] = 0;
+  }
+
+  // the last word holds the low bytes of the id's counter, which vary the most between ids
+  uint ActorIndexSlot(const uint32_t* packed_id) {
+    return (packed_id[2] ^ packed_id[0]) & (actor_index_size - 1);
+  }
+
+  // adds actors[position] to the index, actors whose ids are not valid hex are left out and can't be found
+  void IndexActor(uint position) {
+    if (!PackId(actors[position].id, strlen(actors[position].id), actors[position].packed_id)) {
+      IOTHUB_WARN(F("Actor id is not a valid hex id, it will not be reachable"));
+      return;
+    }
+    uint slot = ActorIndexSlot(actors[position].packed_id);
+    while (actor_index[slot] != actor_index_empty) {
+      slot = (slot + 1) & (actor_index_size - 1);
+    }
+    actor_index[slot] = position;
+  }
+
+  actor* FindActor(const char* actor_id, uint actor_id_length) {
+    uint32_t packed_id[3];
+    if (!PackId(actor_id, actor_id_length, packed_id)) {
+      return NULL;
+    }
+    // the index is never more than half full so there is always an empty slot to stop at
+    uint slot = ActorIndexSlot(packed_id);
+    while (actor_index[slot] != actor_index_empty) {
+      actor* candidate = &actors[actor_index[slot]];
+      if (candidate->packed_id[0] == packed_id[0] &&
+      candidate->packed_id[1] == packed_id[1] &&
+      candidate->packed_id[2] == packed_id[2]) {
+        return candidate;
+      }
+      slot = (slot + 1) & (actor_index_size - 1);
+    }
+    return NULL;
+  }
+
+  void GetActorHandler(Request &req, Response &response, route_parameter* params) {
+    IOTHUB_DEBUG(F("Single Actor listing requested"));
+
+    actor* actor = FindActor(params[0].value, params[0].length);
+    if (actor == NULL) {
+      IOTHUB_WARN(F("Was unable to find matching actor"));
+      response.notFound();
+      return;
+    } // make sure the id exists before sending anything
+
+    ChunkedPrint res(response);
+    char etag[32];
+    FormatEtag(etag, sizeof(etag));
+    if (SendNotModified(res, etag)) return;
+
+    if (response_encoding == encoding_cbor) {
+      SendSuccess(res, "application/cbor", etag);
+      CborWriter cbor(res);
+      WriteCborActor(cbor, actor);
+      return;
+    }
+
+    if (UpdateListingCache()) {
+      uint index = actor - actors;
+      uint start = listing_cache_offsets[index];
+      uint end = listing_cache_offsets[index + 1];
+      if (index + 1 < last_actor_added_index) end--; // the comma before the next actor
+      SendSuccess(res, "application/json", etag, end - start);
+      res.write((const uint8_t*)listing_cache + start, end - start);
+      return;
+    }
+
+    SendSuccess(res, "application/json", etag);
+    PrintActorJson(res, actor, true, true);
+  }
+
+  // every route the embedded server answers, a pattern segment starting with ':' matches any single url segment
+  typedef void (iotHubLib::*route_handler)(Request &req, Response &res, route_parameter* params);
+  struct route {
+    Request::MethodType method;
+    const char* pattern;
+    route_handler handler;
+  };
+  static const uint route_count = 5; // the number of entries in routes, defined below the class
+  static const route routes[route_count];
+  static_assert(route_count <= 32, "FindRoute tracks candidate routes in a 32 bit mask");
+
+  // Matches the url against every route in one pass over its segments. Routes that stop matching are dropped as
+  // soon as they differ, and :parameters are recorded as pointers into the url. Returns NULL if no route matched.
+  const route* FindRoute(Request::MethodType method, char* url_path, route_parameter* params) {
+    const char* cursors[route_count];
+    route_parameter candidate_params[route_count][max_route_parameters];
+    uint candidate_param_count[route_count];
+    uint32_t candidates = 0; // bit i is set while routes[i] still matches
+
+    for (uint i = 0; i < route_count; i++) {
+      if (routes[i].method == method) {
+        candidates |= (uint32_t)1 << i;
+        cursors[i] = routes[i].pattern;
+        candidate_param_count[i] = 0;
+      }
+    }
+
+    char* segment = url_path;
+    while (candidates != 0) {
+      char* segment_end = segment;
+      while (*segment_end != 0 && *segment_end != '/') segment_end++;
+      uint segment_len = segment_end - segment;
+
+      for (uint i = 0; i < route_count; i++) {
+        if ((candidates & ((uint32_t)1 << i)) == 0) continue;
+        const char* pattern_segment = cursors[i];
+        const char* pattern_end = pattern_segment;
+        while (*pattern_end != 0 && *pattern_end != '/') pattern_end++;
+
+        bool segment_matches;
+        if (*pattern_segment == 0) {
+          segment_matches = false; // the url has more segments than the pattern
+        } else if (*pattern_segment == ':') {
+          segment_matches = segment_len > 0 && candidate_param_count[i] < max_route_parameters;
+          if (segment_matches) {
+            candidate_params[i][candidate_param_count[i]].value = segment;
+            candidate_params[i][candidate_param_count[i]].length = segment_len;
+            candidate_param_count[i]++;
+          }
+        } else {
+          segment_matches = (uint)(pattern_end - pattern_segment) == segment_len && strncmp(pattern_segment, segment, segment_len) == 0;
+        }
+
+        if (!segment_matches) {
+          candidates &= ~((uint32_t)1 << i);
+        }
+        cursors[i] = (*pattern_end == '/') ? pattern_end + 1 : pattern_end;
+      }
+
+      if (*segment_end == 0) break;
+      segment = segment_end + 1;
+    }
+
+    // a route matches if its pattern ran out at the same time as the url
+    for (uint i = 0; i < route_count; i++) {
+      if ((candidates & ((uint32_t)1 << i)) != 0 && *cursors[i] == 0) {
+        for (uint j = 0; j < candidate_param_count[i]; j++) {
+          params[j] = candidate_params[i][j];
+        }
+        return &routes[i];
+      }
+    }
+    return NULL;
+  }
+
+  // based on process method provided by aWOT
+  void ProcessRequests(Client *client, char *buff, int buff_len) {
+    if (client != NULL) {
+      unsigned long request_start = IOTHUB_MICROS();
+      Request request;
+      Response response;
+
+      response.init(client);
+      request.init(client, buff, buff_len);
+      request.processRequest();
+      if (request.method() == Request::INVALID) {
+        response.fail();
+      } else {
+        // the content type and accept headers choose between JSON and CBOR bodies
+        char content_type[24] = "";
+        char accept[48] = "";
+        request_if_none_match[0] = 0;
+        Request::HeaderNode if_none_match_header = {"If-None-Match", request_if_none_match, sizeof(request_if_none_match), NULL};
+        Request::HeaderNode accept_header = {"Accept", accept, sizeof(accept), &if_none_match_header};
+        Request::HeaderNode content_type_header = {"Content-Type", content_type, sizeof(content_type), &accept_header};
+        request.processHeaders(&content_type_header);
+        request_encoding = (strncmp(content_type, "application/cbor", 16) == 0) ? encoding_cbor : encoding_json;
+        response_encoding = (strstr(accept, "application/cbor") != NULL) ? encoding_cbor : encoding_json;
+
+        // while there are more requests, keep processing them
+        if (request.next()){
+          DebugRequest(request);
+
+          route_parameter params[max_route_parameters];
+          const route* matched_route = FindRoute(request.method(), request.urlPath(), params);
+          if (matched_route != NULL) {
+            (this->*(matched_route->handler))(request, response, params);
+          } else {
+            // if no route is found, send a 404
+            IOTHUB_DEBUG(F("internal rest server 404ed"));
+            response.notFound();
+          }
+        }
+        request.reset();
+        response.reset();
+      }
+      last_request_micros = IOTHUB_MICROS() - request_start;
+      request_time_us.Record(last_request_micros, request_time_bounds);
+      IOTHUB_DEBUG(F("Request handled in "), last_request_micros, F("us"));
+    }
+  }
+
+  // The length of a request whose head has arrived, with as much of its body as handling it reads, or 0 while the blank
+  // line ending the head hasn't arrived. Bodies over max_request_body_length only need one byte past it for a 413
+  uint CompleteRequestLength(const char* head, uint length) {
+    unsigned long content_length = 0;
+    const char* line = head;
+    for (uint i = 0; i + 1 < length; i++) {
+      if (head[i] != '\r' || head[i + 1] != '\n') continue;
+      if (head + i == line) {
+        if (content_length > max_request_body_length) content_length = max_request_body_length + 1;
+        return i + 2 + content_length;
+      }
+      if (HeaderIs(line, "content-length:")) {
+        content_length = strtoul(line + 15, NULL, 10);
+      }
+      line = head + i + 2;
+    }
+    return 0;
+  }
+
+  // true once a connection's request can be served without waiting on the network, answers 431 to heads too large
+  // to ever complete
+  bool RequestArrived(server_connection& connection) {
+    uint available = connection.client.available();
+    if (available == connection.checked_length) return false;
+    connection.checked_length = available;
+
+    char head[max_request_head_length + 1];
+    // only ask for what has arrived, peekBytes() waits for the rest of a longer length
+    uint wanted = available < max_request_head_length ? available : max_request_head_length;
+    uint length = connection.client.peekBytes(head, wanted);
+    head[length] = 0;
+    uint request_length = CompleteRequestLength(head, length);
+    if (request_length == 0) {
+      if (length < max_request_head_length) return false;
+      IOTHUB_WARN(F("Request head was too large"));
+      connection.client.print(F("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n"
+      "Content-Length: 0\r\n\r\n"));
+      connection.client.stop();
+      return false;
+    }
+    return available >= request_length;
+  }
+
+  // accepts every waiting client, then serves every connection whose request has fully arrived. A request that is
+  // still arriving is kept for a later pass rather than served from its first bytes, and closed once it times out
+  void CheckConnections() {
+    unsigned long now = IOTHUB_MILLIS();
+    while (true) {
+      WiFiClient client = server.available();
+      if (!client) break;
+      server_connection* free_slot = NULL;
+      for (uint i = 0; i < max_server_connections; i++) {
+        if (!server_connections[i].client.connected()) {
+          free_slot = &server_connections[i];
+          break;
+        }
+      }
+      if (free_slot == NULL) {
+        IOTHUB_WARN(F("Too many connections to the actor server, closing one"));
+        client.stop();
+        break;
+      }
+      free_slot->client = client;
+      free_slot->accepted = now;
+      free_slot->checked_length = 0;
+    }
+
+    for (uint i = 0; i < max_server_connections; i++) {
+      server_connection& connection = server_connections[i];
+      if (!connection.client.connected()) continue;
+      if (RequestArrived(connection)) {
+        char request[SERVER_DEFAULT_REQUEST_LENGTH];
+        ProcessRequests(&connection.client, request, SERVER_DEFAULT_REQUEST_LENGTH);
+        connection.client.stop(); // the response is only finished once the connection closes
+      } else if (now - connection.accepted >= server_request_timeout) {
+        IOTHUB_DEBUG(F("Closing actor server connection that didn't send a whole request in time"));
+        connection.client.stop();
+      }
+    }
+  }
+
+  // FNV-1a hash of a node name, kind keeps a sensor and an actor with the same name apart and occurrence keeps apart
+  // nodes of one kind declared with the same name. The first of them hashes as a name did before occurrences were added
+  uint32_t NameHash(const char* name, char kind, uint occurrence) {
+    uint32_t hash = 2166136261;
+    hash = (hash ^ (uint8_t)kind) * 16777619;
+    while (*name != 0) {
+      hash = (hash ^ (uint8_t)*name) * 16777619;
+      name++;
+    }
+    if (occurrence > 0) {
+      hash *= 16777619; // a 0 byte, which no name contains, so this can't collide with a longer name
+      for (uint i = 0; i < sizeof(occurrence); i++) {
+        hash = (hash ^ (uint8_t)(occurrence >> (8 * i))) * 16777619;
+      }
+    }
+    return hash;
+  }
+
+  // the keys sensors and actors are stored under, counting the nodes declared before them with the same name
+  uint32_t SensorKey(const sensor* sensor_ptr) {
+    uint occurrence = 0;
+    for (const sensor* other = sensors; other < sensor_ptr; other++) {
+      if (strcmp(other->name, sensor_ptr->name) == 0) occurrence++;
+    }
+    return NameHash(sensor_ptr->name, 's', occurrence);
+  }
+  uint32_t ActorKey(const actor* actor_ptr) {
+    uint occurrence = 0;
+    for (const actor* other = actors; other < actor_ptr; other++) {
+      if (strcmp(other->name, actor_ptr->name) == 0) occurrence++;
+    }
+    return NameHash(actor_ptr->name, 'a', occurrence);
+  }
+
+  // checks the store in a slot without copying it out of EEPROM, returns its sequence or -1 if it is not valid
+  long IdStoreSlotSequence(uint slot) {
+    uint base = slot * sizeof(id_store);
+    id_store header;
+    for (uint i = 0; i < offsetof(id_store, entries); i++) {
+      ((uint8_t*)&header)[i] = EEPROM.read(base + i);
+    }
+    if (header.magic != id_store_magic || header.version != id_store_version || header.count > id_store_length) {
+      return -1;
+    }
+    uint32_t crc = 0;
+    for (uint i = sizeof(header.crc); i < sizeof(id_store); i++) {
+      uint8_t byte_value = EEPROM.read(base + i);
+      crc = Crc32(&byte_value, 1, crc);
+    }
+    if (crc != header.crc) {
+      IOTHUB_WARN(F("Id store slot "), slot, F(" is corrupted"));
+      return -1;
+    }
+    return header.sequence;
+  }
+
+  // loads the newest valid store, if neither slot is valid the store starts empty and every node is registered again
+  void LoadIdStore() {
+    if (ids_loaded) return;
+    EEPROM.begin(eeprom_size); // so we can read / write EEPROM
+    ids_loaded = true;
+
+    long sequences[2] = {IdStoreSlotSequence(0), IdStoreSlotSequence(1)};
+    int newest = -1;
+    if (sequences[0] >= 0) newest = 0;
+    // sequences wrap, so the newer of two valid slots is the one whose sequence is just ahead of the other
+    if (sequences[1] >= 0 && (newest == -1 || (int16_t)(sequences[1] - sequences[0]) > 0)) newest = 1;
+
+    if (newest == -1) {
+      memset(&ids, 0, sizeof(ids));
+      // before the id store byte 0 was set to 128 once the first id had been written
+      legacy_ids = EEPROM.read(0) == 128;
+      if (legacy_ids) {
+        IOTHUB_INFO(F("Found ids in the old EEPROM layout, they will be moved to the id store"));
+      } else {
+        IOTHUB_INFO(F("No id store found, all nodes will be registered"));
+      }
+      return;
+    }
+    uint base = newest * sizeof(id_store);
+    for (uint i = 0; i < sizeof(id_store); i++) {
+      ((uint8_t*)&ids)[i] = EEPROM.read(base + i);
+    }
+    id_store_slot = newest;
+    IOTHUB_DEBUG(F("Loaded "), ids.count, F(" ids from slot "), newest);
+  }
+
+  // writes the store to the other slot with one commit
+  void SaveIdStore() {
+    LoadIdStore();
+    ids.magic = id_store_magic;
+    ids.version = id_store_version;
+    ids.sequence++;
+    ids.crc = Crc32((uint8_t*)&ids + sizeof(ids.crc), sizeof(ids) - sizeof(ids.crc));
+
+    id_store_slot = 1 - id_store_slot;
+    uint base = id_store_slot * sizeof(id_store);
+    for (uint i = 0; i < sizeof(id_store); i++) {
+      EEPROM.write(base + i, ((uint8_t*)&ids)[i]);
+    }
+    EEPROM.commit();
+    ids_dirty = false;
+    IOTHUB_DEBUG(F("Saved "), ids.count, F(" ids to slot "), id_store_slot);
+  }
+
+  id_store_entry* FindStoredId(uint32_t key) {
+    for (uint i = 0; i < ids.count; i++) {
+      if (ids.entries[i].name_hash == key) {
+        return &ids.entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  // looks up the stored id for a node's key, position is where the node was declared among all sensors and actors.
+  // Returns false if there was none
+  bool ReadId(uint32_t key, uint position, char* id) {
+    LoadIdStore();
+    id_store_entry* entry = FindStoredId(key);
+    if (entry == NULL) return ReadLegacyId(key, position, id);
+    UnpackId(entry->packed_id, id);
+    IOTHUB_DEBUG(F("Read from id store: "), id);
+    return true;
+  }
+
+  // The old layout kept each id as 24 chars from byte 1 in the order nodes were declared, sensors and actors together.
+  // An id found there is written to the store, so the first save after registration completes the migration
+  bool ReadLegacyId(uint32_t key, uint position, char* id) {
+    if (!legacy_ids) return false;
+    uint offset = 1 + position * 24;
+    if (offset + 24 > eeprom_size) return false;
+    for (uint i = 0; i < 24; i++) {
+      id[i] = EEPROM.read(offset + i);
+      if (!isalnum(id[i])) {
+        id[0] = 0;
+        return false;
+      }
+    }
+    id[24] = 0;
+    IOTHUB_DEBUG(F("Read from old EEPROM layout: "), id);
+    WriteId(key, id);
+    return true;
+  }
+
+  // records a node's id, it is saved with the rest of the store once registration is done
+  void WriteId(uint32_t key, const char* id) {
+    LoadIdStore();
+    id_store_entry* entry = FindStoredId(key);
+    if (entry == NULL) {
+      if (ids.count == id_store_length) return;
+      entry = &ids.entries[ids.count];
+      ids.count++;
+    }
+    entry->name_hash = key;
+    PackId(id, 24, entry->packed_id);
+    ids_dirty = true;
+  }
+
+  // drops a node's id so it is registered again
+  void ForgetId(uint32_t key) {
+    LoadIdStore();
+    id_store_entry* entry = FindStoredId(key);
+    if (entry == NULL) return;
+    *entry = ids.entries[ids.count - 1];
+    ids.count--;
+    ids_dirty = true;
+  }
+
+  // clears every stored id and restarts, so all nodes are registered again on the next boot
+  void ClearIdsRestart() {
+    LoadIdStore();
+    ids.count = 0;
+    SaveIdStore();
+    InvalidateRtcState(); // RTC memory survives a restart, so the cached ids have to be dropped explicitly
+    ESP.restart();
+  }
+
+  // case insensitive check that a header line starts with the given lower case header name
+  bool HeaderIs(const char* line, const char* header_name) {
+    while (*header_name != 0) {
+      if (tolower(*line) != *header_name) return false;
+      line++;
+      header_name++;
+    }
+    return true;
+  }
+
+  // makes sure the hub connection is open, an existing connection the hub kept alive is reused
+  bool HubConnect(bool* reused) {
+    if (hub_client.connected()) {
+      hub_connections_reused++;
+      *reused = true;
+      return true;
+    }
+    *reused = false;
+    hub_client.stop();
+    if (!hub_client.connect(iothub_server, iothub_port)) {
+      IOTHUB_ERROR(F("Unable to connect to hub"));
+      return false;
+    }
+    hub_connections_opened++;
+    return true;
+  }
+
+  // writes a request to the hub connection, body may be NULL for requests without one
+  void HubWriteRequest(const char* method, const char* url, const char* body, uint body_length, const char* content_type) {
+    hub_client.print(method); hub_client.print(" "); hub_client.print(url); hub_client.print(" HTTP/1.1\r\n");
+    hub_client.print("Host: "); hub_client.print(iothub_server); hub_client.print(":"); hub_client.print(iothub_port); hub_client.print("\r\n");
+    hub_client.print("Connection: keep-alive\r\n");
+    if (body != NULL) {
+      // important! JSON conversion in nodejs requires the content type
+      hub_client.print("Content-Type: "); hub_client.print(content_type); hub_client.print("\r\n");
+      hub_client.print("Content-Length: "); hub_client.print(body_length); hub_client.print("\r\n");
+    }
+    hub_client.print("\r\n");
+    if (body != NULL) {
+      hub_client.write((const uint8_t*)body, body_length);
+    }
+  }
+
+  // starts a request on the shared hub connection, it is then advanced by StepHubRequest(). The method, url and body
+  // must stay valid until it finishes. The response body is copied into response_body if that is not NULL, which may
+  // be the same buffer as the body as the body has been written by the time the response arrives
+  void StartHubRequest(const char* method, const char* url, const char* body, uint body_length, const char* content_type,
+  char* response_body, uint response_body_size) {
+    hub_method = method;
+    hub_url = url;
+    hub_body = body;
+    hub_body_length = body_length;
+    hub_content_type = content_type;
+    hub_response_body = response_body;
+    hub_response_body_size = response_body_size;
+    hub_response_body_len = 0;
+    hub_request_retried = false;
+    hub_upload_in_flight = false;
+    hub_state = hub_connecting;
+    hub_request_start = IOTHUB_MILLIS();
+  }
+
+  // ends the request in flight, the connection is kept open unless the hub asked otherwise or the response was broken
+  void EndHubRequest(int http_code) {
+    if (hub_response_body != NULL && hub_response_body_size > 0) {
+      hub_response_body[hub_response_body_len] = 0;
+    }
+    if (http_code == -1 || !hub_keep_alive || hub_state == hub_reading_until_close) {
+      hub_client.stop();
+    }
+    hub_state = hub_idle;
+    hub_http_code = http_code;
+    hub_status_counts[http_code > 0 && http_code < 600 ? http_code / 100 : 0]++;
+    if (hub_upload_in_flight) {
+      hub_upload_in_flight = false;
+      UploadResult(http_code);
+    }
+  }
+
+  // a request that failed before any response arrived on a reused connection most likely hit a connection the hub had
+  // already closed, so it is retried once on a new one
+  void FailHubRequest() {
+    if (hub_request_reused && !hub_request_retried && hub_state == hub_reading_status && hub_line_len == 0) {
+      IOTHUB_WARN(F("Hub connection was closed, reconnecting"));
+      hub_client.stop();
+      hub_request_retried = true;
+      hub_state = hub_connecting;
+      return;
+    }
+    EndHubRequest(-1);
+  }
+
+  // handles a complete status, header, chunk size or trailer line
+  void HubResponseLine() {
+    hub_line[hub_line_len] = 0;
+    switch (hub_state) {
+      case hub_reading_status:
+        if (hub_line_len < 12 || strncmp(hub_line, "HTTP/1.", 7) != 0) {
+          EndHubRequest(-1);
+          return;
+        }
+        hub_http_code = atoi(hub_line + 9);
+        hub_content_length = -1;
+        hub_chunked = false;
+        hub_keep_alive = true;
+        hub_state = hub_reading_headers;
+        break;
+
+      case hub_reading_headers:
+        // only the headers describing the body length and connection matter here
+        if (hub_line_len > 0) {
+          if (HeaderIs(hub_line, "content-length:")) {
+            hub_content_length = atol(hub_line + 15);
+          } else if (HeaderIs(hub_line, "transfer-encoding:") && strstr(hub_line, "chunked") != NULL) {
+            hub_chunked = true;
+          } else if (HeaderIs(hub_line, "connection:") && strstr(hub_line, "close") != NULL) {
+            hub_keep_alive = false;
+          }
+        } else if (hub_http_code == 204 || hub_http_code == 304 || hub_content_length == 0) {
+          // these never have a body, whatever the headers say
+          EndHubRequest(hub_http_code);
+        } else if (hub_chunked) {
+          hub_state = hub_reading_chunk_size;
+        } else if (hub_content_length > 0) {
+          hub_remaining = hub_content_length;
+          hub_state = hub_reading_body;
+        } else {
+          hub_state = hub_reading_until_close;
+        }
+        break;
+
+      case hub_reading_chunk_size:
+        hub_remaining = strtol(hub_line, NULL, 16);
+        hub_state = (hub_remaining == 0) ? hub_reading_trailer : hub_reading_chunk;
+        break;
+
+      case hub_reading_chunk_end: // the line ending after each chunk
+        hub_state = hub_reading_chunk_size;
+        break;
+
+      case hub_reading_trailer:
+        if (hub_line_len == 0) {
+          EndHubRequest(hub_http_code);
+        }
+        break;
+
+      default:
+        break;
+    }
+    hub_line_len = 0;
+  }
+
+  // handles one byte of the response
+  void HubResponseByte(char c) {
+    switch (hub_state) {
+      case hub_reading_body:
+      case hub_reading_until_close:
+      case hub_reading_chunk:
+        if (hub_response_body != NULL && hub_response_body_len < hub_response_body_size - 1) {
+          hub_response_body[hub_response_body_len] = c;
+          hub_response_body_len++;
+        }
+        if (hub_state == hub_reading_until_close) return;
+        hub_remaining--;
+        if (hub_remaining == 0) {
+          if (hub_state == hub_reading_body) {
+            EndHubRequest(hub_http_code);
+          } else {
+            hub_state = hub_reading_chunk_end;
+          }
+        }
+        break;
+
+      default:
+        // every other state reads lines, anything past the line buffer is dropped
+        if (c == '\n') {
+          if (hub_line_len > 0 && hub_line[hub_line_len - 1] == '\r') hub_line_len--;
+          HubResponseLine();
+        } else if (hub_line_len < sizeof(hub_line) - 1) {
+          hub_line[hub_line_len] = c;
+          hub_line_len++;
+        }
+        break;
+    }
+  }
+
+  // Advances the request in flight by one step: connect, write, or handle whatever response bytes have arrived.
+  // Returns true once there is no request in flight, hub_http_code then holds the result (-1 if the hub was unreachable).
+  // Connecting is the one step that can block, the ESP8266 WiFiClient has no non-blocking connect.
+  bool StepHubRequest() {
+    switch (hub_state) {
+      case hub_idle:
+        return true;
+
+      case hub_connecting:
+        if (!HubConnect(&hub_request_reused)) {
+          EndHubRequest(-1);
+          return true;
+        }
+        hub_state = hub_writing;
+        return false;
+
+      case hub_writing:
+        HubWriteRequest(hub_method, hub_url, hub_body, hub_body_length, hub_content_type);
+        if (hub_response_body != NULL && hub_response_body_size > 0) {
+          hub_response_body[0] = 0;
+        }
+        hub_deadline = IOTHUB_MILLIS() + hub_response_timeout;
+        hub_line_len = 0;
+        hub_state = hub_reading_status;
+        return false;
+
+      default:
+        if (hub_client.available()) {
+          hub_deadline = IOTHUB_MILLIS() + hub_response_timeout; // the timeout is for the hub going quiet, not the whole response
+        }
+        while (hub_state != hub_idle && hub_client.available()) {
+          HubResponseByte((char)hub_client.read());
+        }
+        if (hub_state == hub_idle) return true;
+
+        if (!hub_client.connected()) {
+          if (hub_state == hub_reading_until_close) {
+            EndHubRequest(hub_http_code); // the hub closing the connection marks the end of the body
+          } else {
+            FailHubRequest();
+          }
+        } else if (Reached(IOTHUB_MILLIS(), hub_deadline)) {
+          IOTHUB_ERROR(F("Hub did not respond in time"));
+          EndHubRequest(-1);
+        }
+        return hub_state == hub_idle;
+    }
+  }
+
+  // blocks until the request in flight, if any, has finished and returns its HTTP code
+  int WaitForHubRequest() {
+    while (!StepHubRequest()) {
+      IOTHUB_DELAY(1);
+    }
+    return hub_http_code;
+  }
+
+  // sends a request to the hub over the shared connection and waits for the response, returns the HTTP code or -1 if
+  // the hub could not be reached. Any request already in flight is finished first
+  int HubRequest(const char* method, const char* url, const char* body, uint body_length, const char* content_type,
+  char* response_body, uint response_body_size) {
+    WaitForHubRequest();
+    StartHubRequest(method, url, body, body_length, content_type, response_body, response_body_size);
+    return WaitForHubRequest();
+  }
+
+  // the same for a JSON body, or no body if it is NULL
+  int HubRequest(const char* method, const char* url, const char* json_body, char* response_body, uint response_body_size) {
+    return HubRequest(method, url, json_body, json_body == NULL ? 0 : strlen(json_body), "application/json",
+    response_body, response_body_size);
+  }
+
+  // takes the id out of a response such as {"id": "..."}, other keys are skipped
+  bool GetIdFromJson(const char* json_string, char (*node_id)[25]) {
+    BufferStream response(json_string);
+    JsonReader json(response);
+    char id[sizeof(*node_id) + 1]; // one spare so an over long id isn't truncated into a valid one
+    id[0] = 0;
+    bool first = true;
+    if (json.Expect('{')) {
+      while (json.More('}', &first)) {
+        char key[8];
+        if (!json.ReadKey(key, sizeof(key))) break;
+        if (strcmp(key, "id") != 0 || !ReadIdItem(json, id, sizeof(id))) {
+          json.SkipValue();
+        }
+      }
+    }
+    if (strlen(id) != 24) {
+      IOTHUB_ERROR(F("Response did not contain a valid id"));
+      return false;
+    }
+    strcpy(*node_id, id);
+    return true;
+  }
+
+  // reads an id out of a hub response, anything other than a string (the hub sends null for nodes it could not
+  // register) comes back as an empty id
+  bool ReadIdItem(JsonReader& json, char* id, uint id_size) {
+    id[0] = 0;
+    if (json.Peek() == '"') return json.ReadString(id, id_size);
+    return json.SkipValue();
+  }
+
+  // writes the body registering one node on its own, {"name": ..., "<type_key>": ...}. Returns false if it didn't fit
+  bool PrintNodeRegistration(const char* name, const char* type_key, const char* type) {
+    WaitForHubRequest(); // an upload in flight is still sending from the payload buffer
+    BufferPrint body(payload_buffer, payload_buffer_length);
+    body.print("{\"name\":"); PrintJsonString(body, name);
+    body.print(",\""); body.print(type_key); body.print("\":"); PrintJsonString(body, type);
+    body.print('}');
+    if (body.overflowed) {
+      IOTHUB_ERROR(F("Payload was too large for the payload buffer"));
+      return false;
+    }
+    return true;
+  }
+
+  void SetSensorUrl(sensor *sensor_ptr) {
+    strcpy(sensor_ptr->data_url, "/api/sensors/");
+    strncat(sensor_ptr->data_url, sensor_ptr->id, 24);
+    strcat(sensor_ptr->data_url, "/data");
+  }
+
+  bool CheckActorRegistered(char * actor_id) {
+    char url[37] = "/api/actors/";
+    strncat(url, actor_id, 24);
+
+    int http_code = HubRequest("GET", url, NULL, NULL, 0);
+
+    // actor was found
+    if (http_code == 200) {
+      return true;
+    }
+    // if it wasn't then it does not exist
+    return false;
+  }
+
+  const char* StateTypeName(actor *actor_ptr) {
+    return actor_ptr->type->state_type_name;
+  }
+
+  // drops the id of whichever node has it, so the node is registered again
+  void ForgetNodeWithId(const char* id) {
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (strcmp(sensors[i].id, id) == 0) {
+        IOTHUB_WARN(F("Sensor loaded from memory has expired, reobtaining id"));
+        ForgetId(SensorKey(&sensors[i]));
+        sensors[i].id[0] = 0;
+      }
+    }
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (strcmp(actors[i].id, id) == 0) {
+        IOTHUB_WARN(F("Actor loaded from memory has expired, reobtaining id"));
+        ForgetId(ActorKey(&actors[i]));
+        actors[i].id[0] = 0;
+      }
+    }
+  }
+
+  // Asks the hub which of the stored ids it no longer knows, in one request, and forgets them so those nodes are
+  // registered again. Ids are kept if the hub can't be asked. Returns false if the hub has no bulk endpoint
+  bool ValidateStoredIds() {
+    WaitForHubRequest();
+    BufferPrint body(payload_buffer, payload_buffer_length);
+    uint id_count = 0;
+    body.print("{\"ids\":[");
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (sensors[i].id[0] == 0) continue;
+      if (id_count > 0) body.print(',');
+      PrintJsonString(body, sensors[i].id);
+      id_count++;
+    }
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] == 0) continue;
+      if (id_count > 0) body.print(',');
+      PrintJsonString(body, actors[i].id);
+      id_count++;
+    }
+    body.print("]}");
+    if (id_count == 0) return true;
+    if (body.overflowed) {
+      IOTHUB_ERROR(F("Too many ids to validate in one request"));
+      return true;
+    }
+
+    int http_code = HubRequest("POST", "/api/nodes/validate", payload_buffer, payload_buffer, payload_buffer_length);
+    if (http_code == 404) return false;
+    if (http_code != 200) {
+      IOTHUB_WARN(F("Unable to validate stored ids, HTTP Code: "), http_code);
+      return true;
+    }
+
+    // the response is {"missing": [...]}, read straight out of the payload buffer
+    BufferStream response(payload_buffer);
+    JsonReader json(response);
+    bool first = true;
+    json.Expect('{');
+    while (json.More('}', &first)) {
+      char key[8];
+      if (!json.ReadKey(key, sizeof(key))) break;
+      if (strcmp(key, "missing") != 0) {
+        json.SkipValue();
+        continue;
+      }
+      if (!json.Expect('[')) break;
+      bool first_id = true;
+      while (json.More(']', &first_id)) {
+        char missing_id[sizeof(actor::id) + 1];
+        if (!ReadIdItem(json, missing_id, sizeof(missing_id))) break;
+        if (missing_id[0] != 0) {
+          ForgetNodeWithId(missing_id);
+        }
+      }
+    }
+    if (json.failed) {
+      IOTHUB_WARN(F("Failed to parse id validation response"));
+    }
+    return true;
+  }
+
+  // the fallback for hubs without bulk validation, each stored actor id is checked on its own as before
+  void ValidateStoredIdsEach() {
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] != 0 && !CheckActorRegistered(actors[i].id)) {
+        ForgetNodeWithId(actors[i].id);
+      }
+    }
+  }
+
+  // takes an id from a registration response, nodes the hub did not give a valid id stay unregistered
+  void TakeRegisteredId(const char* id, const char* name, uint32_t key, char* node_id) {
+    if (strlen(id) != 24) {
+      IOTHUB_WARN(F("Hub did not register "), name);
+      return;
+    }
+    strcpy(node_id, id);
+    WriteId(key, node_id);
+  }
+
+  // Registers every node without an id, as many per request as fit in the payload buffer. The hub answers with an id
+  // (or null if it failed) for each node in the order they were sent. Returns false if the hub has no bulk endpoint
+  bool RegisterPendingNodes() {
+    uint next_sensor = 0;
+    uint next_actor = 0;
+    while (true) {
+      uint8_t batch_sensors[number_sensor_ids + 1];
+      uint8_t batch_actors[number_actor_ids + 1];
+      uint batch_sensor_count = 0;
+      uint batch_actor_count = 0;
+
+      WaitForHubRequest();
+      BufferPrint body(payload_buffer, payload_buffer_length);
+      body.print("{\"sensors\":[");
+      for (; next_sensor < last_sensor_added_index; next_sensor++) {
+        sensor* sensor_ptr = &sensors[next_sensor];
+        if (sensor_ptr->id[0] != 0) continue;
+        size_t before = body.length;
+        if (batch_sensor_count > 0) body.print(',');
+        body.print("{\"name\":"); PrintJsonString(body, sensor_ptr->name);
+        body.print(",\"data_type\":"); PrintJsonString(body, sensor_ptr->data_type_name);
+        body.print('}');
+        // leave room to close the body, the rest go in the next request
+        if (body.overflowed || body.length + 16 > body.size) {
+          body.Rewind(before);
+          break;
+        }
+        batch_sensors[batch_sensor_count] = next_sensor;
+        batch_sensor_count++;
+      }
+      body.print("],\"actors\":[");
+      for (; next_actor < last_actor_added_index; next_actor++) {
+        actor* actor_ptr = &actors[next_actor];
+        if (actor_ptr->id[0] != 0) continue;
+        size_t before = body.length;
+        if (batch_actor_count > 0) body.print(',');
+        body.print("{\"name\":"); PrintJsonString(body, actor_ptr->name);
+        body.print(",\"state_type\":"); PrintJsonString(body, StateTypeName(actor_ptr));
+        body.print('}');
+        if (body.overflowed || body.length + 3 > body.size) {
+          body.Rewind(before);
+          break;
+        }
+        batch_actors[batch_actor_count] = next_actor;
+        batch_actor_count++;
+      }
+      body.print("]}");
+      // nothing left, or a node too large to ever fit which max_node_name_length should prevent
+      if (batch_sensor_count + batch_actor_count == 0) return true;
+
+      IOTHUB_INFO(F("Registering "), batch_sensor_count, F(" sensors and "), batch_actor_count, F(" actors"));
+      int http_code = HubRequest("POST", "/api/nodes/register", payload_buffer, payload_buffer, payload_buffer_length);
+      if (http_code == 404) return false;
+      if (http_code != 200) {
+        IOTHUB_ERROR(F("Registration failed, HTTP Code: "), http_code);
+        return true;
+      }
+
+      // the response is {"sensors": [...], "actors": [...]}, read straight out of the payload buffer
+      BufferStream response(payload_buffer);
+      JsonReader json(response);
+      bool first = true;
+      json.Expect('{');
+      while (json.More('}', &first)) {
+        char key[8];
+        if (!json.ReadKey(key, sizeof(key))) break;
+        bool is_sensors = strcmp(key, "sensors") == 0;
+        if (!is_sensors && strcmp(key, "actors") != 0) {
+          json.SkipValue();
+          continue;
+        }
+        if (!json.Expect('[')) break;
+        bool first_id = true;
+        for (uint i = 0; json.More(']', &first_id); i++) {
+          char id[sizeof(sensor::id) + 1];
+          if (!ReadIdItem(json, id, sizeof(id))) break;
+          if (is_sensors && i < batch_sensor_count) {
+            sensor* sensor_ptr = &sensors[batch_sensors[i]];
+            TakeRegisteredId(id, sensor_ptr->name, SensorKey(sensor_ptr), sensor_ptr->id);
+          } else if (!is_sensors && i < batch_actor_count) {
+            actor* actor_ptr = &actors[batch_actors[i]];
+            TakeRegisteredId(id, actor_ptr->name, ActorKey(actor_ptr), actor_ptr->id);
+          }
+        }
+      }
+      if (json.failed) {
+        IOTHUB_ERROR(F("Failed to parse registration response"));
+        return true;
+      }
+    }
+  }
+
+  // the fallback for hubs without bulk registration, one request per node as before
+  void RegisterPendingNodesEach() {
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (sensors[i].id[0] == 0) {
+        BaseRegisterSensor(&sensors[i], sensors[i].data_type_name);
+      }
+    }
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] == 0) {
+        BaseRegisterActor(&actors[i], StateTypeName(&actors[i]));
+      }
+    }
+  }
+
+  void BaseRegisterActor(actor *actor_ptr, const char* state_type) {
+    IOTHUB_INFO(F("Registering actor"));
+
+    if (!PrintNodeRegistration(actor_ptr->name, "state_type", state_type)) return;
+    // then send the json
+    char response_body[hub_response_length];
+    int http_code = HubRequest("POST", "/api/actors", payload_buffer, response_body, sizeof(response_body));
+
+    bool got_id = GetIdFromJson(response_body,&actor_ptr->id);
+    IOTHUB_DEBUG(F("Response ID: "), actor_ptr->id);
+
+    if (http_code == 200 && got_id) {
+      WriteId(ActorKey(actor_ptr), actor_ptr->id);
+    }
+  }
+
+  void BaseRegisterSensor(sensor *sensor_ptr, const char* data_type){
+    IOTHUB_INFO(F("Registering sensor"));
+
+    if (!PrintNodeRegistration(sensor_ptr->name, "data_type", data_type)) return;
+    // then send the json
+    char response_body[hub_response_length];
+    int http_code = HubRequest("POST", "/api/sensors", payload_buffer, response_body, sizeof(response_body));
+
+    bool got_id = GetIdFromJson(response_body,&sensor_ptr->id);
+    IOTHUB_DEBUG(F("Response ID: "), sensor_ptr->id);
+
+    if (http_code == 200 && got_id) {
+      WriteId(SensorKey(sensor_ptr), sensor_ptr->id);
+    }
+  }
+
+  // true once the given millis() deadline has been reached, safe across millis() overflow
+  bool Reached(unsigned long now, unsigned long deadline) {
+    return (long)(now - deadline) >= 0;
+  }
+
+  // samples every scheduled sensor whose period has elapsed and queues the reading
+  void RunDueSensors() {
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (sensors[i].read_callback == NULL) continue;
+      unsigned long now = IOTHUB_MILLIS();
+      if (!Reached(now, sensors[i].next_due)) continue;
+
+      Send(i, sensors[i].read_callback());
+      sensors[i].next_due += sensors[i].period;
+      // if a sample ran very late don't try to catch up with a burst of readings
+      if (Reached(now, sensors[i].next_due)) {
+        sensors[i].next_due = now + sensors[i].period;
+      }
+    }
+  }
+
+  void InvalidateRtcState() {
+    if (!deep_sleep_enabled) return;
+    Rtc().magic = 0;
+    ESP.rtcUserMemoryWrite(0, (uint32_t*)&Rtc(), sizeof(rtc_state));
+  }
+
+  // loads the state saved before the last deep sleep, false if there was none or it was corrupted
+  bool LoadRtcState() {
+    if (!ESP.rtcUserMemoryRead(0, (uint32_t*)&Rtc(), sizeof(rtc_state))) return false;
+    if (Rtc().magic != rtc_state_magic) return false;
+    if (Rtc().crc != Crc32((uint8_t*)&Rtc() + sizeof(Rtc().crc), sizeof(rtc_state) - sizeof(Rtc().crc))) return false;
+    return true;
+  }
+
+  void SaveRtcState() {
+    Rtc().magic = rtc_state_magic;
+    Rtc().crc = Crc32((uint8_t*)&Rtc() + sizeof(Rtc().crc), sizeof(rtc_state) - sizeof(Rtc().crc));
+    ESP.rtcUserMemoryWrite(0, (uint32_t*)&Rtc(), sizeof(rtc_state));
+  }
+
+  // readings taken on each wake, scheduled sensors are sampled every wake, otherwise assume each sensor is sent once
+  uint ReadingsPerWake() {
+    return scheduled_sensor_count > 0 ? scheduled_sensor_count : last_sensor_added_index;
+  }
+
+  // an upload is due when the buffer couldn't hold another wake's readings or the oldest reading is too old
+  bool UploadDue(uint reading_count, uint32_t oldest_sample_time, uint32_t clock) {
+    if (reading_count == 0) return false;
+    if (reading_count + ReadingsPerWake() > rtc_reading_length) return true;
+    return clock - oldest_sample_time >= upload_age;
+  }
+
+  // moves the readings queued on this wake into the RTC buffer, dropping the oldest if it is full
+  void BufferQueuedReadings() {
+    for (uint i = 0; i < reading_queue_count; i++) {
+      if (Rtc().reading_count == rtc_reading_length) {
+        IOTHUB_WARN(F("RTC reading buffer full, dropping oldest reading"));
+        readings_dropped++;
+        memmove(&Rtc().readings[0], &Rtc().readings[1], (rtc_reading_length - 1) * sizeof(rtc_reading));
+        Rtc().reading_count--;
+      }
+      rtc_reading* buffered = &Rtc().readings[Rtc().reading_count];
+      buffered->sample_time = Rtc().clock + reading_queue[i].sample_time;
+      buffered->value = reading_queue[i].value;
+      buffered->sensor_index = reading_queue[i].sensor_index;
+      Rtc().reading_count++;
+    }
+    reading_queue_count = 0;
+  }
+
+  // brings wifi up for an upload, returns false if it could not connect in time
+  bool WakeRadio() {
+    if (radio_off) {
+      WiFi.forceSleepWake();
+      IOTHUB_DELAY(1);
+      radio_off = false;
+    }
+    if (WiFi.status() != WL_CONNECTED && wifi_connect_start == 0) {
+      BeginWifi();
+    }
+    if (!WaitForWifi(wifi_connect_timeout)) {
+      IOTHUB_ERROR(F("Wifi did not connect, readings stay buffered"));
+      return false;
+    }
+    return true;
+  }
+
+  // loads the wifi cache from RTC memory on a deep sleep wake, otherwise from EEPROM after the id store
+  void LoadWifiCache() {
+    if (rtc_valid && Rtc().wifi.valid) {
+      wifi = Rtc().wifi;
+      return;
+    }
+    LoadIdStore();
+    wifi_store stored;
+    for (uint i = 0; i < sizeof(wifi_store); i++) {
+      ((uint8_t*)&stored)[i] = EEPROM.read(id_store_eeprom_size + i);
+    }
+    bool valid = stored.magic == wifi_store_magic &&
+    stored.crc == Crc32((uint8_t*)&stored + sizeof(stored.crc), sizeof(stored) - sizeof(stored.crc));
+    if (valid) {
+      wifi = stored.wifi;
+    } else {
+      memset(&wifi, 0, sizeof(wifi));
+    }
+  }
+
+  // keeps the access point and lease of the connection just made, EEPROM is only written when they have changed
+  void SaveWifiCache() {
+    wifi_cache connected = {};
+    memcpy(connected.bssid, WiFi.BSSID(), sizeof(connected.bssid));
+    connected.channel = WiFi.channel();
+    connected.valid = 1;
+    connected.ip = WiFi.localIP();
+    connected.gateway = WiFi.gatewayIP();
+    connected.subnet = WiFi.subnetMask();
+    connected.dns = WiFi.dnsIP();
+    if (deep_sleep_enabled) {
+      Rtc().wifi = connected; // saved along with the rest of the RTC state before sleeping
+    }
+    if (memcmp(&connected, &wifi, sizeof(wifi)) == 0) return;
+    wifi = connected;
+
+    LoadIdStore();
+    wifi_store stored;
+    stored.magic = wifi_store_magic;
+    stored.wifi = wifi;
+    stored.crc = Crc32((uint8_t*)&stored + sizeof(stored.crc), sizeof(stored) - sizeof(stored.crc));
+    for (uint i = 0; i < sizeof(wifi_store); i++) {
+      EEPROM.write(id_store_eeprom_size + i, ((uint8_t*)&stored)[i]);
+    }
+    EEPROM.commit();
+    IOTHUB_DEBUG(F("Saved wifi cache"));
+  }
+
+  // starts connecting to the configured network, straight to the cached access point with the cached lease if there is
+  // one. Wifi configuration is outside the scope of this lib, so the network is whatever was last used
+  void BeginWifi() {
+    LoadWifiCache();
+    WiFi.mode(WIFI_STA);
+    snprintf(wifi_ssid, sizeof(wifi_ssid), "%s", WiFi.SSID().c_str());
+    snprintf(wifi_psk, sizeof(wifi_psk), "%s", WiFi.psk().c_str());
+    wifi_connect_start = IOTHUB_MILLIS();
+    wifi_fast_connect = wifi.valid && wifi_ssid[0] != 0;
+    if (wifi_fast_connect) {
+      WiFi.config(IPAddress(wifi.ip), IPAddress(wifi.gateway), IPAddress(wifi.subnet), IPAddress(wifi.dns));
+      WiFi.begin(wifi_ssid, wifi_psk, wifi.channel, wifi.bssid);
+    } else {
+      BeginWifiScan();
+    }
+  }
+
+  // Connects to whichever access point of the network a scan finds. The SDK keeps the BSSID a connection was started
+  // with and a plain begin() would reuse it, so the network is given again without one. disconnect() isn't used to
+  // stop the cached attempt, as it erases the credentials from flash
+  void BeginWifiScan() {
+    if (wifi_ssid[0] != 0) {
+      WiFi.begin(wifi_ssid, wifi_psk);
+    } else {
+      WiFi.begin();
+    }
+  }
+
+  // polls until the connection started by BeginWifi() is up, falling back to a scan and DHCP if the cache fails.
+  // A timeout of zero waits forever
+  bool WaitForWifi(unsigned long timeout) {
+    unsigned long attempt_start = IOTHUB_MILLIS();
+    while (WiFi.status() != WL_CONNECTED) {
+      unsigned long elapsed = IOTHUB_MILLIS() - attempt_start;
+      if (wifi_fast_connect && elapsed > wifi_fast_connect_timeout) {
+        IOTHUB_WARN(F("Cached wifi connection failed, scanning"));
+        wifi_fast_connect = false;
+        wifi.valid = 0;
+        if (deep_sleep_enabled) {
+          Rtc().wifi.valid = 0;
+        }
+        WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0)); // back to DHCP
+        BeginWifiScan();
+        attempt_start = IOTHUB_MILLIS();
+      } else if (!wifi_fast_connect && timeout > 0 && elapsed > timeout) {
+        wifi_connect_start = 0;
+        return false;
+      }
+      IOTHUB_DELAY(wifi_poll_interval);
+    }
+    if (wifi_connect_start != 0) {
+      wifi_connect_ms = IOTHUB_MILLIS() - wifi_connect_start;
+      wifi_connect_start = 0;
+      IOTHUB_INFO(F("Wifi connected in "), wifi_connect_ms, F("ms"), wifi_fast_connect ? F(" from cache") : F(""));
+      SaveWifiCache();
+    }
+    return true;
+  }
+
+  // sends the RTC buffer through the reading queue a batch at a time, oldest first. Readings stay buffered until
+  // the hub has accepted them
+  void UploadRtcReadings() {
+    if (!WakeRadio()) return;
+
+    uint uploaded = 0;
+    while (uploaded < Rtc().reading_count) {
+      uint32_t now = Rtc().clock + IOTHUB_MILLIS();
+      uint batch_end = uploaded;
+      while (batch_end < Rtc().reading_count && reading_queue_count < reading_queue_length) {
+        reading_queue[reading_queue_count].sensor_index = Rtc().readings[batch_end].sensor_index;
+        reading_queue[reading_queue_count].value = Rtc().readings[batch_end].value;
+        reading_queue[reading_queue_count].count = 1;
+        // convert back to this wake's millis(), wrapping below zero is fine as only differences are used
+        reading_queue[reading_queue_count].sample_time = IOTHUB_MILLIS() - (now - Rtc().readings[batch_end].sample_time);
+        reading_queue[reading_queue_count].age_known = true;
+        reading_queue_count++;
+        batch_end++;
+      }
+      bool flushed = Flush();
+      uploaded = batch_end - reading_queue_count; // readings the hub didn't take are still queued
+      if (!flushed) break;
+    }
+    reading_queue_count = 0;
+
+    memmove(&Rtc().readings[0], &Rtc().readings[uploaded], (Rtc().reading_count - uploaded) * sizeof(rtc_reading));
+    Rtc().reading_count -= uploaded;
+    IOTHUB_INFO(F("Uploaded "), uploaded, F(" buffered readings"));
+  }
+
+  // one wake of a deep sleeping node: buffer this wake's readings, upload if due, then sleep. Does not return
+  void DeepSleepCycle() {
+    BufferQueuedReadings();
+
+    if (!Rtc().ids_cached) {
+      for (uint i = 0; i < last_sensor_added_index && i < rtc_cached_ids; i++) {
+        PackId(sensors[i].id, 24, Rtc().packed_ids[i]);
+      }
+      Rtc().ids_cached = registration_complete && last_sensor_added_index == number_sensor_ids;
+    }
+
+    if (UploadDue(Rtc().reading_count, Rtc().readings[0].sample_time, Rtc().clock + IOTHUB_MILLIS())) {
+      UploadRtcReadings();
+    }
+
+    // only wake with the radio enabled if that wake is going to upload, it then connects while sensors are sampled
+    Rtc().batches_refused = !hub_bulk_supported;
+    uint32_t next_wake_clock = Rtc().clock + IOTHUB_MILLIS() + sleep_interval;
+    uint32_t oldest_sample_time = Rtc().reading_count > 0 ? Rtc().readings[0].sample_time : next_wake_clock;
+    Rtc().upload_next_wake = UploadDue(Rtc().reading_count + ReadingsPerWake(), oldest_sample_time, next_wake_clock);
+    Rtc().clock = next_wake_clock;
+    SaveRtcState();
+
+    IOTHUB_INFO(F("Deep sleeping for "), sleep_interval, F("ms"));
+    ESP.deepSleep((uint64_t)sleep_interval * 1000, Rtc().upload_next_wake ? WAKE_RF_DEFAULT : WAKE_RF_DISABLED);
+  }
+
+  // checks the queued readings against the flush thresholds
+  bool FlushDue() {
+    if (reading_queue_count == 0) return false;
+    if (deep_sleep_enabled) return false; // deep sleeping nodes upload from the RTC buffer instead
+    if (flush_remaining > 0 || reading_queue_count >= flush_count) return true;
+    if (flush_bytes > 0 && QueuedJsonLength() >= flush_bytes) return true;
+    if (flush_age > 0 && IOTHUB_MILLIS() - reading_queue[0].sample_time >= flush_age) return true;
+    return false;
+  }
+
+  // A lone reading goes to its sensor's data url, which carries no age. Replayed readings go as a batch, as they can be
+  // much older than the upload and may have no known age at all. A hub without the batch url is sent every reading on
+  // its own, ages and all are then lost
+  bool SingleReadingUpload() {
+    return !hub_bulk_supported || (reading_queue_count == 1 && replay_in_flight == 0);
+  }
+
+  // formats the queued readings into the payload buffer and returns the url to post them to, or NULL if they didn't fit.
+  // A single reading goes to its sensor's data url, more are sent as one batch with each reading's sensor id and how
+  // long ago it was sampled. Nothing here touches the heap, sensor urls are built at registration
+  const char* PrepareUpload() {
+    WaitForHubRequest(); // an upload in flight is still sending from the payload buffer
+    uploading_batch = !SingleReadingUpload();
+    uploading_count = uploading_batch ? reading_queue_count : 1;
+    if (upload_encoding == encoding_cbor) {
+      return PrepareCborUpload();
+    }
+    BufferPrint payload(payload_buffer, payload_buffer_length);
+    const char* url;
+    if (SingleReadingUpload()) {
+      payload.print("{\"value\":"); PrintJsonFloat(payload, reading_queue[0].value);
+      PrintJsonAggregate(payload, reading_queue[0]);
+      payload.print('}');
+      url = sensors[reading_queue[0].sensor_index].data_url;
+    } else {
+      IOTHUB_DEBUG(F("Sending batch of "), reading_queue_count, F(" readings"));
+      unsigned long now = IOTHUB_MILLIS();
+      payload.print('[');
+      for (uint i = 0; i < reading_queue_count; i++) {
+        if (i > 0) payload.print(',');
+        payload.print("{\"id\":"); PrintJsonString(payload, sensors[reading_queue[i].sensor_index].id);
+        payload.print(",\"value\":"); PrintJsonFloat(payload, reading_queue[i].value);
+        payload.print(",\"age\":");
+        if (reading_queue[i].age_known) {
+          payload.print((uint32_t)(now - reading_queue[i].sample_time));
+        } else {
+          payload.print("null");
+        }
+        PrintJsonAggregate(payload, reading_queue[i]);
+        payload.print('}');
+      }
+      payload.print(']');
+      url = "/api/sensors/data";
+    }
+    if (payload.overflowed) {
+      IOTHUB_ERROR(F("Payload was too large for the payload buffer"));
+      return NULL;
     }
-    Serial.println();
+    payload_length = payload.length;
+    return url;
   }
 
-  actor* FindActor(char* actor_id) {
-    Serial.println("Searching for matching actor");
-    for (uint i = 0; i < number_actor_ids; i++) {
-      // check if identical, TODO: restructure as a while loop
-      bool non_match_found = false;
-      uint id_digit;
-      for (id_digit = 0; id_digit < 24; id_digit++) { // 24 is number of digits in id excluding null terminator
-        Serial.print(actors[i].id[id_digit]); Serial.print(" : "); Serial.println(actor_id[id_digit]);
-        if (actors[i].id[id_digit] != actor_id[id_digit]){
-          non_match_found = true;
-          break;
-        };
-      }
-      Serial.print("Id_digit: "); Serial.println(id_digit);
-      if (id_digit == 24 && !non_match_found) {
-        return &actors[i];
+  // the same as PrepareUpload() with the readings encoded as CBOR, which has the same structure as the JSON
+  const char* PrepareCborUpload() {
+    BufferPrint payload(payload_buffer, payload_buffer_length);
+    CborWriter cbor(payload);
+    const char* url;
+    if (SingleReadingUpload()) {
+      cbor.WriteMap(reading_queue[0].count > 1 ? 4 : 1);
+      cbor.WriteString("value"); cbor.WriteFloat(reading_queue[0].value);
+      WriteCborAggregate(cbor, reading_queue[0]);
+      url = sensors[reading_queue[0].sensor_index].data_url;
+    } else {
+      unsigned long now = IOTHUB_MILLIS();
+      cbor.WriteArray(reading_queue_count);
+      for (uint i = 0; i < reading_queue_count; i++) {
+        cbor.WriteMap(reading_queue[i].count > 1 ? 6 : 3);
+        cbor.WriteString("id"); cbor.WriteString(sensors[reading_queue[i].sensor_index].id);
+        cbor.WriteString("value"); cbor.WriteFloat(reading_queue[i].value);
+        cbor.WriteString("age");
+        if (reading_queue[i].age_known) {
+          cbor.WriteInt(now - reading_queue[i].sample_time);
+        } else {
+          cbor.WriteNull();
+        }
+        WriteCborAggregate(cbor, reading_queue[i]);
       }
+      url = "/api/sensors/data";
     }
-    return NULL;
+    if (payload.overflowed) {
+      IOTHUB_ERROR(F("Payload was too large for the payload buffer"));
+      return NULL;
+    }
+    payload_length = payload.length;
+    return url;
   }
 
-  void GetActorHandler(Request &req, Response &res, char* actor_id, uint actor_id_length) {
-    Serial.println("Single Actor listing requested");
+  // windowed readings carry the min, max and count of their samples alongside the mean
+  void PrintJsonAggregate(Print& out, const reading& queued) {
+    if (queued.count <= 1) return;
+    out.print(",\"min\":"); PrintJsonFloat(out, queued.min);
+    out.print(",\"max\":"); PrintJsonFloat(out, queued.max);
+    out.print(",\"count\":"); out.print(queued.count);
+  }
+  void WriteCborAggregate(CborWriter& cbor, const reading& queued) {
+    if (queued.count <= 1) return;
+    cbor.WriteString("min"); cbor.WriteFloat(queued.min);
+    cbor.WriteString("max"); cbor.WriteFloat(queued.max);
+    cbor.WriteString("count"); cbor.WriteInt(queued.count);
+  }
 
-    if (actor_id_length != 24) {
-      Serial.println("The passed in actor_id was not the standard 24 characters long");
-      return;
+  // the most bytes the queued readings can take as a JSON batch, less the brackets
+  uint ReadingJsonLength(const reading& queued) {
+    return queued.count > 1 ? reading_json_length + aggregate_json_length : reading_json_length;
+  }
+  uint QueuedJsonLength() {
+    uint length = 0;
+    for (uint i = 0; i < reading_queue_count; i++) {
+      length += ReadingJsonLength(reading_queue[i]);
     }
-    actor* actor = FindActor(actor_id);
-    if (actor == NULL) {
-      Serial.println("Was unable to find matching actor");
-      return;
-    } // make sure the id exists before sending anything
-
-    StaticJsonBuffer<200> jsonBuffer;
-    JsonObject& json_obj = jsonBuffer.createObject();
+    return length;
+  }
 
-    json_obj["id"] = actor->id;
-    json_obj["name"] = actor->name;
+  // adds a sample to the sensor's window, which is queued as one reading once window ms have passed since it opened
+  void AddToWindow(uint sensor_index, float value) {
+    sensor* window_sensor = &sensors[sensor_index];
+    if (window_sensor->window_count == 0) {
+      window_sensor->window_start = IOTHUB_MILLIS();
+      window_sensor->window_min = value;
+      window_sensor->window_max = value;
+      window_sensor->window_sum = 0;
+    }
+    if (value < window_sensor->window_min) window_sensor->window_min = value;
+    if (value > window_sensor->window_max) window_sensor->window_max = value;
+    window_sensor->window_sum += value;
+    window_sensor->window_count++;
+    if (window_sensor->window_count == UINT16_MAX ||
+    Reached(IOTHUB_MILLIS(), window_sensor->window_start + window_sensor->window)) {
+      CloseWindow(sensor_index);
+    }
+  }
 
-    // determine type of actor so we can figure out which tagged union var to send
-    switch (actor->state_type) {
-      case actor::is_int:
-      json_obj["state"] = actor->state.istate;
-      break;
+  void CloseWindow(uint sensor_index) {
+    sensor* window_sensor = &sensors[sensor_index];
+    float mean = window_sensor->window_sum / window_sensor->window_count;
+    QueueReading(sensor_index, mean, window_sensor->window_count, window_sensor->window_min, window_sensor->window_max);
+    window_sensor->window_count = 0;
+  }
 
-      case actor::is_float:
-      json_obj["state"] = actor->state.fstate;
-      break;
+  // queues windows that have run their length without a new sample to close them
+  void CloseDueWindows() {
+    unsigned long now = IOTHUB_MILLIS();
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (sensors[i].window_count > 0 && Reached(now, sensors[i].window_start + sensors[i].window)) {
+        CloseWindow(i);
+      }
+    }
+  }
 
-      case actor::is_bool:
-      json_obj["state"] = actor->state.bstate;
-      break;
+  // queues a reading unless the sensor's deadband holds it back, then starts an upload if one is due
+  void QueueReading(uint sensor_index, float value, uint16_t count, float min, float max) {
+    sensor* queued_sensor = &sensors[sensor_index];
+    unsigned long now = IOTHUB_MILLIS();
+    if (queued_sensor->has_queued && (queued_sensor->deadband > 0 || queued_sensor->heartbeat > 0)) {
+      bool changed = fabs(value - queued_sensor->last_queued_value) > queued_sensor->deadband;
+      bool heartbeat_due = queued_sensor->heartbeat > 0 && now - queued_sensor->last_queued_time >= queued_sensor->heartbeat;
+      if (!changed && !heartbeat_due) {
+        IOTHUB_DEBUG(F("Sensor "), sensor_index, F(" reading within deadband, not sent"));
+        return;
+      }
+    }
+    queued_sensor->has_queued = true;
+    queued_sensor->last_queued_value = value;
+    queued_sensor->last_queued_time = now;
+
+    reading queued;
+    queued.sensor_index = sensor_index;
+    queued.value = value;
+    queued.sample_time = now;
+    queued.age_known = true;
+    queued.count = count;
+    queued.min = min;
+    queued.max = max;
+
+    // make room if the queue is already full, or the reading wouldn't fit in the payload buffer with the rest
+    if (reading_queue_count == reading_queue_length ||
+    (hub_bulk_supported && QueuedJsonLength() + ReadingJsonLength(queued) > payload_buffer_length - 2)) {
+      Flush();
+    }
+    // readings sent one at a time can be left queued by a failure part way through the flush
+    if (reading_queue_count == reading_queue_length) {
+      IOTHUB_WARN(F("Reading queue full, dropping oldest reading"));
+      readings_dropped++;
+      RemoveQueuedReadings(1);
     }
 
-    res.success("application/json");
-    json_obj.printTo(res); // send straight to http output
-  }
+    reading_queue[reading_queue_count] = queued;
+    reading_queue_count++;
 
-  // takes in two parameters, a pointer to the full url string, the location of the colon
-  void RouteParameter(char* full_string, uint colon_location, char** route_parameter_pointer, uint * route_parameter_len) {
-    if (full_string == NULL) return;
-    const byte string_len = strlen(full_string);
-    // find the end of the dynamic route parameter
-    uint param_end = colon_location;
-    while (param_end < string_len && full_string[param_end] != '/') {
-      param_end++;
+    if (FlushDue()) {
+      StartFlush();
     }
-    *route_parameter_pointer = full_string + colon_location; // the new pointer location is full string pointer location offset by colon location
-    *route_parameter_len =  param_end - colon_location;
   }
 
+  const char* UploadContentType() {
+    return upload_encoding == encoding_cbor ? "application/cbor" : "application/json";
+  }
 
-  bool MatchRoute(char* full_string, char* route, uint* colon_location) {
-    byte string_len = strlen(full_string);
-    byte route_len = strlen(route);
-    uint i = 0;
+  // takes readings off the front of the queue once their upload has finished
+  void RemoveQueuedReadings(uint count) {
+    memmove(&reading_queue[0], &reading_queue[count], (reading_queue_count - count) * sizeof(reading));
+    reading_queue_count -= count;
+    flush_remaining = flush_remaining > count ? flush_remaining - count : 0;
+  }
 
-    while (i < string_len && i < route_len){
-      if (full_string[i] == route[i]) {
-        i++;
-      } else if (route[i] == ':') {
-        *colon_location = i;
-        Serial.println("Matched colon");
-        return true;
-      } else {
-        return false;
+  // Handles the hub's answer to an upload, returns true if the readings were accepted. They leave the queue either way,
+  // but for a deep sleeping node's failed readings, which stay queued so it knows which to keep in RTC memory
+  bool UploadResult(int http_code) {
+    IOTHUB_DEBUG(F("HTTP Code: "), http_code);
+    upload_time_ms.Record(IOTHUB_MILLIS() - hub_request_start, upload_time_bounds);
+    // a hub from before batched uploads 404s their url, it doesn't mean a sensor has been forgotten. Live readings stay
+    // queued to go to their sensors' own urls and replayed ones stay logged
+    if (http_code == 404 && uploading_batch) {
+      IOTHUB_WARN(F("Hub has no batch upload, sending readings one at a time"));
+      hub_bulk_supported = false;
+      if (replay_in_flight > 0) {
+        RemoveQueuedReadings(uploading_count);
       }
+      replay_in_flight = 0;
+      uploading_count = 0;
+      return false;
     }
-    if (i == route_len) {
-      Serial.println("Matched whole route string");
-      return true;
+    bool uploaded = http_code >= 200 && http_code < 300;
+    // deep sleeping nodes keep failed readings in RTC memory, and the offline log keeps those worth retrying
+    bool kept = deep_sleep_enabled || (offline_log_enabled && RetryableUpload(http_code));
+    if (!uploaded && !kept && replay_in_flight == 0) {
+      readings_dropped += uploading_count;
     }
-    Serial.println("Returning false");
-    return false;
+    if (offline_log_enabled) {
+      OfflineLogResult(http_code);
+    }
+    if (uploaded || !deep_sleep_enabled) {
+      RemoveQueuedReadings(uploading_count);
+    }
+    uploading_count = 0;
+    // a hub that doesn't understand CBOR says so, later uploads fall back to JSON. The readings are lost unless the
+    // offline log keeps them to replay
+    if (http_code == 415 && upload_encoding == encoding_cbor) {
+      IOTHUB_WARN(F("Hub does not accept CBOR, falling back to JSON"));
+      upload_encoding = encoding_json;
+    }
+    if (upload_callback != NULL) {
+      upload_callback(http_code);
+    }
+    if (http_code == 404) { // from a sensor's own url
+      IOTHUB_ERROR(F("Sensor 404'd restarting"));
+      // forget the stored ids and restart so sensors are registered again
+      ClearIdsRestart();
+    }
+    return uploaded;
   }
 
-  // if they are the same this returns true
-  bool CStringCompare(char* string_1, char* string_2) {
-    if (strcmp(string_1, string_2) == 0) {
-      return true;
+  // an upload that could not be formatted loses its live readings, replayed ones stay in the log. A deep sleeping node
+  // still has them in RTC memory
+  void AbandonUpload() {
+    if (!deep_sleep_enabled) {
+      if (replay_in_flight == 0) readings_dropped += uploading_count;
+      RemoveQueuedReadings(uploading_count);
     }
-    return false;
+    replay_in_flight = 0;
+    uploading_count = 0;
   }
 
-  // based on process method provided by aWOT
-  void ProcessRequests(Client *client, char *buff, int buff_len) {
-    if (client != NULL) {
-      Request request;
-      Response response;
-
-      response.init(client);
-      request.init(client, buff, buff_len);
-      request.processRequest();
-      if (request.method() == Request::INVALID) {
-        response.fail();
-      } else {
-        Request::HeaderNode* header_tail;
-        request.processHeaders(header_tail);
-
-        // while there are more requests, keep processing them
-        if (request.next()){
-          bool route_found = false; // this should be set to true by any route conditional
-
-          DebugRequest(request);
-          Request::MethodType method =  request.method();
-          char* url_path =  request.urlPath();
-
-          if (method == Request::MethodType::GET) {
-            // GET routes
-            // static routes
-            if (CStringCompare(url_path, "actors")) {
-              route_found = true;
-              GetActorsHandler(request,response);
-            }
-            // dynamic routes
-            uint colon_location = 0;
-            if (MatchRoute(url_path,"actors/:something",&colon_location)) {
-              route_found = true;
-              Serial.println("Matched actors/:something");
-
-              char* route_parameter;
-              uint route_parameter_len;
-              RouteParameter(url_path,colon_location, &route_parameter, &route_parameter_len);
-              Serial.print("Route Param: ");
-              PrintStringFragment(route_parameter, route_parameter_len);
-              GetActorHandler(request,response,route_parameter,route_parameter_len);
-            }
-          }
-          else if (method == Request::MethodType::POST) {
-            // POST routes
-            // dynamic routes
-            uint colon_location = 0;
-            if (MatchRoute(url_path,"actors/:something",&colon_location)) {
-              route_found = true;
-              Serial.println("Matched actors/:something ");
-
-              char* route_parameter;
-              uint route_parameter_len;
-              RouteParameter(url_path,colon_location, &route_parameter, &route_parameter_len);
-              Serial.print("Route Param: ");
-              PrintStringFragment(route_parameter, route_parameter_len);
-              PostActorStateHandler(request,response,route_parameter,route_parameter_len);
-            }
-          }
+  // failures that are worth keeping readings for, the hub being unreachable or down, or about to re-register the node
+  bool RetryableUpload(int http_code) {
+    return http_code == -1 || http_code >= 500 || http_code == 404 || http_code == 415;
+  }
 
-          // if no route is found, send a 404
-          if (!route_found) {
-            Serial.println("internal rest server 404ed");
-            response.notFound();
-          }
-        }
-        request.reset();
-        response.reset();
+#ifdef IOTHUB_OFFLINE_LOG
+  void OfflineLogResult(int http_code) {
+    bool uploaded = http_code >= 200 && http_code < 300;
+    hub_answered = http_code != -1 && http_code < 500;
+    if (replay_in_flight > 0) {
+      // replayed readings the hub rejects outright are dropped too, or they would be replayed forever
+      if (uploaded || !RetryableUpload(http_code)) {
+        DropLoggedReadings(replay_in_flight);
       }
+      replay_in_flight = 0;
+    } else if (!uploaded && RetryableUpload(http_code)) {
+      LogReadings(reading_queue, uploading_count);
     }
   }
 
-  void CheckConnections() {
-    WiFiClient client = server.available();
-    if (client.available()){
-      char request[SERVER_DEFAULT_REQUEST_LENGTH];
-      ProcessRequests(&client, request, SERVER_DEFAULT_REQUEST_LENGTH);
-    }
+  File OpenOfflineLog() {
+    return LittleFS.open(offline_log_path, LittleFS.exists(offline_log_path) ? "r+" : "w+");
   }
 
-  bool CheckFirstBoot() {
-    //Serial.print("BootByte: "); Serial.println(EEPROM.read(0));
-    // check first byte is set to 128, this indicates this is not the first boot
-    if ( 128 == EEPROM.read(0) ) {
-      // Previous boot detected
-      first_boot_bit = false;
-      return false;
-    } else {
-      // No Previous boot detected
-      first_boot_bit = true;
-      return true;
-    }
+  bool WriteOfflineLogHeader(File& log_file) {
+    offline_log.magic = offline_log_magic;
+    offline_log.crc = Crc32((uint8_t*)&offline_log + sizeof(offline_log.crc), sizeof(offline_log) - sizeof(offline_log.crc));
+    log_file.seek(0, SeekSet);
+    return log_file.write((uint8_t*)&offline_log, sizeof(offline_log)) == sizeof(offline_log);
   }
 
-  void UnsetFirstBoot() {
-    if (first_boot_bit == true) {
-      // check first byte is set to 128, this indicates this is not the first boot
-      EEPROM.write(0,128);
-      EEPROM.commit();
-      first_boot_bit = false;
-    } else {
-      Serial.println("No change in unset boot bit");
+  // reads or writes count records starting at slot, in two parts if they wrap around the end of the ring
+  bool OfflineLogRecords(File& log_file, uint slot, logged_reading* records, uint count, bool write) {
+    while (count > 0) {
+      uint part = count < offline_log_length - slot ? count : offline_log_length - slot;
+      size_t bytes = part * sizeof(logged_reading);
+      log_file.seek(sizeof(offline_log_header) + slot * sizeof(logged_reading), SeekSet);
+      size_t done = write ? log_file.write((uint8_t*)records, bytes) : log_file.read((uint8_t*)records, bytes);
+      if (done != bytes) return false;
+      records += part;
+      count -= part;
+      slot = 0;
     }
+    return true;
   }
 
-  void SetFirstBoot() {
-    if (first_boot_bit == false) {
-      EEPROM.write(0,0);
-      EEPROM.commit();
-      first_boot_bit = true;
+  // appends readings to the offline log in one write, dropping the oldest if it is full
+  void LogReadings(const reading* failed, uint count) {
+    if (count == 0) return;
+    logged_reading records[reading_queue_length];
+    for (uint i = 0; i < count; i++) {
+      records[i].sensor_index = failed[i].sensor_index;
+      records[i].value = failed[i].value;
+      records[i].sample_time = failed[i].sample_time;
+      records[i].boot = offline_log.boot;
+    }
+    File log_file = OpenOfflineLog();
+    if (!log_file) {
+      IOTHUB_ERROR(F("Could not open the offline log"));
+      return;
+    }
+    uint dropped = offline_log.count + count > offline_log_length ? offline_log.count + count - offline_log_length : 0;
+    if (dropped > 0) {
+      IOTHUB_WARN(F("Offline log full, dropping "), dropped, F(" oldest readings"));
+      offline_log.head = (offline_log.head + dropped) % offline_log_length;
+      offline_log.count -= dropped;
+      readings_dropped += dropped;
+    }
+    uint tail = (offline_log.head + offline_log.count) % offline_log_length;
+    if (OfflineLogRecords(log_file, tail, records, count, true)) {
+      offline_log.count += count;
+      WriteOfflineLogHeader(log_file);
+      IOTHUB_INFO(F("Logged "), count, F(" readings for later, "), offline_log.count, F(" waiting"));
     } else {
-      Serial.println("No change in set boot bit");
+      IOTHUB_ERROR(F("Failed writing the offline log"));
     }
+    log_file.close();
   }
 
-  void SetFirstBootRestart() {
-    SetFirstBoot();
-    ESP.restart();
+  void DropLoggedReadings(uint count) {
+    if (count > offline_log.count) count = offline_log.count;
+    offline_log.head = (offline_log.head + count) % offline_log_length;
+    offline_log.count -= count;
+    File log_file = OpenOfflineLog();
+    if (!log_file) return;
+    WriteOfflineLogHeader(log_file);
+    log_file.close();
   }
 
-  void ShowEeprom() {
-    // first byte reserved
-    Serial.println();
-    Serial.print("Read bytes: ");
+  // Starts uploading the oldest logged readings. Only runs once the hub has answered an upload, and only when no live
+  // readings are queued, so replaying a long outage never holds up new readings
+  void ReplayOfflineLog() {
+    if (!offline_log_enabled || !hub_answered || offline_log.count == 0) return;
+    if (!registration_complete || reading_queue_count > 0 || hub_state != hub_idle) return;
+
+    logged_reading records[offline_replay_batch];
+    // a hub without the batch url is sent them one at a time, so one failing part way never sends the others twice
+    uint batch = hub_bulk_supported ? offline_replay_batch : 1;
+    uint count = offline_log.count < batch ? offline_log.count : batch;
+    File log_file = OpenOfflineLog();
+    if (!log_file) return;
+    bool read = OfflineLogRecords(log_file, offline_log.head, records, count, false);
+    log_file.close();
+    if (!read) {
+      IOTHUB_ERROR(F("Failed reading the offline log"));
+      return;
+    }
 
-    for(int addr = 0; addr < 48 + ids_eeprom_offset;) {
-      Serial.print("[");
-      Serial.print( (char)EEPROM.read(addr));
-      Serial.print("] ");
-      addr++;
+    for (uint i = 0; i < count; i++) {
+      // readings of sensors this node no longer has an id for are dropped with the rest of the batch
+      if (records[i].sensor_index >= last_sensor_added_index || sensors[records[i].sensor_index].id[0] == 0) continue;
+      reading* replayed = &reading_queue[reading_queue_count];
+      replayed->sensor_index = records[i].sensor_index;
+      replayed->value = records[i].value;
+      replayed->count = 1;
+      // millis() restarted since an earlier boot logged a reading, so how long ago it was sampled isn't known
+      replayed->age_known = records[i].boot == offline_log.boot;
+      replayed->sample_time = replayed->age_known ? records[i].sample_time : IOTHUB_MILLIS();
+      reading_queue_count++;
+    }
+    if (reading_queue_count == 0) {
+      DropLoggedReadings(count);
+      return;
     }
-    Serial.println("//end");
+    IOTHUB_INFO(F("Replaying "), reading_queue_count, F(" logged readings"));
+    replay_in_flight = count;
+    StartFlush();
+  }
+#else
+  // without IOTHUB_OFFLINE_LOG the log is never enabled
+  void OfflineLogResult(int http_code) {}
+  void ReplayOfflineLog() {}
+#endif
+
+  void PushWriteLength(uint32_t length) {
+    do {
+      uint8_t digit = length % 128;
+      length /= 128;
+      if (length > 0) digit |= 0x80;
+      push_client.write(digit);
+    } while (length > 0);
+  }
+  void PushWriteString(const char* value, uint length) {
+    push_client.write((uint8_t)(length >> 8));
+    push_client.write((uint8_t)length);
+    push_client.write((const uint8_t*)value, length);
   }
 
-  // writes the passed in id to a location in memory, it assumes either last_actor_added_index or last_sensor_added_index will be incremented afterwards
-  void ReadId(char * p_write) {
-    uint offset = (last_actor_added_index * 24) + (last_sensor_added_index * 24) + ids_eeprom_offset;
-
-    // read an entire 24 byte id
-    for(uint j = 0; j < 24;j++) {
-        p_write[j] = (char)EEPROM.read(j+offset);
+  // MQTT 3.1.1 CONNECT with a clean session, so the subscriptions are sent again on every connect
+  void PushConnect() {
+    push_last_attempt = IOTHUB_MILLIS();
+    push_failed_attempts++; // until the broker's CONNACK accepts it
+    push_client.stop();
+    if (!push_client.connect(push_broker, push_port)) {
+      IOTHUB_WARN(F("Unable to connect to push broker"));
+      return;
     }
-    p_write[24] = 0; // add null character when reading into struct
-    Serial.print("Read from eeprom into sensor_ids: "); Serial.println(p_write);
+    char client_id[24];
+    snprintf(client_id, sizeof(client_id), "iothub-%08x", ESP.getChipId());
+    uint client_id_length = strlen(client_id);
+    push_client.write((uint8_t)0x10);
+    PushWriteLength(10 + 2 + client_id_length);
+    PushWriteString("MQTT", 4);
+    push_client.write((uint8_t)4); // protocol level 3.1.1
+    push_client.write((uint8_t)0x02); // clean session
+    push_client.write((uint8_t)0);
+    push_client.write((uint8_t)push_keep_alive);
+    PushWriteString(client_id, client_id_length);
+    push_last_sent = IOTHUB_MILLIS();
+    push_last_received = push_last_sent;
+    push_have_header = false;
+    push_have_type = false;
+    push_state = push_awaiting_connack;
   }
 
-  void WriteId(char * p_read) {
-    ShowEeprom();
-    uint offset = (last_actor_added_index * 24) + (last_sensor_added_index * 24) + ids_eeprom_offset;
-
-    // write an entire 24 byte id
-    for(uint j = 0; j < 24;j++) {
-        EEPROM.write(j+offset, p_read[j] );
+  // subscribes to the state topic of every registered actor in one packet
+  void PushSubscribe() {
+    uint topic_length = strlen(push_topic_prefix) + 24 + strlen(push_topic_suffix);
+    uint subscribed = 0;
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] != 0) subscribed++;
     }
-    EEPROM.commit();
-    ShowEeprom();
+    if (subscribed == 0) return;
+    push_client.write((uint8_t)0x82);
+    PushWriteLength(2 + subscribed * (2 + topic_length + 1));
+    push_client.write((uint8_t)0);
+    push_client.write((uint8_t)1); // packet id
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] == 0) continue;
+      char topic[64];
+      snprintf(topic, sizeof(topic), "%s%s%s", push_topic_prefix, actors[i].id, push_topic_suffix);
+      PushWriteString(topic, topic_length);
+      push_client.write((uint8_t)0); // QoS 0, a state that is lost is superseded by the next one
+    }
+    push_last_sent = IOTHUB_MILLIS();
+    IOTHUB_INFO(F("Subscribed to "), subscribed, F(" actor topics"));
   }
 
-  // this should read sensor ID's from internal memory if available, else ask for new ids from the given server
-  void LoadIds() {
-    // first byte reserved
-    int addr = ids_eeprom_offset;
+  void PushDisconnected() {
+    IOTHUB_WARN(F("Push connection lost"));
+    push_client.stop();
+    push_state = push_disconnected;
+  }
 
-    // read sensor ids
-    for(int i = 0; i< number_sensor_ids;i++) {
-      ReadId(sensors[i].id);
-      last_sensor_added_index++;
+  // reads an MQTT string, topics longer than the buffer are consumed and returned empty
+  uint PushReadString(char* buffer, uint buffer_size) {
+    uint length = push_client.read() << 8;
+    length |= push_client.read();
+    uint kept = 0;
+    for (uint i = 0; i < length; i++) {
+      int next = push_client.read();
+      if (length < buffer_size) buffer[kept++] = (char)next;
     }
-
-    EEPROM.commit();
-    Serial.print("Read bytes: "); Serial.println(addr-ids_eeprom_offset);
-  };
-
-  void GetIdFromJson(String json_string, char (*sensor_id)[25]) {
-    StaticJsonBuffer<100> jsonBuffer;
-    JsonObject& json_object = jsonBuffer.parseObject(json_string);
-    const char* id = json_object["id"];
-    //strcpy (to,from)
-    strcpy (*sensor_id,id);
+    buffer[kept] = 0;
+    return length;
   }
 
-  bool CheckActorRegistered(char * actor_id) {
-    HTTPClient http;
-
-    String url = "/api/actors/";
-    url.concat(actor_id);
-
-    http.begin(iothub_server,iothub_port,url);
-    int http_code = http.GET();
-    http.end();
+  // a PUBLISH to an actor's state topic, the payload is parsed straight from the connection as JSON or CBOR
+  void PushHandlePublish(uint8_t flags, uint32_t length) {
+    char topic[64];
+    uint topic_length = PushReadString(topic, sizeof(topic));
+    uint32_t header_length = 2 + topic_length;
+    uint qos = (flags >> 1) & 0x03;
+    uint16_t packet_id = 0;
+    if (qos > 0) {
+      packet_id = push_client.read() << 8;
+      packet_id |= push_client.read();
+      header_length += 2;
+    }
+    LimitedStream payload(push_client, length > header_length ? length - header_length : 0);
 
-    // actor was found
-    if (http_code == 200) {
-      return true;
+    uint prefix_length = strlen(push_topic_prefix);
+    actor* target = NULL;
+    if (topic_length == prefix_length + 24 + strlen(push_topic_suffix) && strncmp(topic, push_topic_prefix, prefix_length) == 0 &&
+    strcmp(topic + prefix_length + 24, push_topic_suffix) == 0) {
+      target = FindActor(topic + prefix_length, 24);
+    }
+    if (target == NULL) {
+      IOTHUB_WARN(F("Push update for an unknown topic: "), topic);
+    } else {
+      double new_state;
+      int first = payload.peek();
+      // a JSON object starts with a brace, a CBOR map with major type 5
+      bool parsed = (first >= 0xA0 && first <= 0xBF) ? ReadCborState(payload, &new_state) : ReadJsonState(payload, &new_state);
+      if (!parsed) {
+        IOTHUB_WARN(F("Failed to parse pushed actor state"));
+      } else if (!target->type->accepts(new_state)) {
+        IOTHUB_WARN(F("Pushed actor state out of range for its type"));
+      } else {
+        ApplyActorState(target, new_state);
+      }
+    }
+    while (payload.read() != -1) {} // whatever the parser didn't need
+
+    if (qos == 1) { // PUBACK
+      push_client.write((uint8_t)0x40);
+      push_client.write((uint8_t)2);
+      push_client.write((uint8_t)(packet_id >> 8));
+      push_client.write((uint8_t)packet_id);
+      push_last_sent = IOTHUB_MILLIS();
     }
-    // if it wasn't then it does not exist
-    return false;
   }
 
-  void BaseRegisterActor(actor *actor_ptr,char * state_type) {
-    Serial.println("Registering actor");
-    HTTPClient http;
-
-    // Make a HTTP post
-    http.begin(iothub_server,iothub_port,"/api/actors");
-
-    // prep the json object
-    StaticJsonBuffer<max_node_name_length+10> jsonBuffer;
-    JsonObject& json_obj = jsonBuffer.createObject();
-    json_obj["name"] = actor_ptr->name;
-    json_obj["state_type"] = state_type;
-
-    http.addHeader("Content-Type","application/json"); // important! JSON conversion in nodejs requires this
-
-    // add the json to a string
-    String json_string;
-    json_obj.printTo(json_string);// this is great except it seems to be adding quotation marks around what it is sending
-    // then send the json
-    int http_code = http.POST(json_string);
-
-    // then print the response over Serial
-    Serial.print("Response ID: ");
-    GetIdFromJson(http.getString(),&actor_ptr->id);
-
-    Serial.print(*actor_ptr->id); Serial.println("///end");
-    //Serial.println( sensor_id );
-
-    http.end();
-
-    if (http_code == 200) {
-      WriteId(actor_ptr->id);
+  // how long to wait after the last attempt to connect to the broker, push_reconnect_interval after a connection that
+  // was accepted and doubling with every attempt that failed since, up to push_reconnect_max_interval
+  unsigned long PushRetryDelay() {
+    unsigned long delay = push_reconnect_interval;
+    for (uint i = 1; i < push_failed_attempts && delay < push_reconnect_max_interval; i++) {
+      delay *= 2;
     }
+    return delay < push_reconnect_max_interval ? delay : push_reconnect_max_interval;
   }
 
-  void BaseRegisterSensor(sensor *sensor_ptr, const char* data_type){
-    Serial.println("Registering sensor");
-    HTTPClient http;
-
-    // Make a HTTP post
-    http.begin(iothub_server,iothub_port,"/api/sensors");
-
-    // prep the json object
-    StaticJsonBuffer<max_node_name_length+10> jsonBuffer;
-    JsonObject& json_obj = jsonBuffer.createObject();
-    json_obj["name"] = sensor_ptr->name;
-    json_obj["data_type"] = data_type;
-
-    http.addHeader("Content-Type","application/json"); // important! JSON conversion in nodejs requires this
+  // Advances the push connection a step from Tick(): reconnects when it has dropped, handles every packet that has
+  // fully arrived and keeps the connection alive. Never waits on the network other than for a TCP connect
+  void StepPushConnection() {
+    if (push_state == push_off || !registration_complete) return;
+    unsigned long now = IOTHUB_MILLIS();
+    if (push_state == push_disconnected) {
+      if (push_last_attempt == 0 || now - push_last_attempt >= PushRetryDelay()) {
+        PushConnect();
+      }
+      return;
+    }
+    if (!push_client.connected() || now - push_last_received > push_keep_alive * 1500UL) {
+      PushDisconnected();
+      return;
+    }
 
-    // add the json to a string
-    String json_string;
-    json_obj.printTo(json_string);// this is great except it seems to be adding quotation marks around what it is sending
-    // then send the json
-    int http_code = http.POST(json_string);
+    while (true) {
+      if (!push_have_header) {
+        if (!push_have_type) {
+          if (push_client.available() < 1) break;
+          push_packet_type = push_client.read();
+          push_remaining = 0;
+          push_length_shift = 0;
+          push_have_type = true;
+        }
+        // the remaining length is a varint of up to four bytes, which may arrive a segment after the type byte
+        bool have_length = false;
+        while (!have_length && push_client.available() > 0) {
+          int digit = push_client.read();
+          push_remaining |= (uint32_t)(digit & 0x7F) << push_length_shift;
+          push_length_shift += 7;
+          have_length = (digit & 0x80) == 0;
+          if (!have_length && push_length_shift > 21) {
+            PushDisconnected();
+            return;
+          }
+        }
+        if (!have_length) break;
+        push_have_type = false;
+        push_have_header = true;
+      }
+      // oversized packets are discarded as they arrive rather than waited for
+      if (push_remaining > push_max_packet_length) {
+        while (push_remaining > 0 && push_client.available() > 0) {
+          push_client.read();
+          push_remaining--;
+        }
+        if (push_remaining > 0) break;
+        push_have_header = false;
+        continue;
+      }
+      if ((uint32_t)push_client.available() < push_remaining) break;
 
-    // then print the response over Serial
-    Serial.print("Response ID: ");
-    GetIdFromJson(http.getString(),&sensor_ptr->id);
+      push_have_header = false;
+      push_last_received = now;
+      uint8_t type = push_packet_type >> 4;
+      if (type == 3) {
+        PushHandlePublish(push_packet_type & 0x0F, push_remaining);
+      } else {
+        // the rest only matter for their size, other than the return code in the second byte of a CONNACK
+        uint8_t return_code = 0;
+        for (uint32_t i = 0; i < push_remaining; i++) {
+          int next = push_client.read();
+          if (i == 1) return_code = next;
+        }
+        if (type == 2) { // CONNACK
+          if (return_code != 0) {
+            IOTHUB_ERROR(F("Push broker refused the connection: "), return_code);
+            PushDisconnected();
+            return;
+          }
+          IOTHUB_INFO(F("Push connection established"));
+          push_state = push_connected;
+          push_failed_attempts = 0;
+          PushSubscribe();
+        }
+      }
+    }
 
-    Serial.print(*sensor_ptr->id); Serial.println("///end");
-    //Serial.println( sensor_id );
+    if (push_state == push_awaiting_connack) return;
+    if (now - push_last_sent >= push_keep_alive * 500UL) { // PINGREQ at half the keep alive
+      push_client.write((uint8_t)0xC0);
+      push_client.write((uint8_t)0);
+      push_last_sent = now;
+    }
+  }
 
-    http.end();
+  // starts uploading the queued readings without waiting for the hub, Tick() then advances the request. Does nothing
+  // if a request is already in flight, the readings stay queued until it finishes
+  void StartFlush() {
+    if (reading_queue_count == 0 || hub_state != hub_idle) return;
+    if (flush_remaining == 0) {
+      flush_remaining = reading_queue_count;
+    }
 
-    if (http_code == 200) {
-      WriteId(sensor_ptr->id);
+    const char* url = PrepareUpload();
+    // readings are not retried, a failed upload loses them unless the offline log is enabled
+    if (url == NULL) {
+      AbandonUpload();
+      return;
     }
+
+    StartHubRequest("POST", url, payload_buffer, payload_length, UploadContentType(), NULL, 0);
+    hub_upload_in_flight = true;
   }
 
 public:
@@ -583,102 +3470,258 @@ public:
     iothub_port = tmp_port;
     last_actor_added_index = 0;
     last_sensor_added_index = 0;
+    memset(actor_index, actor_index_empty, sizeof(actor_index));
   };
   // destructor
   ~iotHubLib() {
   };
 
   void Start() {
+#if IOTHUB_LOG_LEVEL > IOTHUB_LOG_NONE
     Serial.begin(115200);
-    WiFi.begin(); // wifi configuration is outside the scope of this lib, use whatever was last used
-
-    Serial.println("Establishing Wifi Connection");
-    while (WiFi.status() != WL_CONNECTED) {
-      delay(1000);
-      Serial.print(".");
+#endif
+    if (deep_sleep_enabled) {
+      rtc_valid = LoadRtcState();
+      hub_bulk_supported = !(rtc_valid && Rtc().batches_refused);
+    }
+    if (rtc_valid && Rtc().ids_cached) {
+      // waking from deep sleep, the radio is only needed if this wake uploads
+      if (Rtc().upload_next_wake) {
+        BeginWifi(); // connects in the background while sensors are sampled
+      } else {
+        WiFi.mode(WIFI_OFF);
+        WiFi.forceSleepBegin();
+        radio_off = true;
+      }
+    } else {
+      IOTHUB_INFO(F("Establishing Wifi Connection"));
+      BeginWifi();
+      WaitForWifi(0);
+      IOTHUB_INFO(F("DONE - Got IP: "), WiFi.localIP());
+    }
+    if (deep_sleep_enabled && !rtc_valid) {
+      memset(&Rtc(), 0, sizeof(rtc_state));
+      Rtc().wifi = wifi; // so the next wake doesn't need EEPROM to reconnect quickly
+      rtc_valid = true;
     }
-    Serial.println();
-    Serial.print("DONE - Got IP: "); Serial.println(WiFi.localIP());
 
-    EEPROM.begin(512); // so we can read / write EEPROM
+    // a deep sleep wake already has its sensor ids in RTC memory
+    if (!(rtc_valid && Rtc().ids_cached)) {
+      LoadIdStore();
+    }
 
-    Serial.print("Using Server: "); Serial.print(iothub_server); Serial.print(" Port: "); Serial.println(iothub_port);
+    IOTHUB_INFO(F("Using Server: "), iothub_server, F(" Port: "), iothub_port);
 
     if (number_actor_ids > 0) {
+      etag_epoch = ESP.random();
       server.begin();
-      Serial.println("Internal Actor Server Started");
+      IOTHUB_INFO(F("Internal Actor Server Started"));
     }
   }
 
   void ClearEeprom() {
+    LoadIdStore();
     // clear eeprom
-    for (int i = 0 ; i < 256 ; i++) {
+    for (uint i = 0 ; i < eeprom_size ; i++) {
       EEPROM.write(i, 0);
     }
     EEPROM.commit();
+    memset(&ids, 0, sizeof(ids));
+    ids_dirty = false;
+    memset(&wifi, 0, sizeof(wifi));
   }
 
   void StartConfig() {};
 
 
-  void Send(uint sensor_index,float sensor_value) {
-      // make sure the sensor value is not something crazy
-      if (!isnormal(sensor_value)) {
-        Serial.println("Sensor was abnormal (infinity, NaN, zero or subnormal) no data sent.");
-        return;
-      };
+  // sets when queued readings are sent, count is the number of readings, bytes the approximate upload size
+  // and age how many ms the oldest reading may wait. Zero bytes or age disables that threshold.
+  void SetFlushThresholds(uint count, uint bytes, unsigned long age) {
+    if (count == 0 || count > reading_queue_length) {
+      count = reading_queue_length;
+    }
+    flush_count = count;
+    flush_bytes = bytes;
+    flush_age = age;
+  }
+
+  // Turns on deep sleep for sensor only nodes, call it before Start(). Each wake samples the sensors, keeps the readings
+  // in RTC memory and sleeps again for sleep_time ms, only bringing wifi up once the buffer is full or the oldest
+  // reading is upload_age ms old. Sensor ids are cached in RTC memory too. GPIO16 has to be wired to RST to wake up.
+  void EnableDeepSleep(unsigned long sleep_time, unsigned long upload_age_ms) {
+    static_assert(number_actor_ids == 0, "deep sleep is only supported on sensor only nodes");
+    static_assert(rtc_reading_length > 0, "too many sensors to fit their ids and a reading buffer in RTC memory");
+    static_assert(sizeof(rtc_state) <= rtc_memory_size, "RTC state is larger than RTC user memory");
+    deep_sleep_enabled = true;
+    sleep_interval = sleep_time;
+    upload_age = upload_age_ms;
+  }
+
+  // Only queues readings of the sensor that differ from the last one queued by more than deadband, or once heartbeat
+  // ms have passed since it (zero disables the heartbeat). Call it after the sensor is registered
+  void SetSensorDeadband(uint sensor_index, float deadband, unsigned long heartbeat = 0) {
+    if (sensor_index >= last_sensor_added_index) return;
+    sensors[sensor_index].deadband = deadband;
+    sensors[sensor_index].heartbeat = heartbeat;
+  }
+
+  // Collects readings of the sensor for window ms and queues them as one reading of their mean, with their min, max
+  // and count. A deadband then applies to the mean. Zero turns the window off
+  void SetSensorWindow(uint sensor_index, unsigned long window) {
+    if (sensor_index >= last_sensor_added_index) return;
+    if (window == 0 && sensors[sensor_index].window_count > 0) {
+      CloseWindow(sensor_index);
+    }
+    sensors[sensor_index].window = window;
+  }
+
+  uint QueuedReadings() {
+    return reading_queue_count;
+  }
+
+  // how long the embedded server took to handle the last request, useful for comparing log levels
+  unsigned long LastRequestMicros() {
+    return last_request_micros;
+  }
+
+  // how many hub requests needed a new connection and how many reused the existing one
+  uint HubConnectionsOpened() {
+    return hub_connections_opened;
+  }
+  uint HubConnectionsReused() {
+    return hub_connections_reused;
+  }
 
-      Serial.print("Sensor "); Serial.print(sensor_index); Serial.print(" value "); Serial.println(sensor_value);
+  // true if one of the actors has this id, the lookup every actor request and push update makes, useful for timing it
+  bool HasActor(const char* actor_id) {
+    return FindActor(actor_id, strlen(actor_id)) != NULL;
+  }
 
-      HTTPClient http;
+  // sends all queued readings to the hub, a single reading uses the per sensor url, more are sent as one batch
+  // waits for the hub, returns true if the readings were accepted. A hub without the batch url is sent them one at a
+  // time, stopping at the first failure
+  bool Flush() {
+    WaitForHubRequest(); // an upload in flight takes its readings off the queue first
+    while (reading_queue_count > 0) {
+      const char* url = PrepareUpload();
+      // readings are not retried, a failed upload loses them unless the offline log is enabled
+      if (url == NULL) {
+        AbandonUpload();
+        return false;
+      }
+      bool batch = uploading_batch;
+      bool uploaded = UploadResult(HubRequest("POST", url, payload_buffer, payload_length, UploadContentType(), NULL, 0));
+      // a refused batch leaves its readings queued to go one at a time
+      if (!uploaded && !(batch && !hub_bulk_supported)) return false;
+    }
+    return true;
+  }
 
-      // generate the URL for sensor
-      String url = "/api/sensors/";
-      url.concat(sensors[sensor_index].id);
-      url.concat("/data");
-      Serial.print("Url: "); Serial.println(url);
-      // Make a HTTP post
-      http.begin(iothub_server,iothub_port, url);
+  // chooses how readings are uploaded, JSON is the default. If the hub rejects CBOR uploads with a 415 the
+  // library falls back to JSON. The embedded actor server answers in CBOR whenever a request accepts it
+  void SetEncoding(iothub_encoding encoding) {
+    upload_encoding = encoding;
+  }
 
-      // prep the json object
-      StaticJsonBuffer<50> jsonBuffer;
-      JsonObject& json_obj = jsonBuffer.createObject();
-      json_obj["value"] = sensor_value;
+  // Keeps readings whose upload fails because the hub can't be reached, is down or has forgotten the node in a ring
+  // log in flash, and uploads them again oldest first once the hub answers. Needs a LittleFS partition and
+  // IOTHUB_OFFLINE_LOG defined before including the library, not used when deep sleeping as those nodes keep failed
+  // readings in RTC memory
+#ifdef IOTHUB_OFFLINE_LOG
+  void EnableOfflineLog() {
+    if (deep_sleep_enabled) return;
+    if (!LittleFS.begin()) {
+      IOTHUB_ERROR(F("Could not mount LittleFS, offline log disabled"));
+      return;
+    }
+    File log_file = OpenOfflineLog();
+    if (!log_file) {
+      IOTHUB_ERROR(F("Could not open the offline log"));
+      return;
+    }
+    bool valid = log_file.read((uint8_t*)&offline_log, sizeof(offline_log)) == sizeof(offline_log) &&
+    offline_log.magic == offline_log_magic &&
+    offline_log.crc == Crc32((uint8_t*)&offline_log + sizeof(offline_log.crc), sizeof(offline_log) - sizeof(offline_log.crc)) &&
+    offline_log.head < offline_log_length && offline_log.count <= offline_log_length;
+    if (!valid) {
+      memset(&offline_log, 0, sizeof(offline_log));
+    }
+    offline_log.boot++;
+    WriteOfflineLogHeader(log_file);
+    log_file.close();
+    offline_log_enabled = true;
+    hub_answered = true; // try replaying straight away, the first failure stops it until the hub answers
+    IOTHUB_INFO(F("Offline log has "), offline_log.count, F(" readings waiting"));
+  }
+#else
+  template<bool offline_log_included = false> void EnableOfflineLog() {
+    static_assert(offline_log_included, "define IOTHUB_OFFLINE_LOG before including iotHubLib.h to use the offline log");
+  }
+#endif
+
+  // Keeps an MQTT connection open to broker and applies actor states published to iothub/actors/<id>/state, as
+  // {"state": ...} in JSON or CBOR, through the same callbacks as the embedded server. Tick() connects once the actors
+  // are registered, and reconnects and subscribes again whenever the connection drops
+  void EnablePushUpdates(const char* broker, uint16_t port = 1883) {
+    push_broker = broker;
+    push_port = port;
+    push_state = push_disconnected;
+  }
 
-      http.addHeader("Content-Type", "application/json"); // important! JSON conversion in nodejs requires this
+  bool PushConnected() {
+    return push_state == push_connected;
+  }
 
-      // add the json to a string
-      String json_string;
-      json_obj.printTo(json_string);// this is great except it seems to be adding quotation marks around what it is sending
-      // then send the json
+  // how long the last wifi connection took to come up, in ms
+  unsigned long WifiConnectMillis() {
+    return wifi_connect_ms;
+  }
 
-      Serial.print("Sending Data: "); Serial.println(json_string);
-      int http_code = http.POST(json_string);
+  uint LoggedReadings() {
+#ifdef IOTHUB_OFFLINE_LOG
+    return offline_log_enabled ? offline_log.count : 0;
+#else
+    return 0;
+#endif
+  }
 
-      // then print the response over Serial
-      Serial.print("Response: "); Serial.println( http.getString() );
-      Serial.print("HTTP Code: "); Serial.println(http_code);Serial.println();
+  // runs callback with the HTTP code of every upload once the hub has answered, or -1 if it could not be reached
+  void SetUploadCallback(void (*callback)(int http_code)) {
+    upload_callback = callback;
+  }
 
-      if (http_code == 404) {
-        Serial.println("Sensor 404'd restarting");
-        // set first boot so that sensors can be registered on next boot
-        // restart and re-register sensors
-        SetFirstBootRestart();
+  // queues a reading, it is sent once one of the flush thresholds is reached. Uploads triggered here don't wait for the
+  // hub, Tick() advances them
+  void Send(uint sensor_index,float sensor_value) {
+      // make sure the sensor value is not something crazy
+      if (!isnormal(sensor_value)) {
+        IOTHUB_WARN(F("Sensor was abnormal (infinity, NaN, zero or subnormal) no data sent."));
+        return;
+      };
+      if (sensor_index >= last_sensor_added_index || sensors[sensor_index].id[0] == 0) {
+        IOTHUB_ERROR(F("Sensor index has not been registered, no data sent."));
+        return;
       }
 
-      http.end();
+      IOTHUB_DEBUG(F("Sensor "), sensor_index, F(" value "), sensor_value);
+
+      if (sensors[sensor_index].window > 0) {
+        AddToWindow(sensor_index, sensor_value);
+      } else {
+        QueueReading(sensor_index, sensor_value, 1, sensor_value, sensor_value);
+      }
   };
 
   bool ActorValidation(const char* actor_name) {
     // do some validation
     // check actor name not too long
     if (strlen(actor_name) > max_node_name_length) {
-      Serial.println("Actor being registered had a name length over that set by max_node_name_length");
+      IOTHUB_ERROR(F("Actor being registered had a name length over that set by max_node_name_length"));
       return true;
     }
     // check that we don't already have too many actors
-    if (last_actor_added_index > number_actor_ids) {
-      Serial.println("Actor being registered was more than the number specified in initialisation.");
+    if (last_actor_added_index >= number_actor_ids) {
+      IOTHUB_ERROR(F("Actor being registered was more than the number specified in initialisation."));
       return true;
     }
     return false;
@@ -686,123 +3729,213 @@ public:
 
   bool SensorValidation(const char* sensor_name) {
     if (strlen(sensor_name) > max_node_name_length) {
-      Serial.println("Sensor being registered had a name length over that set by max_node_name_length");
+      IOTHUB_ERROR(F("Sensor being registered had a name length over that set by max_node_name_length"));
       return true;
     }
     // check that we don't already have too many sensors
-    if (last_sensor_added_index > number_sensor_ids) {
-      Serial.println("Sensor being registered was more than the number specified in initialisation.");
+    if (last_sensor_added_index >= number_sensor_ids) {
+      IOTHUB_ERROR(F("Sensor being registered was more than the number specified in initialisation."));
       return true;
     }
     return false;
   }
 
-  // this function tests to see if all the specified sensors and actors were registered, if so it unsets the first boot bit
-  void CheckAllRegistered() {
-    if (CheckFirstBoot()) {
-      if (last_actor_added_index == number_actor_ids &&
-      last_sensor_added_index == number_sensor_ids) {
-        Serial.println("All sensors and actors registered, unsetting first boot bit.");
-        UnsetFirstBoot();
+  // Registers every declared node the hub doesn't know yet. Stored ids are validated in one request, then every node
+  // without an id is registered in one more (or a few if they don't fit in one). New ids are saved with a single commit.
+  // Runs once every node has been declared, and Tick() runs it if fewer were declared or some nodes failed to register
+  void CompleteRegistration() {
+    registration_attempted = true;
+    last_registration_attempt = IOTHUB_MILLIS();
+
+    // a deep sleep wake has its ids from RTC memory, they were validated when first cached
+    bool ids_from_rtc = deep_sleep_enabled && Rtc().ids_cached;
+    if (!ids_from_rtc && !ids_validated) {
+      if (!hub_bulk_supported || !ValidateStoredIds()) {
+        hub_bulk_supported = false;
+        ValidateStoredIdsEach();
       }
+      ids_validated = true;
+    }
+    if (!hub_bulk_supported || !RegisterPendingNodes()) {
+      hub_bulk_supported = false;
+      RegisterPendingNodesEach();
     }
-  }
 
-  void RegisterActor(const char* actor_name ,void (*function_pointer)(int)) {
-    if (ActorValidation(actor_name)) return;
-    Serial.println("Int actor being registered");
-    actor new_actor;
-    new_actor.name = actor_name;
-    new_actor.state_type = actor::is_int;
-    new_actor.on_update.icallback = function_pointer;
-    if (CheckFirstBoot()) {
-      Serial.println("First boot, registering");
-      BaseRegisterActor(&new_actor,"number");
-    } else {
-      Serial.println("Not first boot, loading ids from eeprom");
-      ReadId(new_actor.id);
-      // if previously stored actor is not registered then set as first boot
-      if (!CheckActorRegistered(new_actor.id)) {
-        Serial.println("Actor loaded from memory has expired, reobtaining ids");
-        SetFirstBootRestart();
+    // sensor urls and the actor index both depend on the ids
+    registration_complete = true;
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      SetSensorUrl(&sensors[i]);
+      if (sensors[i].id[0] == 0) registration_complete = false;
+    }
+    memset(actor_index, actor_index_empty, sizeof(actor_index));
+    for (uint i = 0; i < last_actor_added_index; i++) {
+      if (actors[i].id[0] == 0) {
+        registration_complete = false;
+      } else {
+        IndexActor(i);
       }
     }
-    actors[last_actor_added_index] = new_actor;
-    last_actor_added_index++;
-    CheckAllRegistered();
+    if (ids_dirty) {
+      SaveIdStore();
+    }
+    ActorStatesChanged(); // ids may have changed
+    if (registration_complete && registered_after_ms == 0) {
+      registered_after_ms = IOTHUB_MILLIS();
+    }
   }
-  void RegisterActor(const char* actor_name ,void (*function_pointer)(bool)) {
-    if (ActorValidation(actor_name)) return;
-    Serial.println("Bool actor being registered");
-    actor new_actor;
-    new_actor.name = actor_name;
-    new_actor.state_type = actor::is_bool;
-    new_actor.on_update.bcallback = function_pointer;
-    if (CheckFirstBoot()) {
-      Serial.println("First boot, registering");
-      BaseRegisterActor(&new_actor,"boolean");
-    } else {
-      Serial.println("Not first boot, loading ids from eeprom");
-      ReadId(new_actor.id);
-      // if previously stored actor is not registered then set as first boot
-      if (!CheckActorRegistered(new_actor.id)) {
-        Serial.println("Actor loaded from memory has expired, reobtaining ids");
-        SetFirstBootRestart();
-      }
+
+  // registers everything once the last node has been declared, nodes only load their stored id when declared
+  void DeclaredNode() {
+    if (last_actor_added_index == number_actor_ids && last_sensor_added_index == number_sensor_ids) {
+      CompleteRegistration();
     }
-    actors[last_actor_added_index] = new_actor;
+  }
+
+  // the state type of an actor comes from its callback, which picks the actor_type_info used to handle it
+  template<typename T> void RegisterTypedActor(const char* actor_name, void (*function_pointer)(T)) {
+    if (ActorValidation(actor_name)) return;
+    actor* new_actor = &actors[last_actor_added_index];
+    new_actor->name = actor_name;
+    new_actor->type = &actor_type<T>::info;
+    actor_state<T>::State(new_actor) = T();
+    actor_state<T>::Callback(new_actor) = function_pointer;
+    new_actor->id[0] = 0;
+    ReadId(ActorKey(new_actor), last_sensor_added_index + last_actor_added_index, new_actor->id);
     last_actor_added_index++;
-    CheckAllRegistered();
+    ActorStatesChanged();
+    DeclaredNode();
+  }
+  void RegisterActor(const char* actor_name ,void (*function_pointer)(int)) {
+    IOTHUB_DEBUG(F("Int actor being registered"));
+    RegisterTypedActor(actor_name, function_pointer);
+  }
+  void RegisterActor(const char* actor_name ,void (*function_pointer)(float)) {
+    IOTHUB_DEBUG(F("Float actor being registered"));
+    RegisterTypedActor(actor_name, function_pointer);
+  }
+  void RegisterActor(const char* actor_name ,void (*function_pointer)(bool)) {
+    IOTHUB_DEBUG(F("Bool actor being registered"));
+    RegisterTypedActor(actor_name, function_pointer);
   }
 
   void AddDummyActors(void (*function_pointer)(int)) {
+    memset(actor_index, actor_index_empty, sizeof(actor_index));
     // add as many actors as we have space for
     for (uint i = 0; i < number_actor_ids; i++) {
       actors[i].name = "Dummy actor name";
-      char id[25] = "54tr65e4rsr2d3t57q9t3a1h";
+      char id[25] = "54a265e4b5f2d3e57c9f3a1d";
       strncpy(actors[i].id,id,25);
 
-      actors[i].state_type = actor::is_int;
+      actors[i].type = &actor_type<int>::info;
       actors[i].state.istate = 10;
       actors[i].on_update.icallback = function_pointer;
+      IndexActor(i);
     }
+    last_actor_added_index = number_actor_ids;
+    registration_complete = true; // dummy actors are never registered with the hub
+    ActorStatesChanged();
   }
 
 
   void RegisterSensor(const char* sensor_name, const char* data_type) {
     if (SensorValidation(sensor_name)) return;
-    sensor new_sensor;
-    new_sensor.name = sensor_name;
-    if (CheckFirstBoot()) {
-      Serial.println("First boot, registering");
-      BaseRegisterSensor(&new_sensor,data_type);
+    sensor* new_sensor = &sensors[last_sensor_added_index];
+    new_sensor->name = sensor_name;
+    new_sensor->data_type_name = data_type;
+    new_sensor->read_callback = NULL;
+    new_sensor->deadband = 0;
+    new_sensor->heartbeat = 0;
+    new_sensor->has_queued = false;
+    new_sensor->window = 0;
+    new_sensor->window_count = 0;
+    new_sensor->id[0] = 0;
+    if (deep_sleep_enabled && Rtc().ids_cached) {
+      UnpackId(Rtc().packed_ids[last_sensor_added_index], new_sensor->id);
     } else {
-      Serial.println("Not first boot, loading ids from eeprom");
-      ReadId(new_sensor.id);
+      ReadId(SensorKey(new_sensor), last_sensor_added_index + last_actor_added_index, new_sensor->id);
+    }
+    last_sensor_added_index++; // increment last sensor added
+    DeclaredNode();
+  }
+
+  // registers a sensor that Tick() samples by calling read_callback every period ms, starting on the next Tick()
+  void RegisterSensor(const char* sensor_name, const char* data_type, float (*read_callback)(), unsigned long period) {
+    uint sensor_index = last_sensor_added_index;
+    RegisterSensor(sensor_name, data_type);
+    if (last_sensor_added_index == sensor_index) return; // registration was rejected
+
+    sensors[sensor_index].read_callback = read_callback;
+    sensors[sensor_index].period = period;
+    sensors[sensor_index].next_due = IOTHUB_MILLIS();
+    scheduled_sensor_count++;
+  }
+
+  // how many ms until Tick() next has a sensor to sample or readings to flush
+  unsigned long TimeUntilNextJob() {
+    if (hub_state != hub_idle) return 1; // keep polling the request in flight
+    unsigned long now = IOTHUB_MILLIS();
+    unsigned long wait = sleep_interval;
+    for (uint i = 0; i < last_sensor_added_index; i++) {
+      if (sensors[i].read_callback == NULL) continue;
+      if (Reached(now, sensors[i].next_due)) return 0;
+      if (sensors[i].next_due - now < wait) wait = sensors[i].next_due - now;
+    }
+    if (reading_queue_count > 0 && flush_age > 0) {
+      unsigned long flush_deadline = reading_queue[0].sample_time + flush_age;
+      if (Reached(now, flush_deadline)) return 0;
+      if (flush_deadline - now < wait) wait = flush_deadline - now;
     }
-    sensors[last_sensor_added_index] = new_sensor;
-    last_sensor_added_index++; // increment last actor added
-    CheckAllRegistered();
+    return wait;
   }
 
+  // runs whatever is due and returns, nodes with actors return straight away so the actor server is polled every loop().
+  // Sensor only nodes wait for the next due sensor instead, or for sleep_interval if they call Send() themselves.
   void Tick() {
+    if (!registration_complete &&
+    (!registration_attempted || Reached(IOTHUB_MILLIS(), last_registration_attempt + registration_retry_interval))) {
+      CompleteRegistration();
+    }
+    StepHubRequest();
+    StepPushConnection();
+    RunDueSensors();
+    CloseDueWindows();
+
+    if (deep_sleep_enabled) {
+      DeepSleepCycle();
+      return;
+    }
+
+    // send any readings that have waited longer than the age threshold
+    if (FlushDue()) {
+      StartFlush();
+    }
+    ReplayOfflineLog();
+
     if (number_actor_ids > 0) {
       CheckConnections();
-      delay(20);
     }
-    // disable wifi while sleeping
-    //WiFi.forceSleepBegin();
+    else if (scheduled_sensor_count > 0) {
+      IOTHUB_DELAY(TimeUntilNextJob()); // note that delay has built in calls to yeild() :)
+    }
     else if (number_sensor_ids > 0) {
-      delay(sleep_interval); // note that delay has built in calls to yeild() :)
+      WaitForHubRequest();
+      IOTHUB_DELAY(sleep_interval);
     }
-
-    //unsigned long time_wifi_starting = millis();
-    // re-enble wifi after sleeping
-    //WiFi.forceSleepWake();
-
-    //Serial.print("Wifi status: "); Serial.println(WiFi.status());
-
-    //unsigned long time_wifi_started = millis();
-    //Serial.print("Time taken to reconnect to wifi: "); Serial.println( time_wifi_started - time_wifi_starting );
   }
 };
+
+template<const uint number_sensor_ids,const uint number_actor_ids>
+constexpr uint32_t iotHubLib<number_sensor_ids,number_actor_ids>::upload_time_bounds[histogram_buckets];
+template<const uint number_sensor_ids,const uint number_actor_ids>
+constexpr uint32_t iotHubLib<number_sensor_ids,number_actor_ids>::request_time_bounds[histogram_buckets];
+
+template<const uint number_sensor_ids,const uint number_actor_ids>
+const typename iotHubLib<number_sensor_ids,number_actor_ids>::route iotHubLib<number_sensor_ids,number_actor_ids>::routes[route_count] = {
+  {Request::GET, "actors", &iotHubLib::GetActorsHandler},
+  {Request::POST, "actors", &iotHubLib::PostActorStatesHandler},
+  {Request::GET, "metrics", &iotHubLib::GetMetricsHandler},
+  {Request::GET, "actors/:id", &iotHubLib::GetActorHandler},
+  {Request::POST, "actors/:id", &iotHubLib::PostActorStateHandler},
+};
+
+#endif